@@ -9,7 +9,9 @@
 #include "sr_arpcache.h"
 #include "sr_router.h"
 #include "sr_if.h"
+#include "sr_rt.h"
 #include "sr_protocol.h"
+#include "sr_flowcache.h"
 
 /* 
   This function gets called every second. For each request sent out, we keep
@@ -26,14 +28,13 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req){
     printf("ip of req that needs sending %lu\n", ntohl(req->ip));
     req->times_sent++;
     req->sent = time(NULL);
-    printf("outgoing interface of arp %s times sent %d\n", req->packets->iface, req->times_sent);
+    printf("outgoing interface of arp %s times sent %d\n", req->packets->iface->name, req->times_sent);
     send_arprequest(sr, req->ip, req->packets->iface);
 
 }
 
 void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
 
-    struct sr_if* iface = 0;
     struct sr_arpcache *cache = &(sr->cache);
     char outgoing_iface[sr_IFACE_NAMELEN];
     time_t curtime = time(NULL);
@@ -46,8 +47,7 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
 
             struct sr_packet *pkt, *nxt;
             for (pkt = req->packets; pkt; pkt = nxt) {
-                iface = sr_get_interface(sr, pkt->iface);
-                handle_icmp(sr, pkt->buf, pkt->len, iface, 3, 1);
+                handle_icmp(sr, pkt->buf, pkt->len, pkt->iface, 3, 1);
                 nxt = pkt->next;
             }
             sr_arpreq_destroy(cache, req);
@@ -98,7 +98,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       struct sr_if *iface)
 {
     pthread_mutex_lock(&(cache->lock));
     
@@ -125,8 +125,7 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
         new_pkt->buf = (uint8_t *)malloc(packet_len);
         memcpy(new_pkt->buf, packet, packet_len);
         new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+        new_pkt->iface = iface;
         new_pkt->next = req->packets;
         req->packets = new_pkt;
     }
@@ -210,8 +209,6 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             nxt = pkt->next;
             if (pkt->buf)
                 free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
             free(pkt);
         }
         
@@ -275,12 +272,19 @@ void *sr_arpcache_timeout(void *sr_ptr) {
         for (i = 0; i < SR_ARPCACHE_SZ; i++) {
             if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
                 cache->entries[i].valid = 0;
+                /* cached flows may carry this MAC */
+                sr_flowcache_invalidate(sr->flows);
             }
         }
         
+        /* the ICMP for requests that gave up looks up routes */
+        sr_epoch_enter(&(sr->rt_epoch));
         sr_arpcache_sweepreqs(sr);
+        sr_epoch_exit(&(sr->rt_epoch));
 
         pthread_mutex_unlock(&(cache->lock));
+
+        sr_rt_periodic(sr);
     }
     
     return NULL;
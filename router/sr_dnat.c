@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sr_dnat.h"
+
+#define SR_DNAT_MIN_RULES 16
+
+static uint32_t sr_dnat_int_hash(const void *entry) {
+  const struct sr_dnat_rule *r = entry;
+  return sr_hash_mix32(r->ip_int ^ sr_hash_mix32(r->aux_int));
+}
+
+static int sr_dnat_int_match(const void *entry, const void *key) {
+  const struct sr_dnat_rule *r = entry, *k = key;
+  return r->ip_int == k->ip_int && r->aux_int == k->aux_int;
+}
+
+/* Parses a port number, 1..65535, ending at end. Returns -1 if s is not
+   one. */
+static int sr_dnat_port(const char *s, char **end) {
+  unsigned long port;
+
+  if (*s < '0' || *s > '9') {
+    return -1;
+  }
+  port = strtoul(s, end, 10);
+  return port >= 1 && port <= 65535 ? (int) port : -1;
+}
+
+/* Splits "ip:rest" (or just "rest" if ip_opt) into the address and the text
+   after the colon. Returns 0 on success. */
+static int sr_dnat_addr(char *s, int ip_opt, uint32_t *ip, char **rest) {
+  char *colon = strchr(s, ':');
+  struct in_addr addr;
+
+  if (colon == NULL) {
+    *ip = 0;
+    *rest = s;
+    return ip_opt ? 0 : -1;
+  }
+  *colon = '\0';
+  if (inet_aton(s, &addr) == 0 || addr.s_addr == 0) {
+    return -1;
+  }
+  *ip = addr.s_addr;
+  *rest = colon + 1;
+  return 0;
+}
+
+/* Parses one rules line into *first (and *last - *first more ports).
+   Returns 1 for a rule, 0 for a blank or comment line, -1 for garbage. */
+static int sr_dnat_parse(char *line, struct sr_dnat_rule *first, int *last) {
+  char proto[16], ext[64], in[64], extra[2];
+  char *rest, *end;
+  int n, lo, port;
+
+  if ((end = strchr(line, '#'))) {
+    *end = '\0';
+  }
+  n = sscanf(line, "%15s %63s %63s %1s", proto, ext, in, extra);
+  if (n <= 0) {
+    return 0;
+  }
+  if (n != 3 || strcmp(proto, "tcp") != 0) {
+    return -1;
+  }
+  if (sr_dnat_addr(ext, 1, &(first->ip_ext), &rest) != 0 ||
+      (lo = sr_dnat_port(rest, &end)) < 0) {
+    return -1;
+  }
+  *last = lo;
+  if (*end == '-' && ((*last = sr_dnat_port(end + 1, &end)) < lo)) {
+    return -1;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  if (sr_dnat_addr(in, 0, &(first->ip_int), &rest) != 0 ||
+      (port = sr_dnat_port(rest, &end)) < 0 || *end != '\0' ||
+      port + (*last - lo) > 65535) {
+    return -1;
+  }
+  first->aux_ext = (uint16_t) lo;
+  first->aux_int = (uint16_t) port;
+  return 1;
+}
+
+struct sr_dnat *sr_dnat_load(const char *path) {
+  struct sr_dnat *d;
+  struct sr_dnat_rule rule, *r;
+  uint32_t size = SR_DNAT_MIN_RULES, i;
+  char line[BUFSIZ];
+  int lineno = 0, last, port, err = 0;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    perror(path);
+    return NULL;
+  }
+  d = (struct sr_dnat *) calloc(1, sizeof(struct sr_dnat));
+  if (d == NULL || (d->rules = (struct sr_dnat_rule *) malloc(size * sizeof(*r))) == NULL) {
+    free(d);
+    fclose(fp);
+    return NULL;
+  }
+
+  while (!err && fgets(line, sizeof(line), fp)) {
+    lineno++;
+    switch (sr_dnat_parse(line, &rule, &last)) {
+      case 0:
+        continue;
+      case -1:
+        fprintf(stderr, "Error loading DNAT rules, %s:%d does not parse\n", path, lineno);
+        err = 1;
+        continue;
+    }
+    for (port = rule.aux_ext; port <= last && !err; port++) {
+      if (d->by_ext[port]) {
+        fprintf(stderr, "Error loading DNAT rules, %s:%d: port %d is already forwarded\n",
+          path, lineno, port);
+        err = 1;
+        break;
+      }
+      if (d->nrules == size) {
+        r = (struct sr_dnat_rule *) realloc(d->rules, 2 * size * sizeof(*r));
+        if (r == NULL) {
+          err = 1;
+          break;
+        }
+        d->rules = r;
+        size *= 2;
+      }
+      r = &(d->rules[d->nrules++]);
+      r->ip_ext = rule.ip_ext;
+      r->ip_int = rule.ip_int;
+      r->aux_ext = (uint16_t) port;
+      r->aux_int = (uint16_t)(rule.aux_int + (port - rule.aux_ext));
+      d->by_ext[port] = (uint16_t) d->nrules;
+    }
+  }
+  fclose(fp);
+
+  /* the rules array has stopped moving; index the internal endpoints */
+  if (!err && sr_hash_init(&(d->by_int), d->nrules, sr_dnat_int_hash, NULL) != 0) {
+    err = 1;
+  }
+  for (i = 0; !err && i < d->nrules; i++) {
+    r = &(d->rules[i]);
+    if (sr_hash_find(&(d->by_int), sr_dnat_int_hash(r), r, sr_dnat_int_match)) {
+      fprintf(stderr, "Error loading DNAT rules, %s: two rules forward to the same internal port %u\n",
+        path, r->aux_int);
+      err = 1;
+    }
+    else if (sr_hash_insert(&(d->by_int), r) != 0) {
+      err = 1;
+    }
+  }
+  if (err) {
+    sr_dnat_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void sr_dnat_free(struct sr_dnat *d) {
+  if (d == NULL) {
+    return;
+  }
+  sr_hash_destroy(&(d->by_int));
+  free(d->rules);
+  free(d);
+}
+
+const struct sr_dnat_rule *sr_dnat_find_ext(const struct sr_dnat *d, uint32_t ip_ext,
+  uint16_t aux_ext) {
+  const struct sr_dnat_rule *r;
+
+  if (d->by_ext[aux_ext] == 0) {
+    return NULL;
+  }
+  r = &(d->rules[d->by_ext[aux_ext] - 1]);
+  return r->ip_ext == 0 || r->ip_ext == ip_ext ? r : NULL;
+}
+
+const struct sr_dnat_rule *sr_dnat_find_int(struct sr_dnat *d, uint32_t ip_int,
+  uint16_t aux_int) {
+  struct sr_dnat_rule key;
+
+  key.ip_int = ip_int;
+  key.aux_int = aux_int;
+  return sr_hash_find(&(d->by_int), sr_dnat_int_hash(&key), &key, sr_dnat_int_match);
+}
@@ -0,0 +1,58 @@
+/* Static port forwarding (DNAT) rules for the NAT.
+
+   A rules file sends fixed external TCP ports to fixed internal endpoints,
+   so servers behind the NAT can be reached without a dynamic mapping. One
+   rule per line, '#' starts a comment:
+
+     tcp  80                      10.0.1.100:8080
+     tcp  203.0.113.5:6000-6009   10.0.1.101:6000
+
+   The external side is a port or an inclusive range, optionally on one
+   external address; without one the rule applies on every address of the
+   NAT. A range maps onto as many consecutive internal ports. An external
+   port can be forwarded by one rule only, whatever its address.
+
+   Rules are compiled into a table indexed directly by external port, so an
+   inbound packet is translated with one array access, and a hash on the
+   internal endpoint for the replies. A compiled table is never changed:
+   a reload builds a new one and the NAT swaps it in, so lookups need no
+   lock, only an epoch section while they use the table. */
+
+#ifndef SR_DNAT_H
+#define SR_DNAT_H
+
+#include <inttypes.h>
+#include "sr_epoch.h"
+#include "sr_hash.h"
+
+/* One external port; a range rule becomes one of these per port. */
+struct sr_dnat_rule {
+  uint32_t ip_ext;      /* network byte order; 0: any external address */
+  uint32_t ip_int;
+  uint16_t aux_ext;     /* host byte order */
+  uint16_t aux_int;
+};
+
+struct sr_dnat {
+  struct sr_epoch_entry retire;
+  uint16_t by_ext[65536]; /* external port -> rules index + 1, 0: none */
+  struct sr_hash by_int;  /* keyed on (ip_int, aux_int) */
+  uint32_t nrules;
+  struct sr_dnat_rule *rules;
+};
+
+/* Reads and compiles the rules in path. Reports the first bad line on
+   stderr and returns NULL if the file cannot be read, a line does not
+   parse, or two rules claim the same external port or internal endpoint. */
+struct sr_dnat *sr_dnat_load(const char *path);
+void sr_dnat_free(struct sr_dnat *d);
+
+/* The rule for external port aux_ext on address ip_ext, or NULL. */
+const struct sr_dnat_rule *sr_dnat_find_ext(const struct sr_dnat *d, uint32_t ip_ext,
+  uint16_t aux_ext);
+
+/* The rule forwarding to internal endpoint ip_int:aux_int, or NULL. */
+const struct sr_dnat_rule *sr_dnat_find_int(struct sr_dnat *d, uint32_t ip_int,
+  uint16_t aux_int);
+
+#endif
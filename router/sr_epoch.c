@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sr_epoch.h"
+
+int sr_epoch_init(struct sr_epoch *e) {
+  memset(e->limbo, 0, sizeof(e->limbo));
+  e->global = 0;
+  e->threads = NULL;
+  if (pthread_key_create(&(e->key), NULL) != 0) {
+    return -1;
+  }
+  return pthread_mutex_init(&(e->lock), NULL);
+}
+
+static void sr_epoch_free_list(struct sr_epoch_entry *entry) {
+  struct sr_epoch_entry *next;
+  for (; entry; entry = next) {
+    next = entry->next;
+    entry->free_fn(entry, entry->arg);
+  }
+}
+
+void sr_epoch_destroy(struct sr_epoch *e) {
+  struct sr_epoch_thread *t, *next;
+  int i;
+
+  pthread_mutex_lock(&(e->lock));
+  for (i = 0; i < SR_EPOCH_LISTS; i++) {
+    sr_epoch_free_list(e->limbo[i]);
+    e->limbo[i] = NULL;
+  }
+  for (t = e->threads; t; t = next) {
+    next = t->next;
+    free(t);
+  }
+  e->threads = NULL;
+  pthread_mutex_unlock(&(e->lock));
+  pthread_key_delete(e->key);
+  pthread_mutex_destroy(&(e->lock));
+}
+
+/* This thread's record, registered on first use. A thread without one
+   could neither read safely nor hold reclamation back, and the packet
+   path has no way to report the failure, so running out of memory here
+   ends the process like a failed allocation at startup does. */
+static struct sr_epoch_thread *sr_epoch_self(struct sr_epoch *e) {
+  struct sr_epoch_thread *t = pthread_getspecific(e->key);
+
+  if (t == NULL) {
+    t = (struct sr_epoch_thread *) calloc(1, sizeof(struct sr_epoch_thread));
+    if (t == NULL) {
+      fprintf(stderr, "Cannot allocate an epoch thread record\n");
+      exit(1);
+    }
+    pthread_mutex_lock(&(e->lock));
+    t->next = e->threads;
+    e->threads = t;
+    pthread_mutex_unlock(&(e->lock));
+    pthread_setspecific(e->key, t);
+  }
+  return t;
+}
+
+void sr_epoch_enter(struct sr_epoch *e) {
+  struct sr_epoch_thread *t = sr_epoch_self(e);
+
+  if (t->depth++ == 0) {
+    __atomic_store_n(&(t->epoch), __atomic_load_n(&(e->global), __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&(t->active), 1, __ATOMIC_RELAXED);
+    /* the reclaimer must see us active before we read any shared pointer */
+    __sync_synchronize();
+  }
+}
+
+void sr_epoch_exit(struct sr_epoch *e) {
+  struct sr_epoch_thread *t = pthread_getspecific(e->key);
+
+  if (--t->depth == 0) {
+    __atomic_store_n(&(t->active), 0, __ATOMIC_RELEASE);
+  }
+}
+
+void sr_epoch_retire(struct sr_epoch *e, struct sr_epoch_entry *entry,
+                     sr_epoch_free_fn free_fn, void *arg) {
+  unsigned long slot;
+
+  entry->free_fn = free_fn;
+  entry->arg = arg;
+  pthread_mutex_lock(&(e->lock));
+  slot = e->global % SR_EPOCH_LISTS;
+  entry->next = e->limbo[slot];
+  e->limbo[slot] = entry;
+  pthread_mutex_unlock(&(e->lock));
+}
+
+void sr_epoch_reclaim(struct sr_epoch *e) {
+  struct sr_epoch_thread *t;
+  struct sr_epoch_entry *done;
+  unsigned long global;
+
+  pthread_mutex_lock(&(e->lock));
+  __sync_synchronize();
+  global = e->global;
+  for (t = e->threads; t; t = t->next) {
+    if (__atomic_load_n(&(t->active), __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&(t->epoch), __ATOMIC_RELAXED) != global) {
+      /* a reader is still in an older epoch */
+      pthread_mutex_unlock(&(e->lock));
+      return;
+    }
+  }
+
+  /* readers are all in 'global' or idle, so the list about to be reused,
+     retired two epochs back, is unreachable */
+  global++;
+  __atomic_store_n(&(e->global), global, __ATOMIC_RELEASE);
+  done = e->limbo[global % SR_EPOCH_LISTS];
+  e->limbo[global % SR_EPOCH_LISTS] = NULL;
+  pthread_mutex_unlock(&(e->lock));
+
+  sr_epoch_free_list(done);
+}
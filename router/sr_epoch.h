@@ -0,0 +1,79 @@
+/* Epoch-based reclamation for lock-free readers.
+
+   Readers bracket every access to shared structures with sr_epoch_enter()
+   and sr_epoch_exit() and never block. Writers still serialize among
+   themselves (with their own lock), unlink an object so no new reader can
+   reach it, and then hand it to sr_epoch_retire() instead of freeing it.
+   The object is freed once every thread that could still hold a reference
+   has left its read-side section.
+
+   The global epoch only advances when every thread currently inside a read
+   section has observed the current epoch; anything retired two epochs ago
+   is then unreachable and its free function is called. sr_epoch_reclaim()
+   drives this and is meant to be called periodically (the NAT calls it from
+   its timeout thread).
+
+   Retired objects embed a struct sr_epoch_entry, so retiring does not
+   allocate. */
+
+#ifndef SR_EPOCH_H
+#define SR_EPOCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SR_EPOCH_LISTS 3
+
+struct sr_epoch_entry;
+
+typedef void (*sr_epoch_free_fn)(struct sr_epoch_entry *entry, void *arg);
+
+struct sr_epoch_entry {
+  struct sr_epoch_entry *next;
+  sr_epoch_free_fn free_fn;
+  void *arg;                /* handed back to free_fn, e.g. the owning pool */
+};
+
+/* One per thread that has ever entered a read section. */
+struct sr_epoch_thread {
+  unsigned long epoch;      /* global epoch seen on entry */
+  int active;               /* inside a read section */
+  int depth;                /* nesting of enter/exit */
+  struct sr_epoch_thread *next;
+};
+
+struct sr_epoch {
+  unsigned long global;
+  struct sr_epoch_thread *threads;
+  struct sr_epoch_entry *limbo[SR_EPOCH_LISTS]; /* retired, by epoch % 3 */
+  pthread_key_t key;        /* this thread's sr_epoch_thread */
+  pthread_mutex_t lock;     /* thread list and limbo lists */
+};
+
+int sr_epoch_init(struct sr_epoch *e);
+
+/* Frees everything still in limbo. No reader may be active. */
+void sr_epoch_destroy(struct sr_epoch *e);
+
+/* Read-side section. May nest. */
+void sr_epoch_enter(struct sr_epoch *e);
+void sr_epoch_exit(struct sr_epoch *e);
+
+/* Defers free_fn(entry, arg) until no reader can still see the object. */
+void sr_epoch_retire(struct sr_epoch *e, struct sr_epoch_entry *entry,
+                     sr_epoch_free_fn free_fn, void *arg);
+
+/* Advances the epoch if every active reader has caught up and frees what
+   became unreachable. */
+void sr_epoch_reclaim(struct sr_epoch *e);
+
+/* Recovers the retired object from its embedded entry. */
+#define SR_EPOCH_OWNER(entry, type, member) \
+  ((type *)((char *)(entry) - offsetof(type, member)))
+
+/* Stores that publish a fully initialized object to readers, and the loads
+   readers use to pick them up. */
+#define SR_PUBLISH(ptr, val) __atomic_store_n(&(ptr), (val), __ATOMIC_RELEASE)
+#define SR_CONSUME(ptr)      __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+
+#endif
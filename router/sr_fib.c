@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "sr_fib.h"
+
+#define SR_FIB_LEAF 0x80000000u /* direct table entry holds a leaf value */
+#define SR_FIB_FANOUT (1 << SR_FIB_STRIDE)
+#define SR_FIB_CHUNK 0x8000     /* tbl24 entry holds a chunk number */
+
+/* Binary trie of the routes, the form the FIB is compiled from. Node 0 is
+   the root, so a child index of 0 means no child. */
+struct sr_fib_trie {
+  uint32_t child[2];
+  uint32_t value;     /* leaf value of the route for exactly this prefix */
+};
+
+struct sr_fib_builder;
+
+/* Called by sr_fib_expand() for each entry of the table it fills: t is the
+   trie node standing at that entry if it has longer prefixes below, else 0,
+   and best the longest match at the entry. */
+typedef int (*sr_fib_emit_fn)(struct sr_fib_builder *b, uint32_t index, uint32_t t,
+  uint32_t best);
+
+struct sr_fib_builder {
+  struct sr_fib *fib;
+  uint32_t chunk;     /* DIR-24-8 chunk being filled */
+  struct sr_fib_trie *trie;
+  uint32_t ntrie;
+  uint32_t trie_size;
+  uint32_t nodes_size;
+  uint32_t leaves_size;
+  uint32_t tbl8_size;
+  uint32_t nexthops_size;
+  uint32_t *nh_hash;  /* open addressing: nexthops index + 1, 0 empty */
+  uint32_t nh_buckets;
+};
+
+/* Makes room for need elements of elem bytes in *array, which holds *size.
+   Returns 0 on success. */
+static int sr_fib_grow(void **array, uint32_t *size, uint32_t need, size_t elem) {
+  uint32_t n = *size ? *size : 256;
+  void *p;
+
+  if (need <= *size) {
+    return 0;
+  }
+  while (n < need) {
+    n *= 2;
+  }
+  if ((p = realloc(*array, (size_t) n * elem)) == NULL) {
+    return -1;
+  }
+  *array = p;
+  *size = n;
+  return 0;
+}
+
+/* Count of leading one bits of mask (network byte order). */
+static int sr_fib_prefix_len(uint32_t mask) {
+  uint32_t m = ntohl(mask);
+  int len = 0;
+
+  while (len < 32 && (m & (0x80000000u >> len))) {
+    len++;
+  }
+  return len;
+}
+
+static uint32_t sr_fib_nh_hash(const struct sr_fib_builder *b, struct sr_if *iface,
+  uint32_t gw) {
+  uint32_t h = gw ^ (uint32_t)(uintptr_t) iface ^ (uint32_t)((uint64_t)(uintptr_t) iface >> 32);
+
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
+  return h & (b->nh_buckets - 1);
+}
+
+/* Leaf value of the next hop (iface, gw), added if new. Returns 0 if out of
+   memory. */
+static uint32_t sr_fib_nexthop(struct sr_fib_builder *b, struct sr_if *iface, uint32_t gw) {
+  struct sr_fib *fib = b->fib;
+  struct sr_nexthop *nh;
+  uint32_t i, *old, n;
+
+  for (i = sr_fib_nh_hash(b, iface, gw); b->nh_hash[i]; i = (i + 1) & (b->nh_buckets - 1)) {
+    nh = &(fib->nexthops[b->nh_hash[i] - 1]);
+    if (nh->iface == iface && nh->gw.s_addr == gw) {
+      return b->nh_hash[i];
+    }
+  }
+  if (sr_fib_grow((void **) &(fib->nexthops), &(b->nexthops_size), fib->nnexthops + 1,
+      sizeof(struct sr_nexthop)) != 0) {
+    return 0;
+  }
+  nh = &(fib->nexthops[fib->nnexthops++]);
+  nh->iface = iface;
+  nh->gw.s_addr = gw;
+  b->nh_hash[i] = fib->nnexthops;
+
+  /* keep the hash at most half full */
+  if (2 * fib->nnexthops > b->nh_buckets) {
+    old = b->nh_hash;
+    n = b->nh_buckets;
+    if ((b->nh_hash = (uint32_t *) calloc(2 * n, sizeof(uint32_t))) == NULL) {
+      b->nh_hash = old;
+      return 0;
+    }
+    b->nh_buckets = 2 * n;
+    for (i = 0; i < fib->nnexthops; i++) {
+      nh = &(fib->nexthops[i]);
+      for (n = sr_fib_nh_hash(b, nh->iface, nh->gw.s_addr); b->nh_hash[n];
+           n = (n + 1) & (b->nh_buckets - 1)) {
+      }
+      b->nh_hash[n] = i + 1;
+    }
+    free(old);
+  }
+  return fib->nnexthops;
+}
+
+/* Puts route value (its leaf value) in the binary trie. */
+static int sr_fib_trie_insert(struct sr_fib_builder *b, struct sr_rt *rt, uint32_t value) {
+  uint32_t key = ntohl(rt->dest.s_addr), t = 0, bit;
+  int len = sr_fib_prefix_len(rt->mask.s_addr), d;
+
+  for (d = 0; d < len; d++) {
+    bit = (key >> (31 - d)) & 1;
+    if (b->trie[t].child[bit] == 0) {
+      if (sr_fib_grow((void **) &(b->trie), &(b->trie_size), b->ntrie + 1,
+          sizeof(struct sr_fib_trie)) != 0) {
+        return -1;
+      }
+      memset(&(b->trie[b->ntrie]), 0, sizeof(struct sr_fib_trie));
+      b->trie[t].child[bit] = b->ntrie++;
+    }
+    t = b->trie[t].child[bit];
+  }
+  b->trie[t].value = value;
+  return 0;
+}
+
+static int sr_fib_trie_inner(const struct sr_fib_builder *b, uint32_t t) {
+  return b->trie[t].child[0] || b->trie[t].child[1];
+}
+
+/* Compiles the trie below t, at depth bits and with best the longest match
+   on the way there (t's own route included), into poptrie node n. */
+static int sr_fib_compile(struct sr_fib_builder *b, uint32_t t, int depth, uint32_t best,
+  uint32_t n) {
+  struct sr_fib *fib = b->fib;
+  struct sr_fib_node node;
+  uint32_t child[SR_FIB_FANOUT], child_best[SR_FIB_FANOUT], u, match, last = 0;
+  int v, j, nchild = 0, nleaf = 0;
+
+  memset(&node, 0, sizeof(node));
+  node.base0 = fib->nleaves;
+  for (v = 0; v < SR_FIB_FANOUT; v++) {
+    /* follow the chunk's bits down; below 32 bits the trie has no nodes */
+    for (u = t, match = best, j = SR_FIB_STRIDE - 1; j >= 0; j--) {
+      if ((u = b->trie[u].child[(v >> j) & 1]) == 0) {
+        break;
+      }
+      if (b->trie[u].value) {
+        match = b->trie[u].value;
+      }
+    }
+    if (u && sr_fib_trie_inner(b, u)) {
+      node.vector |= (uint64_t) 1 << v;
+      child[nchild] = u;
+      child_best[nchild++] = match;
+      continue;
+    }
+    if (nleaf == 0 || match != last) {
+      if (sr_fib_grow((void **) &(fib->leaves), &(b->leaves_size), fib->nleaves + 1,
+          sizeof(uint32_t)) != 0) {
+        return -1;
+      }
+      fib->leaves[fib->nleaves++] = match;
+      node.leafvec |= (uint64_t) 1 << v;
+      last = match;
+      nleaf++;
+    }
+  }
+
+  /* the children go side by side, then each fills in its own subtree */
+  node.base1 = fib->nnodes;
+  if (sr_fib_grow((void **) &(fib->nodes), &(b->nodes_size), fib->nnodes + nchild,
+      sizeof(struct sr_fib_node)) != 0) {
+    return -1;
+  }
+  fib->nnodes += nchild;
+  fib->nodes[n] = node;
+  for (j = 0; j < nchild; j++) {
+    if (sr_fib_compile(b, child[j], depth + SR_FIB_STRIDE, child_best[j], node.base1 + j) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Expands the trie below node t, reached by the depth-bit path prefix with
+   best its longest match so far, into the entries of a table indexed by
+   bits depth..stop-1 of the address, handing each entry to emit. */
+static int sr_fib_expand(struct sr_fib_builder *b, uint32_t t, int depth, int stop,
+  uint32_t best, uint32_t prefix, sr_fib_emit_fn emit) {
+  uint32_t c, first, i;
+  int bit;
+
+  if (depth == stop) {
+    return emit(b, prefix, sr_fib_trie_inner(b, t) ? t : 0, best);
+  }
+  for (bit = 0; bit < 2; bit++) {
+    if ((c = b->trie[t].child[bit])) {
+      if (sr_fib_expand(b, c, depth + 1, stop, b->trie[c].value ? b->trie[c].value : best,
+          (prefix << 1) | bit, emit) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    /* nothing longer below: the whole range takes best */
+    first = ((prefix << 1) | bit) << (stop - depth - 1);
+    for (i = 0; i < 1u << (stop - depth - 1); i++) {
+      if (emit(b, first + i, 0, best) != 0) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Poptrie direct table entry: a leaf, or a node compiled from t. */
+static int sr_fib_emit_direct(struct sr_fib_builder *b, uint32_t index, uint32_t t,
+  uint32_t best) {
+  struct sr_fib *fib = b->fib;
+
+  if (t == 0) {
+    fib->direct[index] = SR_FIB_LEAF | best;
+    return 0;
+  }
+  if (sr_fib_grow((void **) &(fib->nodes), &(b->nodes_size), fib->nnodes + 1,
+      sizeof(struct sr_fib_node)) != 0) {
+    return -1;
+  }
+  fib->direct[index] = fib->nnodes++;
+  return sr_fib_compile(b, t, SR_FIB_DIRECT_BITS, best, fib->direct[index]);
+}
+
+/* DIR-24-8 chunk entry; nothing is longer than /32, so t is always 0. */
+static int sr_fib_emit_tbl8(struct sr_fib_builder *b, uint32_t index, uint32_t t,
+  uint32_t best) {
+  b->fib->tbl8[(b->chunk << 8) | index] = (uint16_t) best;
+  return 0;
+}
+
+/* DIR-24-8 first-level entry: a leaf, or a chunk filled from t. */
+static int sr_fib_emit_tbl24(struct sr_fib_builder *b, uint32_t index, uint32_t t,
+  uint32_t best) {
+  struct sr_fib *fib = b->fib;
+
+  if (t == 0) {
+    fib->tbl24[index] = (uint16_t) best;
+    return 0;
+  }
+  if (fib->nchunks == SR_FIB_DIR24_MAX) {
+    fprintf(stderr, "Routing table has too many prefixes longer than /24 for DIR-24-8\n");
+    return -1;
+  }
+  if (sr_fib_grow((void **) &(fib->tbl8), &(b->tbl8_size), (fib->nchunks + 1) << 8,
+      sizeof(uint16_t)) != 0) {
+    return -1;
+  }
+  b->chunk = fib->nchunks++;
+  fib->tbl24[index] = (uint16_t)(SR_FIB_CHUNK | b->chunk);
+  return sr_fib_expand(b, t, 24, 32, best, 0, sr_fib_emit_tbl8);
+}
+
+struct sr_fib *sr_fib_build(struct sr_rt *routes, struct sr_if *ifaces, int engine) {
+  struct sr_fib_builder b;
+  struct sr_rt *rt;
+  struct sr_if *iface;
+  uint32_t value;
+  int err = 0;
+
+  memset(&b, 0, sizeof(b));
+  b.nh_buckets = 64;
+  if ((b.fib = (struct sr_fib *) calloc(1, sizeof(struct sr_fib))) == NULL ||
+      (b.nh_hash = (uint32_t *) calloc(b.nh_buckets, sizeof(uint32_t))) == NULL ||
+      sr_fib_grow((void **) &(b.trie), &(b.trie_size), 1, sizeof(struct sr_fib_trie)) != 0) {
+    free(b.nh_hash);
+    free(b.fib);
+    return NULL;
+  }
+  memset(&(b.trie[0]), 0, sizeof(struct sr_fib_trie));
+  b.ntrie = 1;
+  b.fib->engine = engine;
+
+  for (rt = routes; rt && !err; rt = rt->next) {
+    for (iface = ifaces; iface && strncmp(iface->name, rt->interface, sr_IFACE_NAMELEN) != 0;
+         iface = iface->next) {
+    }
+    if ((value = sr_fib_nexthop(&b, iface, rt->gw.s_addr)) == 0) {
+      err = -1;
+      break;
+    }
+    err = sr_fib_trie_insert(&b, rt, value);
+    b.fib->nroutes++;
+  }
+  free(b.nh_hash);
+  if (!err && engine == SR_FIB_DIR24 && b.fib->nnexthops > SR_FIB_DIR24_MAX) {
+    fprintf(stderr, "Routing table has too many next hops for DIR-24-8\n");
+    err = -1;
+  }
+  else if (!err && engine == SR_FIB_DIR24) {
+    err = (b.fib->tbl24 = (uint16_t *) malloc((1 << 24) * sizeof(uint16_t))) == NULL ||
+      sr_fib_expand(&b, 0, 0, 24, b.trie[0].value, 0, sr_fib_emit_tbl24) != 0;
+  }
+  else if (!err) {
+    err = (b.fib->direct = (uint32_t *) malloc((1 << SR_FIB_DIRECT_BITS) * sizeof(uint32_t))) == NULL ||
+      sr_fib_expand(&b, 0, 0, SR_FIB_DIRECT_BITS, b.trie[0].value, 0, sr_fib_emit_direct) != 0;
+  }
+  free(b.trie);
+  if (err) {
+    sr_fib_free(b.fib);
+    return NULL;
+  }
+  return b.fib;
+}
+
+void sr_fib_free(struct sr_fib *fib) {
+  if (fib == NULL) {
+    return;
+  }
+  free(fib->nexthops);
+  free(fib->direct);
+  free(fib->tbl24);
+  free(fib->tbl8);
+  free(fib->nodes);
+  free(fib->leaves);
+  free(fib);
+}
+
+size_t sr_fib_memory(const struct sr_fib *fib) {
+  if (fib->engine == SR_FIB_DIR24) {
+    return ((size_t) 1 << 24) * sizeof(uint16_t) + (size_t) fib->nchunks * 256 * sizeof(uint16_t);
+  }
+  return ((size_t) 1 << SR_FIB_DIRECT_BITS) * sizeof(uint32_t) +
+    (size_t) fib->nnodes * sizeof(struct sr_fib_node) + (size_t) fib->nleaves * sizeof(uint32_t);
+}
+
+const struct sr_nexthop *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip) {
+  /* the key is left-aligned in 64 bits, so chunks that run past the
+     address read zeros */
+  uint64_t key = (uint64_t) ntohl(ip) << 32, below;
+  uint32_t e, value;
+  const struct sr_fib_node *node;
+  int offset = SR_FIB_DIRECT_BITS, v;
+
+  if (fib->engine == SR_FIB_DIR24) {
+    value = fib->tbl24[key >> 40];
+    if (value & SR_FIB_CHUNK) {
+      value = fib->tbl8[((value & ~SR_FIB_CHUNK) << 8) | ((key >> 32) & 0xff)];
+    }
+    return value ? &(fib->nexthops[value - 1]) : NULL;
+  }
+
+  e = fib->direct[key >> (64 - SR_FIB_DIRECT_BITS)];
+  if (e & SR_FIB_LEAF) {
+    value = e & ~SR_FIB_LEAF;
+  }
+  else {
+    node = &(fib->nodes[e]);
+    while (1) {
+      v = (int)(key >> (64 - SR_FIB_STRIDE - offset)) & (SR_FIB_FANOUT - 1);
+      below = ((uint64_t) 2 << v) - 1;  /* chunks 0..v */
+      if (!(node->vector & ((uint64_t) 1 << v))) {
+        break;
+      }
+      node = &(fib->nodes[node->base1 + __builtin_popcountll(node->vector & below) - 1]);
+      offset += SR_FIB_STRIDE;
+    }
+    value = fib->leaves[node->base0 + __builtin_popcountll(node->leafvec & below) - 1];
+  }
+  return value ? &(fib->nexthops[value - 1]) : NULL;
+}
+
+/* Seconds on the monotonic clock. */
+static double sr_fib_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prepends a zeroed interface for each route interface name ifaces
+   lacks, so a benchmark run before the server sends HWINFO still
+   compiles one next hop per (interface, gateway) like the router does.
+   The nodes in front of ifaces are the caller's to free. */
+static struct sr_if *sr_fib_placeholders(struct sr_rt *routes, struct sr_if *ifaces) {
+  struct sr_if *list = ifaces, *ifc;
+  struct sr_rt *rt;
+
+  for (rt = routes; rt; rt = rt->next) {
+    for (ifc = list; ifc; ifc = ifc->next) {
+      if (strncmp(ifc->name, rt->interface, sr_IFACE_NAMELEN) == 0) {
+        break;
+      }
+    }
+    if (ifc || (ifc = (struct sr_if *) calloc(1, sizeof(struct sr_if))) == NULL) {
+      continue;
+    }
+    strncpy(ifc->name, rt->interface, sr_IFACE_NAMELEN - 1);
+    ifc->next = list;
+    list = ifc;
+  }
+  return list;
+}
+
+void sr_fib_benchmark(struct sr_rt *routes, struct sr_if *ifaces, unsigned long lookups) {
+  static const char *names[] = { "poptrie", "dir-24-8" };
+  struct sr_fib *fib;
+  struct sr_rt *rt, **in;
+  struct sr_if *bound, *ifc;
+  uint32_t *addrs, nroutes = 0, x = 2463534242u, i;
+  unsigned long n;
+  uintptr_t sink = 0;
+  double t0, t1, t2;
+  int engine;
+
+  for (rt = routes; rt; rt = rt->next) {
+    nroutes++;
+  }
+  addrs = (uint32_t *) malloc(65536 * sizeof(uint32_t));
+  in = (struct sr_rt **) malloc((nroutes ? nroutes : 1) * sizeof(struct sr_rt *));
+  if (addrs == NULL || in == NULL) {
+    free(addrs);
+    free(in);
+    return;
+  }
+  for (rt = routes, i = 0; rt; rt = rt->next) {
+    in[i++] = rt;
+  }
+  /* half the addresses anywhere, half inside a route, so the deep parts
+     of the tables get exercised too */
+  for (i = 0; i < 65536; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    addrs[i] = x;
+    if ((i & 1) && nroutes) {
+      rt = in[x % nroutes];
+      addrs[i] = (ntohl(rt->dest.s_addr) & ntohl(rt->mask.s_addr)) | (x & ~ntohl(rt->mask.s_addr));
+    }
+    addrs[i] = htonl(addrs[i]);
+  }
+
+  bound = sr_fib_placeholders(routes, ifaces);
+  printf("FIB benchmark: %u routes, %lu lookups\n", nroutes, lookups);
+  for (engine = SR_FIB_POPTRIE; engine <= SR_FIB_DIR24; engine++) {
+    t0 = sr_fib_now();
+    if ((fib = sr_fib_build(routes, bound, engine)) == NULL) {
+      printf("  %-9s cannot build\n", names[engine]);
+      continue;
+    }
+    t1 = sr_fib_now();
+    for (n = 0; n < lookups; n++) {
+      sink += (uintptr_t) sr_fib_lookup(fib, addrs[n & 65535]);
+    }
+    t2 = sr_fib_now();
+    printf("  %-9s build %.3fs  %8.1f KB  %6.1f ns/lookup\n", names[engine], t1 - t0,
+      sr_fib_memory(fib) / 1024.0, lookups ? (t2 - t1) * 1e9 / lookups : 0.0);
+    sr_fib_free(fib);
+  }
+  while (bound != ifaces) {
+    ifc = bound->next;
+    free(bound);
+    bound = ifc;
+  }
+  free(addrs);
+  free(in);
+  if (sink == 1) {
+    printf("\n");  /* keeps the lookups from being optimized away */
+  }
+}
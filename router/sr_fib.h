@@ -0,0 +1,97 @@
+/* Forwarding table: longest-prefix match over the routing table.
+
+   The routing table proper stays the linked list of struct sr_rt that
+   sr_load_rt() builds; the FIB is compiled from it and answers lookups
+   only. It is a poptrie: the top 16 bits of the address index a direct
+   table, and the rest is a trie of 64-way nodes, one per 6 bits. Rather
+   than 64 child pointers a node keeps two bitmaps, one marking the chunks
+   that continue into a child node and one marking where a run of equal
+   leaves starts; a child or leaf is found at its base plus the popcount of
+   the bitmap below the chunk. Nodes and leaves are packed in two arrays, so
+   a lookup touches the direct table and at most three nodes and a leaf,
+   whatever the size of the table.
+
+   A second engine, DIR-24-8, trades memory for the flattest lookup: a
+   table of 16M 16-bit entries indexed by the top 24 bits holds the result
+   directly, or for addresses under a prefix longer than /24 the number of
+   a 256-entry chunk indexed by the last 8 bits. A lookup is one memory
+   access, two past /24, at the cost of 32MB plus 512 bytes per chunk. Its
+   entries have 15 bits for the result, so it takes at most
+   SR_FIB_DIR24_MAX next hops and chunks.
+
+   Matching is by prefix length: the route with the longest mask covering
+   the address wins, whatever the order of the routes. Of two routes for
+   the same prefix the later one wins. Masks are taken to be contiguous; a
+   mask's prefix length is its count of leading one bits.
+
+   Lookups yield a next hop rather than a route: the routes are reduced to
+   their distinct (interface, gateway) pairs, so a lookup hands back the
+   egress interface itself and the leaves stay few and repetitive, which
+   is what both engines compress best.
+
+   A compiled FIB is never changed; a new routing table gets a new FIB,
+   which the router swaps in while lookups carry on in the old one. */
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "sr_rt.h"
+#include "sr_epoch.h"
+
+#define SR_FIB_DIRECT_BITS 16
+#define SR_FIB_STRIDE 6
+#define SR_FIB_DIR24_MAX 0x7fff
+
+/* lookup engines */
+#define SR_FIB_POPTRIE 0
+#define SR_FIB_DIR24 1
+
+struct sr_fib_node {
+  uint64_t vector;    /* bit v: chunk v continues into a child node */
+  uint64_t leafvec;   /* bit v: chunk v is a leaf and starts a new run */
+  uint32_t base0;     /* index of the node's first leaf */
+  uint32_t base1;     /* index of its first child; children are contiguous */
+};
+
+struct sr_fib {
+  struct sr_epoch_entry retire;
+  int engine;
+  /* a leaf value v > 0 stands for nexthops[v - 1]; 0 for no route */
+  struct sr_nexthop *nexthops;
+  uint32_t nnexthops;
+  uint32_t nroutes;
+  /* poptrie: top bits -> SR_FIB_LEAF | leaf value, or the index of a node */
+  uint32_t *direct;
+  struct sr_fib_node *nodes;
+  uint32_t nnodes;
+  uint32_t *leaves;
+  uint32_t nleaves;
+  /* DIR-24-8: top 24 bits -> leaf value, or SR_FIB_CHUNK | chunk number */
+  uint16_t *tbl24;
+  uint16_t *tbl8;
+  uint32_t nchunks;
+};
+
+/* Compiles the routes on the list starting at routes for the given engine,
+   resolving their interface names in the list ifaces. A route through an
+   interface not on the list gets a next hop with no interface. Returns
+   NULL if out of memory, or (saying so on stderr) if the table is too big
+   for DIR-24-8. */
+struct sr_fib *sr_fib_build(struct sr_rt *routes, struct sr_if *ifaces, int engine);
+void sr_fib_free(struct sr_fib *fib);
+
+/* Bytes the compiled tables take. */
+size_t sr_fib_memory(const struct sr_fib *fib);
+
+/* Builds the routes with each engine and times lookups of addresses
+   in and around them, printing the results.  Interfaces the routes name
+   but ifaces lacks are bound to placeholders for the run. */
+void sr_fib_benchmark(struct sr_rt *routes, struct sr_if *ifaces, unsigned long lookups);
+
+/* The next hop of the route with the longest prefix covering ip (network
+   byte order), or NULL if none does. */
+const struct sr_nexthop *sr_fib_lookup(const struct sr_fib *fib, uint32_t ip);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sr_flowcache.h"
+#include "sr_router.h"
+#include "sr_utils.h"
+#include "sr_hash.h"
+#include "sr_nat.h"
+
+#define SR_FLOW_IP(packet) ((sr_ip_hdr_t *)((packet) + sizeof(sr_ethernet_hdr_t)))
+#define SR_FLOW_L4(packet) ((packet) + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+
+/* The 16-bit checksum word holding the TTL (and the protocol). */
+#define SR_FLOW_TTL_WORD(iphdr) htons(((iphdr)->ip_ttl << 8) | (iphdr)->ip_p)
+
+/* Fills key from packet. Returns 0 for packets the cache does not handle:
+   anything but unfragmented, option-less TCP without SYN/FIN/RST and ICMP
+   echo. */
+static int sr_flow_key_of(uint8_t *packet, unsigned int len, struct sr_flow_key *key) {
+  sr_ip_hdr_t *iphdr = SR_FLOW_IP(packet);
+  unsigned int l4_off = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t);
+
+  if (len < l4_off || iphdr->ip_v != 4 || iphdr->ip_hl != 5 ||
+      (iphdr->ip_off & htons(IP_MF | IP_OFFMASK))) {
+    return 0;
+  }
+  key->ip_src = iphdr->ip_src;
+  key->ip_dst = iphdr->ip_dst;
+  key->ip_p = iphdr->ip_p;
+
+  if (iphdr->ip_p == ip_protocol_tcp) {
+    sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *) SR_FLOW_L4(packet);
+    if (len < l4_off + sizeof(sr_tcp_hdr_t) ||
+        (tcp_header->flags & (tcp_flag_syn | tcp_flag_fin | tcp_flag_rst))) {
+      return 0;
+    }
+    key->aux_src = tcp_header->aux_src;
+    key->aux_dst = tcp_header->aux_dst;
+    return 1;
+  }
+  if (iphdr->ip_p == ip_protocol_icmp) {
+    sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) SR_FLOW_L4(packet);
+    if (len < l4_off + sizeof(sr_icmp_hdr_t) ||
+        (icmp_hdr->icmp_type != 0 && icmp_hdr->icmp_type != 8)) {
+      return 0;
+    }
+    key->aux_src = icmp_hdr->icmp_id;
+    key->aux_dst = icmp_hdr->icmp_type;
+    return 1;
+  }
+  return 0;
+}
+
+static struct sr_flow *sr_flow_slot(struct sr_flowcache *fc, const struct sr_flow_key *key) {
+  uint32_t h = sr_hash_mix32(key->ip_src ^
+    sr_hash_mix32(key->ip_dst ^
+      sr_hash_mix32((((uint32_t)key->aux_src << 16) | key->aux_dst) ^ key->ip_p)));
+  return &(fc->flows[h & (SR_FLOWCACHE_SZ - 1)]);
+}
+
+static int sr_flow_key_eq(const struct sr_flow_key *a, const struct sr_flow_key *b) {
+  return a->ip_src == b->ip_src && a->ip_dst == b->ip_dst &&
+    a->aux_src == b->aux_src && a->aux_dst == b->aux_dst && a->ip_p == b->ip_p;
+}
+
+struct sr_flowcache *sr_flowcache_create(void) {
+  struct sr_flowcache *fc = (struct sr_flowcache *) calloc(1, sizeof(struct sr_flowcache));
+  if (fc) {
+    fc->gen = 1;    /* zeroed entries are never current */
+  }
+  return fc;
+}
+
+void sr_flowcache_destroy(struct sr_flowcache *fc) {
+  free(fc);
+}
+
+void sr_flowcache_invalidate(struct sr_flowcache *fc) {
+  if (fc == NULL) {
+    return;
+  }
+  __atomic_add_fetch(&(fc->gen), 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&(fc->invalidations), 1, __ATOMIC_RELAXED);
+}
+
+int sr_flowcache_forward(struct sr_instance *sr, uint8_t *packet, unsigned int len) {
+  struct sr_flowcache *fc = sr->flows;
+  sr_ip_hdr_t *iphdr = SR_FLOW_IP(packet);
+  struct sr_flow_key key;
+  struct sr_flow *f;
+  int hit = 0;
+
+  if (fc == NULL || !sr_flow_key_of(packet, len, &key)) {
+    return 0;
+  }
+  f = sr_flow_slot(fc, &key);
+
+  /* the entry's touch target is only guaranteed to exist while the
+     generation is current; the epoch section keeps it from being freed
+     between the check and the store */
+  if (sr->nat) {
+    sr_epoch_enter(&(sr->nat->epoch));
+  }
+  if (f->gen == __atomic_load_n(&(fc->gen), __ATOMIC_ACQUIRE) &&
+      sr_flow_key_eq(&(f->key), &key) && iphdr->ip_ttl > 1) {
+    if (f->touch) {
+      __atomic_store_n(f->touch, time(NULL), __ATOMIC_RELAXED);
+    }
+    hit = 1;
+  }
+  if (sr->nat) {
+    sr_epoch_exit(&(sr->nat->epoch));
+  }
+  if (!hit) {
+    fc->misses++;
+    return 0;
+  }
+  fc->hits++;
+
+  iphdr->ip_ttl--;
+  iphdr->ip_sum = cksum_apply(iphdr->ip_sum, f->ip_delta);
+  iphdr->ip_src = f->ip_src;
+  iphdr->ip_dst = f->ip_dst;
+  if (key.ip_p == ip_protocol_tcp) {
+    sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *) SR_FLOW_L4(packet);
+    tcp_header->checksum = cksum_apply(tcp_header->checksum, f->l4_delta);
+    tcp_header->aux_src = f->aux_src;
+    tcp_header->aux_dst = f->aux_dst;
+  }
+  else {
+    sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) SR_FLOW_L4(packet);
+    icmp_hdr->icmp_sum = cksum_apply(icmp_hdr->icmp_sum, f->l4_delta);
+    icmp_hdr->icmp_id = f->aux_src;
+  }
+  memcpy(((sr_ethernet_hdr_t *) packet)->ether_dhost, f->dhost, ETHER_ADDR_LEN);
+  memcpy(((sr_ethernet_hdr_t *) packet)->ether_shost, f->shost, ETHER_ADDR_LEN);
+
+  if (sr_send_packet_if(sr, packet, len, f->iface) == -1) {
+    fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
+  }
+  return 1;
+}
+
+void sr_flowcache_begin(struct sr_flowcache *fc, uint8_t *packet, unsigned int len) {
+  if (fc == NULL) {
+    return;
+  }
+  fc->pending_ok = sr_flow_key_of(packet, len, &(fc->pending));
+  if (fc->pending_ok) {
+    fc->pending_gen = __atomic_load_n(&(fc->gen), __ATOMIC_ACQUIRE);
+    fc->pending_ttl_word = SR_FLOW_TTL_WORD(SR_FLOW_IP(packet));
+  }
+}
+
+void sr_flowcache_fill(struct sr_flowcache *fc, uint8_t *packet,
+  const struct sr_if *iface, time_t *touch) {
+  sr_ip_hdr_t *iphdr = SR_FLOW_IP(packet);
+  struct sr_flow_key *key;
+  struct sr_flow *f;
+  uint16_t l4_delta;
+
+  if (fc == NULL || !fc->pending_ok) {
+    return;
+  }
+  fc->pending_ok = 0;
+  key = &(fc->pending);
+
+  /* the fast path assumes exactly one TTL decrement */
+  if (iphdr->ip_p != key->ip_p ||
+      cksum_delta16(0, fc->pending_ttl_word, SR_FLOW_TTL_WORD(iphdr)) != htons(0xfeff)) {
+    return;
+  }
+
+  f = sr_flow_slot(fc, key);
+  f->gen = 0;
+  f->key = *key;
+  f->ip_src = iphdr->ip_src;
+  f->ip_dst = iphdr->ip_dst;
+  f->ip_delta = cksum_delta16(0, fc->pending_ttl_word, SR_FLOW_TTL_WORD(iphdr));
+  f->ip_delta = cksum_delta32(f->ip_delta, key->ip_src, iphdr->ip_src);
+  f->ip_delta = cksum_delta32(f->ip_delta, key->ip_dst, iphdr->ip_dst);
+
+  if (key->ip_p == ip_protocol_tcp) {
+    sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *) SR_FLOW_L4(packet);
+    f->aux_src = tcp_header->aux_src;
+    f->aux_dst = tcp_header->aux_dst;
+    /* the pseudo-header brings the addresses into the TCP checksum */
+    l4_delta = cksum_delta32(0, key->ip_src, iphdr->ip_src);
+    l4_delta = cksum_delta32(l4_delta, key->ip_dst, iphdr->ip_dst);
+    l4_delta = cksum_delta16(l4_delta, key->aux_src, tcp_header->aux_src);
+    l4_delta = cksum_delta16(l4_delta, key->aux_dst, tcp_header->aux_dst);
+  }
+  else {
+    sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *) SR_FLOW_L4(packet);
+    f->aux_src = icmp_hdr->icmp_id;
+    f->aux_dst = key->aux_dst;
+    l4_delta = cksum_delta16(0, key->aux_src, icmp_hdr->icmp_id);
+  }
+  f->l4_delta = l4_delta;
+
+  f->touch = touch;
+  f->iface = iface;
+  memcpy(f->dhost, ((sr_ethernet_hdr_t *) packet)->ether_dhost, ETHER_ADDR_LEN);
+  memcpy(f->shost, ((sr_ethernet_hdr_t *) packet)->ether_shost, ETHER_ADDR_LEN);
+  f->gen = fc->pending_gen;
+  fc->fills++;
+}
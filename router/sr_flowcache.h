@@ -0,0 +1,102 @@
+/* Fast path for established flows.
+
+   The first packets of a flow take the slow path: route lookup, ARP lookup,
+   NAT lookup and rewrite. Once a packet has been translated and sent out
+   immediately, everything that was done to it is remembered in a
+   direct-mapped table keyed on the 5-tuple the packet arrived with: the
+   new addresses and ports, the resulting IP and transport checksum deltas
+   (TTL decrement included), the egress interface and both MAC addresses.
+   Later packets of the flow are rewritten from the entry and sent without
+   touching any other table.
+
+   Only TCP segments without SYN, FIN or RST and ICMP echo messages are
+   cached, so every TCP state change is still seen by the NAT.
+
+   Entries are not removed one by one. The cache has a generation number
+   and an entry is only good while it carries the current one; anything
+   that may change how a packet is forwarded (an ARP entry coming or going,
+   a route change, a NAT mapping or connection that a cached flow relies on
+   going away) bumps the generation and so drops every entry at once.
+
+   Lookups and fills happen on the packet thread only. Invalidation may come
+   from any thread. */
+
+#ifndef SR_FLOWCACHE_H
+#define SR_FLOWCACHE_H
+
+#include <inttypes.h>
+#include <time.h>
+#include "sr_protocol.h"
+
+#define SR_FLOWCACHE_SZ 4096   /* power of two */
+
+struct sr_instance;
+struct sr_if;
+
+/* A packet's 5-tuple as received. For ICMP aux_src is the query id and
+   aux_dst the message type. All fields in network byte order. */
+struct sr_flow_key {
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t aux_src;
+  uint16_t aux_dst;
+  uint8_t ip_p;
+};
+
+struct sr_flow {
+  unsigned long gen;            /* valid while equal to the cache's */
+  struct sr_flow_key key;
+
+  /* header fields after translation */
+  uint32_t ip_src;
+  uint32_t ip_dst;
+  uint16_t aux_src;
+  uint16_t aux_dst;
+  uint16_t ip_delta;            /* applied with cksum_apply() */
+  uint16_t l4_delta;
+
+  time_t *touch;                /* NAT idle timestamp to refresh, or NULL */
+  const struct sr_if *iface;    /* egress interface */
+  uint8_t dhost[ETHER_ADDR_LEN];
+  uint8_t shost[ETHER_ADDR_LEN];
+};
+
+struct sr_flowcache {
+  unsigned long gen;
+  struct sr_flow flows[SR_FLOWCACHE_SZ];
+
+  /* the packet on the slow path, recorded by sr_flowcache_begin() */
+  struct sr_flow_key pending;
+  unsigned long pending_gen;
+  uint16_t pending_ttl_word;    /* checksum word holding the TTL */
+  int pending_ok;
+
+  /* counters */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t fills;
+  uint64_t invalidations;
+};
+
+struct sr_flowcache *sr_flowcache_create(void);
+void sr_flowcache_destroy(struct sr_flowcache *fc);
+
+/* Drops every entry. fc may be NULL. Safe from any thread. */
+void sr_flowcache_invalidate(struct sr_flowcache *fc);
+
+/* Forwards packet from the cache if its flow has a valid entry. Returns 1
+   if the packet was sent, 0 if it must take the slow path. */
+int sr_flowcache_forward(struct sr_instance *sr, uint8_t *packet, unsigned int len);
+
+/* Records the header of a packet entering the slow path, so that
+   sr_flowcache_fill() can work out what the slow path did to it. */
+void sr_flowcache_begin(struct sr_flowcache *fc, uint8_t *packet, unsigned int len);
+
+/* Called once the slow path has sent the packet recorded by
+   sr_flowcache_begin() out of iface with its final headers. touch is the
+   NAT timestamp the fast path has to keep fresh (see sr_nat_flow_pin()), or
+   NULL for a flow the NAT does not track. */
+void sr_flowcache_fill(struct sr_flowcache *fc, uint8_t *packet,
+  const struct sr_if *iface, time_t *touch);
+
+#endif
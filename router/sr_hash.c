@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_hash.h"
+
+/* Marks a slot whose entry was removed. Probes continue past it. */
+#define SR_HASH_TOMBSTONE ((void *) 1)
+
+uint32_t sr_hash_mix32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  x ^= x >> 16;
+  return x;
+}
+
+static uint32_t sr_hash_roundup(uint32_t n) {
+  uint32_t cap = SR_HASH_MIN_SZ;
+  while (cap < n) {
+    cap <<= 1;
+  }
+  return cap;
+}
+
+static struct sr_hash_table *sr_hash_table_alloc(uint32_t cap) {
+  struct sr_hash_table *t = (struct sr_hash_table *)
+    calloc(1, sizeof(struct sr_hash_table) + (cap - 1) * sizeof(void *));
+  if (t) {
+    t->mask = cap - 1;
+  }
+  return t;
+}
+
+static void sr_hash_table_free(struct sr_epoch_entry *entry, void *arg) {
+  free(entry);
+}
+
+int sr_hash_init(struct sr_hash *h, uint32_t capacity, sr_hash_fn hash,
+                 struct sr_epoch *epoch) {
+  h->table = sr_hash_table_alloc(sr_hash_roundup(capacity * 2));
+  if (h->table == NULL) {
+    return -1;
+  }
+  h->count = 0;
+  h->used = 0;
+  h->hash = hash;
+  h->epoch = epoch;
+  return 0;
+}
+
+void sr_hash_destroy(struct sr_hash *h) {
+  free(h->table);
+  h->table = NULL;
+  h->count = h->used = 0;
+}
+
+void *sr_hash_find(struct sr_hash *h, uint32_t hash, const void *key,
+                   sr_hash_match_fn match) {
+  struct sr_hash_table *t = SR_CONSUME(h->table);
+  uint32_t i = hash & t->mask;
+  void *entry;
+
+  while ((entry = SR_CONSUME(t->slots[i])) != NULL) {
+    if (entry != SR_HASH_TOMBSTONE && match(entry, key)) {
+      return entry;
+    }
+    i = (i + 1) & t->mask;
+  }
+  return NULL;
+}
+
+/* Builds a slot array sized so the table is at most half full, drops every
+   tombstone on the way and swaps it in. Readers still walking the old array
+   keep it until the epoch moves on. */
+static int sr_hash_rebuild(struct sr_hash *h) {
+  struct sr_hash_table *old = h->table, *t;
+  uint32_t cap = sr_hash_roundup((h->count + 1) * 2), i, j;
+
+  t = sr_hash_table_alloc(cap);
+  if (t == NULL) {
+    return -1;
+  }
+  for (i = 0; i <= old->mask; i++) {
+    void *entry = old->slots[i];
+    if (entry == NULL || entry == SR_HASH_TOMBSTONE) {
+      continue;
+    }
+    j = h->hash(entry) & t->mask;
+    while (t->slots[j]) {
+      j = (j + 1) & t->mask;
+    }
+    t->slots[j] = entry;
+  }
+  SR_PUBLISH(h->table, t);
+  h->used = h->count;
+
+  if (h->epoch) {
+    sr_epoch_retire(h->epoch, &(old->retire), sr_hash_table_free, NULL);
+  }
+  else {
+    free(old);
+  }
+  return 0;
+}
+
+int sr_hash_insert(struct sr_hash *h, void *entry) {
+  struct sr_hash_table *t;
+  uint32_t i;
+
+  /* keep the table (tombstones included) under 3/4 full */
+  if ((h->used + 1) * 4 > (h->table->mask + 1) * 3 && sr_hash_rebuild(h) != 0) {
+    return -1;
+  }
+
+  t = h->table;
+  i = h->hash(entry) & t->mask;
+  while (t->slots[i] != NULL && t->slots[i] != SR_HASH_TOMBSTONE) {
+    i = (i + 1) & t->mask;
+  }
+  if (t->slots[i] == NULL) {
+    h->used++;
+  }
+  SR_PUBLISH(t->slots[i], entry);
+  h->count++;
+  return 0;
+}
+
+uint32_t sr_hash_capacity(struct sr_hash *h) {
+  return h->table->mask + 1;
+}
+
+void *sr_hash_slot(struct sr_hash *h, uint32_t i) {
+  void *entry = h->table->slots[i];
+  return entry == SR_HASH_TOMBSTONE ? NULL : entry;
+}
+
+int sr_hash_remove(struct sr_hash *h, void *entry) {
+  struct sr_hash_table *t = h->table;
+  uint32_t i = h->hash(entry) & t->mask;
+  void *cur;
+
+  while ((cur = t->slots[i]) != NULL) {
+    if (cur == entry) {
+      SR_PUBLISH(t->slots[i], SR_HASH_TOMBSTONE);
+      h->count--;
+      return 0;
+    }
+    i = (i + 1) & t->mask;
+  }
+  return -1;
+}
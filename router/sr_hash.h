@@ -0,0 +1,77 @@
+/* Open-addressing hash index over caller-owned entries.
+
+   The table stores only pointers; entries live wherever the caller put them
+   and carry their own key fields. Callers supply a function that hashes an
+   entry (used when the table grows) and, on lookup, the hash of the key plus
+   a match function comparing an entry against that key. The key is usually a
+   stack instance of the entry type with just the key fields filled in.
+
+   Collisions are resolved by linear probing. Removed slots are marked with a
+   tombstone rather than shifted so that a probe sequence stays valid for any
+   reader that is already walking it; tombstones are dropped when the table is
+   rebuilt.
+
+   Writers must be serialized by the caller. sr_hash_find() may run
+   concurrently with a writer inside an sr_epoch read section: slots are
+   published with release stores, and a slot array replaced by a rebuild is
+   retired through the epoch given to sr_hash_init(). Entries themselves are
+   the caller's to retire. */
+
+#ifndef SR_HASH_H
+#define SR_HASH_H
+
+#include <inttypes.h>
+#include "sr_epoch.h"
+
+#define SR_HASH_MIN_SZ 64
+
+typedef uint32_t (*sr_hash_fn)(const void *entry);
+typedef int (*sr_hash_match_fn)(const void *entry, const void *key);
+
+struct sr_hash_table {
+  struct sr_epoch_entry retire;
+  uint32_t mask;        /* capacity - 1, capacity is a power of two */
+  void *slots[1];       /* capacity slots follow */
+};
+
+struct sr_hash {
+  struct sr_hash_table *table;
+  uint32_t count;       /* live entries */
+  uint32_t used;        /* live entries + tombstones */
+  sr_hash_fn hash;
+  struct sr_epoch *epoch; /* NULL: old slot arrays are freed at once */
+};
+
+/* Initializes an empty index able to hold roughly capacity entries before it
+   has to grow. Returns 0 on success. */
+int sr_hash_init(struct sr_hash *h, uint32_t capacity, sr_hash_fn hash,
+                 struct sr_epoch *epoch);
+
+/* Frees the slot array. Entries are not touched. */
+void sr_hash_destroy(struct sr_hash *h);
+
+/* Returns the entry matching key, or NULL. hash must equal h->hash() of the
+   entry being looked for. */
+void *sr_hash_find(struct sr_hash *h, uint32_t hash, const void *key,
+                   sr_hash_match_fn match);
+
+/* Adds entry to the index. Does not check for duplicates. Returns 0 on
+   success, -1 if the table could not grow. */
+int sr_hash_insert(struct sr_hash *h, void *entry);
+
+/* Removes this exact entry (by pointer). Returns 0 if it was present. */
+int sr_hash_remove(struct sr_hash *h, void *entry);
+
+/* Number of slots, for walking the index with sr_hash_slot(). Changes when
+   an insert grows the table. */
+uint32_t sr_hash_capacity(struct sr_hash *h);
+
+/* The entry in slot i (below the capacity), or NULL if the slot holds none.
+   Removing entries does not move the others, so a walk by slot number may
+   remove as it goes. Serialized with writers by the caller. */
+void *sr_hash_slot(struct sr_hash *h, uint32_t i);
+
+/* Finalizer from MurmurHash3; spreads a 32-bit key over all bits. */
+uint32_t sr_hash_mix32(uint32_t x);
+
+#endif
@@ -27,12 +27,16 @@
 
 #ifdef _LINUX_
 #include <getopt.h>
+#include <signal.h>
+#include <arpa/inet.h>
 #endif /* _LINUX_ */
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_nat.h"
+#include "sr_flowcache.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 
 extern char* optarg;
 
@@ -51,6 +55,13 @@ static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_sighup(int sig);
+static void sr_sigusr1(int sig);
+
+/* the router whose routes, and the NAT whose rules, SIGHUP reloads;
+   SIGUSR1 runs the router's route command file */
+static struct sr_instance *sr_hup_sr;
+static struct sr_nat *sr_hup_nat;
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -73,8 +84,20 @@ int main(int argc, char **argv)
     int icmp_to=60;
     int tcp_est_to=7440;
     int tcp_trans_to=300;
-
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:")) != EOF)
+    unsigned long max_flows=0;
+    int port_blocks=0;
+    unsigned long host_mappings=0, host_half_open=0;
+    unsigned long mem_budget_kb=0;
+    char *dnat_rules = NULL;
+    char *checkpoint = NULL;
+    char *rt_commands = NULL;
+    int fib_engine = SR_FIB_POPTRIE;
+    unsigned long bench_lookups = 0;
+    uint32_t pool[SR_NAT_POOL_MAX];
+    int pool_size=0, i;
+    struct in_addr addr;
+
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:M:P:BQ:O:m:F:S:L:X:C:")) != EOF)
     {
         switch (c)
         {
@@ -118,11 +141,63 @@ int main(int argc, char **argv)
             case 'R':
                 tcp_trans_to = atoi((char *) optarg);
                 break;
+            case 'M':
+                max_flows = strtoul((char *) optarg, NULL, 10);
+                break;
+            case 'Q':
+                host_mappings = strtoul((char *) optarg, NULL, 10);
+                break;
+            case 'O':
+                host_half_open = strtoul((char *) optarg, NULL, 10);
+                break;
+            case 'm':
+                mem_budget_kb = strtoul((char *) optarg, NULL, 10);
+                break;
+            case 'B':
+                port_blocks = 1;
+                break;
+            case 'F':
+                dnat_rules = optarg;
+                break;
+            case 'S':
+                checkpoint = optarg;
+                break;
+            case 'L':
+                if(strcmp(optarg, "poptrie") == 0)
+                    fib_engine = SR_FIB_POPTRIE;
+                else if(strcmp(optarg, "dir24") == 0)
+                    fib_engine = SR_FIB_DIR24;
+                else
+                {
+                    fprintf(stderr,"Unknown route lookup engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                rt_commands = optarg;
+                break;
+            case 'X':
+                bench_lookups = strtoul((char *) optarg, NULL, 10);
+                break;
+            case 'P':
+                if(inet_aton((char *) optarg, &addr) == 0 || pool_size == SR_NAT_POOL_MAX)
+                {
+                    fprintf(stderr,"Bad or too many NAT addresses: %s\n", optarg);
+                    exit(1);
+                }
+                pool[pool_size++] = addr.s_addr;
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fib_engine = fib_engine;
+    if((sr.flows = sr_flowcache_create()) == 0)
+    {
+        fprintf(stderr,"Cannot allocate the flow cache\n");
+        exit(1);
+    }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -132,6 +207,12 @@ int main(int argc, char **argv)
     else
         strncpy(sr.template, template, 30);
 
+    if(bench_lookups)
+    {
+        sr_fib_benchmark(sr.routing_table, sr.if_list, bench_lookups);
+        exit(0);
+    }
+
     sr.topo_id = topo;
     strncpy(sr.host,host,32);
 
@@ -178,11 +259,34 @@ int main(int argc, char **argv)
     if(ntrue){
         printf("hehehehehehehe\n");
         sr.nat = &nat;
-        sr_nat_init(&sr,icmp_to,tcp_est_to,tcp_trans_to);
+        sr_nat_init(&sr,icmp_to,tcp_est_to,tcp_trans_to,max_flows,port_blocks);
+        sr_nat_set_host_limits(&nat, host_mappings, host_half_open);
+        sr_nat_set_mem_budget(&nat, (uint64_t)mem_budget_kb * 1024);
+        for(i = 0; i < pool_size; i++){
+            sr_nat_add_address(&nat, pool[i]);
+        }
+        if(dnat_rules){
+            if(sr_nat_load_static(&nat, dnat_rules) != 0){
+                exit(1);
+            }
+            sr_hup_nat = &nat;
+        }
+        /* after the rules, so restored mappings never hold a forwarded
+           port; restored once the hardware info completes the pool */
+        if(checkpoint && sr_nat_set_checkpoint(&nat, checkpoint) != 0){
+            fprintf(stderr,"Cannot keep NAT state in %s\n", checkpoint);
+            exit(1);
+        }
     }
     else{
         sr.nat=NULL;
     } 
+    sr_hup_sr = &sr;
+    signal(SIGHUP, sr_sighup);
+    if(rt_commands){
+        sr.rt_cmd_path = rt_commands;
+        signal(SIGUSR1, sr_sigusr1);
+    }
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
@@ -202,14 +306,52 @@ static void usage(char* argv0)
     printf("Simple Router Client\n");
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
-    printf("           [-t topo id] [-r routing table] \n");
+    printf("           [-t topo id] [-r routing table, reloaded on SIGHUP] \n");
     printf("           [-l log file] \n");
     printf("           [-n] [-I ICMP timeout] \n");
     printf("           [-E TCP ESTABLISHED timeout] [-R TCP TRANSISTORY timeout] \n");
+    printf("           [-M max NAT flows] [-P extra NAT address]... \n");
+    printf("           [-B (allocate NAT ports in per-host blocks)] \n");
+    printf("           [-Q max NAT mappings per host] [-O max half-open TCP per host] \n");
+    printf("           [-m NAT memory budget in KB] \n");
+    printf("           [-F NAT port forwarding rules file, reloaded on SIGHUP] \n");
+    printf("           [-S NAT state checkpoint file, restored at startup] \n");
+    printf("           [-C route command file (add/del lines), run on SIGUSR1] \n");
+    printf("           [-L route lookup engine: poptrie (default) or dir24 (32MB)] \n");
+    printf("           [-X N (benchmark both engines on the routing table, N lookups; interfaces are placeholders named by the rtable)] \n");
     printf("   defaults server=%s port=%d host=%s  \n   ICMP timeout=30 TCP ESTABLISHED timeout = 7440 TCP TRANSISTORY timeout = 300\n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_sighup(..)
+ * Scope: local
+ *
+ * Only flags the reloads; the ARP cache thread reloads the routes and
+ * the NAT's timeout thread its rules.
+ *---------------------------------------------------------------------------*/
+
+static void sr_sighup(int sig)
+{
+    sr_reload_rt(sr_hup_sr);
+    if(sr_hup_nat)
+    {
+        sr_nat_reload_static(sr_hup_nat);
+    }
+} /* -- sr_sighup -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_sigusr1(..)
+ * Scope: local
+ *
+ * Flags the route command file to be run by the ARP cache thread.
+ *---------------------------------------------------------------------------*/
+
+static void sr_sigusr1(int sig)
+{
+    sr_rt_command(sr_hup_sr);
+} /* -- sr_sigusr1 -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_set_user(..)
  * Scope: local
@@ -252,6 +394,8 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_flowcache_destroy(sr->flows);
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -275,7 +419,16 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr->fib_engine = SR_FIB_POPTRIE;
+    pthread_mutex_init(&(sr->rt_lock), 0);
+    sr_epoch_init(&(sr->rt_epoch));
+    sr->rt_path = 0;
+    sr->rt_reload = 0;
+    sr->rt_cmd_path = 0;
+    sr->rt_cmd = 0;
     sr->logfile = 0;
+    sr->flows = 0;
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -302,8 +455,10 @@ int sr_verify_routing_table(struct sr_instance* sr)
     /* -- REQUIRES --*/
     assert(sr);
 
+    pthread_mutex_lock(&(sr->rt_lock));
     if( (sr->if_list == 0) || (sr->routing_table == 0))
     {
+        pthread_mutex_unlock(&(sr->rt_lock));
         return 999; /* doh! */
     }
 
@@ -325,6 +480,7 @@ int sr_verify_routing_table(struct sr_instance* sr)
 
         rt_walker = rt_walker->next;
     } /* -- while -- */
+    pthread_mutex_unlock(&(sr->rt_lock));
 
     return ret;
 } /* -- sr_verify_routing_table -- */
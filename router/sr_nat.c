@@ -17,9 +17,533 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <arpa/inet.h>
 
+#define SR_NAT_INDEX_SZ 1024
 
-int sr_nat_init(struct sr_instance *sr, int icmp_to, int tcp_est_to, int tcp_trans_to) { /* Initializes the nat */
+/* External ports per shard; the last shard's slice may be short. */
+#define SR_NAT_SLICE ((MAX_PORT - MIN_PORT + SR_NAT_SHARDS) / SR_NAT_SHARDS)
+
+/* sr_timer kinds on a shard's wheel */
+#define SR_NAT_TIMER_MAPPING 0
+#define SR_NAT_TIMER_CONN 1
+
+/* Hash/match callbacks for the two mapping indexes. Lookups build a key as a
+   stack sr_nat_mapping with only the key fields set. */
+static uint32_t sr_nat_int_hash(const void *entry) {
+  const struct sr_nat_mapping *m = entry;
+  return sr_hash_mix32(m->ip_int ^ sr_hash_mix32(((uint32_t)m->aux_int << 8) | m->type));
+}
+
+static int sr_nat_int_match(const void *entry, const void *key) {
+  const struct sr_nat_mapping *m = entry, *k = key;
+  return m->ip_int == k->ip_int && m->aux_int == k->aux_int && m->type == k->type;
+}
+
+static uint32_t sr_nat_ext_hash(const void *entry) {
+  const struct sr_nat_mapping *m = entry;
+  return sr_hash_mix32(m->ip_ext ^ sr_hash_mix32(((uint32_t)m->aux_ext << 8) | m->type));
+}
+
+static int sr_nat_ext_match(const void *entry, const void *key) {
+  const struct sr_nat_mapping *m = entry, *k = key;
+  return m->aux_ext == k->aux_ext && m->ip_ext == k->ip_ext && m->type == k->type;
+}
+
+/* Connections are indexed on the translated 5-tuple: the mapping's external
+   endpoint plus the remote endpoint (protocol is always TCP). */
+struct sr_nat_conn_key {
+  uint32_t ip_ext;
+  uint32_t ip_dst;
+  uint16_t aux_ext;
+  uint16_t aux_dst;
+};
+
+static uint32_t sr_nat_tuple_hash(uint32_t ip_ext, uint16_t aux_ext,
+  uint32_t ip_dst, uint16_t aux_dst) {
+  return sr_hash_mix32(ip_dst ^
+    sr_hash_mix32(ip_ext ^ sr_hash_mix32(((uint32_t)aux_ext << 16) | aux_dst)));
+}
+
+static uint32_t sr_nat_conn_hash(const void *entry) {
+  const struct sr_nat_connection *c = entry;
+  return sr_nat_tuple_hash(c->mapping->ip_ext, c->mapping->aux_ext, c->ip_dst, c->aux_dst);
+}
+
+static int sr_nat_conn_match(const void *entry, const void *key) {
+  const struct sr_nat_connection *c = entry;
+  const struct sr_nat_conn_key *k = key;
+  return c->ip_dst == k->ip_dst && c->aux_dst == k->aux_dst &&
+    c->mapping->aux_ext == k->aux_ext && c->mapping->ip_ext == k->ip_ext;
+}
+
+/* Shard owning external port (or ICMP id) aux_ext, host byte order. Ports
+   below MIN_PORT are never mapped; shard 0 answers for them. */
+static struct sr_nat_shard *sr_nat_port_shard(struct sr_nat *nat, uint16_t aux_ext) {
+  if (aux_ext < MIN_PORT) {
+    return &(nat->shards[0]);
+  }
+  return &(nat->shards[(aux_ext - MIN_PORT) / SR_NAT_SLICE]);
+}
+
+/* Shard creating mappings for internal host ip_int. */
+static struct sr_nat_shard *sr_nat_host_shard(struct sr_nat *nat, uint32_t ip_int) {
+  return &(nat->shards[sr_hash_mix32(ip_int) % SR_NAT_SHARDS]);
+}
+
+/* Index of ip in the address pool, or -1. */
+static int sr_nat_pool_index(struct sr_nat *nat, uint32_t ip) {
+  int i, n = __atomic_load_n(&(nat->pool_size), __ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++) {
+    if (nat->pool[i] == ip) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Pool index of the external address paired with internal host ip_int, or
+   -1 while the pool is empty. Uses other hash bits than the shard choice,
+   so every shard spreads its hosts over the whole pool. */
+static int sr_nat_host_pool(struct sr_nat *nat, uint32_t ip_int) {
+  int n = __atomic_load_n(&(nat->pool_size), __ATOMIC_ACQUIRE);
+  if (n == 0) {
+    return -1;
+  }
+  return (sr_hash_mix32(ip_int) >> 16) % n;
+}
+
+/* Live connection for the 5-tuple, or NULL. Caller holds the shard lock or
+   is in an epoch section. */
+static struct sr_nat_connection *sr_nat_find_conn(struct sr_nat_shard *shard,
+  uint32_t ip_ext, uint16_t aux_ext, uint32_t ip_dst, uint16_t aux_dst) {
+  struct sr_nat_conn_key key;
+  key.ip_ext = ip_ext;
+  key.aux_ext = aux_ext;
+  key.ip_dst = ip_dst;
+  key.aux_dst = aux_dst;
+  return sr_hash_find(&(shard->conn_index), sr_nat_tuple_hash(ip_ext, aux_ext, ip_dst, aux_dst),
+    &key, sr_nat_conn_match);
+}
+
+/* Live mapping for (ip_ext, aux_ext, type), or NULL. Caller holds the shard
+   lock or is in an epoch section. */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat_shard *shard,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+  struct sr_nat_mapping key;
+  key.ip_ext = ip_ext;
+  key.aux_ext = aux_ext;
+  key.type = type;
+  return sr_hash_find(&(shard->ext_index), sr_nat_ext_hash(&key), &key, sr_nat_ext_match);
+}
+
+/* Live mapping for (ip_int, aux_int, type), or NULL. Caller holds the shard
+   lock or is in an epoch section. */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type) {
+  struct sr_nat_mapping key;
+  key.ip_int = ip_int;
+  key.aux_int = aux_int;
+  key.type = type;
+  return sr_hash_find(&(shard->int_index), sr_nat_int_hash(&key), &key, sr_nat_int_match);
+}
+
+/* Counter record for internal host ip_int, created on demand if create is
+   set. Returns NULL if there is none (or no memory). Caller holds the shard
+   lock. */
+static struct sr_nat_host *sr_nat_host_get(struct sr_nat_shard *shard, uint32_t ip_int,
+  int create) {
+  struct sr_nat_host **bucket = &(shard->hosts[sr_hash_mix32(ip_int) % SR_NAT_HOST_BUCKETS]);
+  struct sr_nat_host *host;
+
+  for (host = *bucket; host; host = host->next) {
+    if (host->ip_int == ip_int) {
+      return host;
+    }
+  }
+  if (!create || (host = (struct sr_nat_host *) calloc(1, sizeof(struct sr_nat_host))) == NULL) {
+    return NULL;
+  }
+  host->ip_int = ip_int;
+  host->next = *bucket;
+  *bucket = host;
+  shard->nhosts++;
+  return host;
+}
+
+/* Drops host's record once it holds no mappings. Caller holds the shard
+   lock. */
+static void sr_nat_host_put(struct sr_nat_shard *shard, struct sr_nat_host *host) {
+  struct sr_nat_host **pp;
+
+  if (host->mappings > 0) {
+    return;
+  }
+  for (pp = &(shard->hosts[sr_hash_mix32(host->ip_int) % SR_NAT_HOST_BUCKETS]); *pp != host;
+       pp = &((*pp)->next)) {
+  }
+  *pp = host->next;
+  free(host);
+  shard->nhosts--;
+}
+
+static int sr_nat_conn_half_open(sr_nat_conn_states state) {
+  return state == nat_conn_syn || state == nat_conn_synack;
+}
+
+/* Called as conn enters (on set) or leaves a half-open state. Keeps the
+   owning host's half-open count and the shard's oldest-first list of
+   half-open connections. Caller holds the shard lock. */
+static void sr_nat_conn_embryonic(struct sr_nat_shard *shard, struct sr_nat_connection *conn,
+  int on) {
+  conn->mapping->host->half_open += on ? 1 : -1;
+  if (on) {
+    conn->emb_next = NULL;
+    conn->emb_prev = shard->emb_tail;
+    if (shard->emb_tail) {
+      shard->emb_tail->emb_next = conn;
+    }
+    else {
+      shard->emb_head = conn;
+    }
+    shard->emb_tail = conn;
+    return;
+  }
+  if (conn->emb_prev) {
+    conn->emb_prev->emb_next = conn->emb_next;
+  }
+  else {
+    shard->emb_head = conn->emb_next;
+  }
+  if (conn->emb_next) {
+    conn->emb_next->emb_prev = conn->emb_prev;
+  }
+  else {
+    shard->emb_tail = conn->emb_prev;
+  }
+}
+
+/* Bytes held by live mappings and connections (and by those retired but
+   not yet reclaimed). */
+static uint64_t sr_nat_mem_used(struct sr_nat *nat) {
+  return __atomic_load_n(&(nat->mapping_slab.in_use), __ATOMIC_RELAXED) * nat->mapping_slab.size +
+    __atomic_load_n(&(nat->conn_slab.in_use), __ATOMIC_RELAXED) * nat->conn_slab.size;
+}
+
+/* Memory in use as a percentage of the budget; 0 without one. */
+static uint32_t sr_nat_pressure(struct sr_nat *nat) {
+  if (nat->mem_budget == 0) {
+    return 0;
+  }
+  return (uint32_t)(sr_nat_mem_used(nat) * 100 / nat->mem_budget);
+}
+
+/* base shortened for pressure: untouched up to SR_NAT_PRESSURE_LOW, down to
+   floor (but never up to it) at SR_NAT_PRESSURE_HIGH. */
+static uint16_t sr_nat_scale_timeout(uint16_t base, uint16_t floor, uint32_t pressure) {
+  if (pressure <= SR_NAT_PRESSURE_LOW || base <= floor) {
+    return base;
+  }
+  if (pressure >= SR_NAT_PRESSURE_HIGH) {
+    return floor;
+  }
+  return (uint16_t)(base - (uint32_t)(base - floor) * (pressure - SR_NAT_PRESSURE_LOW) /
+    (SR_NAT_PRESSURE_HIGH - SR_NAT_PRESSURE_LOW));
+}
+
+/* Takes an external port on pool address number pool for internal host
+   ip_int. Returns the port or -1. Caller holds the shard lock. */
+static int sr_nat_port_get(struct sr_nat *nat, struct sr_nat_shard *shard, int pool,
+  uint32_t ip_int, sr_nat_mapping_type type) {
+  if (nat->port_blocks) {
+    return sr_portblock_get(shard->blocks[pool], ip_int, type);
+  }
+  return sr_portalloc_get(&(shard->ports[pool][type]));
+}
+
+/* Inverse of sr_nat_port_get. Caller holds the shard lock. */
+static void sr_nat_port_put(struct sr_nat *nat, struct sr_nat_shard *shard, int pool,
+  uint32_t ip_int, sr_nat_mapping_type type, uint16_t port) {
+  if (nat->port_blocks) {
+    sr_portblock_put(shard->blocks[pool], ip_int, type, port);
+  }
+  else {
+    sr_portalloc_put(&(shard->ports[pool][type]), port);
+  }
+}
+
+/* Block assignments are all that port-block mode logs; together with the
+   time they tell which host held an external port. arg is the pool
+   address the blocks are on. */
+static void sr_nat_block_event(void *arg, int assigned, uint32_t ip,
+  uint16_t lo, uint16_t hi) {
+  char int_s[INET_ADDRSTRLEN], ext_s[INET_ADDRSTRLEN];
+
+  inet_ntop(AF_INET, &ip, int_s, sizeof(int_s));
+  inet_ntop(AF_INET, arg, ext_s, sizeof(ext_s));
+  printf("%ld NAT BLOCK %s %s %s:%u-%u\n", (long) time(NULL),
+    assigned ? "ASSIGN" : "RELEASE", int_s, ext_s, lo, hi);
+}
+
+/* Sets or clears the prefilter bit for a mapping's external port. A bitmap
+   word can cover ports of two shards, hence the atomics. Caller holds the
+   shard lock. */
+static void sr_nat_mark_mapped(struct sr_nat *nat, struct sr_nat_mapping *mapping, int on) {
+  uint32_t *map = nat->mapped[sr_nat_pool_index(nat, mapping->ip_ext)];
+  uint32_t bit = (uint32_t)mapping->type * 65536 + mapping->aux_ext;
+
+  if (on) {
+    __atomic_or_fetch(&(map[bit / 32]), 1u << (bit % 32), __ATOMIC_RELEASE);
+  }
+  else {
+    __atomic_and_fetch(&(map[bit / 32]), ~(1u << (bit % 32)), __ATOMIC_RELEASE);
+  }
+}
+
+/* Adds a mapping to the prefilter, to both indexes and to the head of the
+   mapping list. Returns -1 if an index cannot grow, leaving the mapping in
+   none of them; a reader may already have found it through the external
+   index, so the caller retires rather than frees it, and still owns its
+   port and timer. Caller holds the shard lock. */
+static int sr_nat_link_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  /* set before the mapping is published, so a reader that can find it never
+     sees the bit clear */
+  sr_nat_mark_mapped(nat, mapping, 1);
+  if (sr_hash_insert(&(shard->ext_index), mapping) != 0) {
+    sr_nat_mark_mapped(nat, mapping, 0);
+    return -1;
+  }
+  if (sr_hash_insert(&(shard->int_index), mapping) != 0) {
+    sr_hash_remove(&(shard->ext_index), mapping);
+    sr_nat_mark_mapped(nat, mapping, 0);
+    return -1;
+  }
+
+  mapping->prev = NULL;
+  mapping->next = shard->mappings;
+  if (shard->mappings) {
+    shard->mappings->prev = mapping;
+  }
+  SR_PUBLISH(shard->mappings, mapping);
+  return 0;
+}
+
+/* Inverse of sr_nat_link_mapping; also gives the external port back to the
+   allocator. mapping->next is left alone so a lock-free reader standing on
+   the mapping can still walk on. Does not free. Caller holds the shard
+   lock. */
+static void sr_nat_unlink_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  if (mapping->prev) {
+    SR_PUBLISH(mapping->prev->next, mapping->next);
+  }
+  else {
+    SR_PUBLISH(shard->mappings, mapping->next);
+  }
+  if (mapping->next) {
+    mapping->next->prev = mapping->prev;
+  }
+
+  sr_hash_remove(&(shard->ext_index), mapping);
+  sr_hash_remove(&(shard->int_index), mapping);
+  sr_nat_mark_mapped(nat, mapping, 0);
+  if (mapping->flow_pinned) {
+    sr_flowcache_invalidate(nat->flows);
+  }
+  sr_nat_port_put(nat, shard, sr_nat_pool_index(nat, mapping->ip_ext), mapping->ip_int,
+    mapping->type, mapping->aux_ext);
+}
+
+/* Deadline for a connection in the given state last seen at last_updated,
+   under the timeouts the memory budget currently allows. */
+static time_t sr_nat_state_deadline(struct sr_nat *nat, sr_nat_conn_states state,
+  time_t last_updated) {
+  if (state == nat_conn_est) {
+    return last_updated + __atomic_load_n(&(nat->cur_est_to), __ATOMIC_RELAXED);
+  }
+  if (state == nat_conn_time_wait) {
+    return last_updated + SR_NAT_TIME_WAIT_TO;
+  }
+  return last_updated + __atomic_load_n(&(nat->cur_trans_to), __ATOMIC_RELAXED);
+}
+
+/* Deadline for a connection in its current state. Packets only bump
+   last_updated; the timer is moved lazily when it fires early. */
+static time_t sr_nat_conn_deadline(struct sr_nat *nat, struct sr_nat_connection *conn) {
+  return sr_nat_state_deadline(nat, conn->state,
+    __atomic_load_n(&(conn->last_updated), __ATOMIC_RELAXED));
+}
+
+static void sr_nat_conn_free(struct sr_epoch_entry *entry, void *slab) {
+  sr_slab_free((struct sr_slab *) slab,
+    SR_EPOCH_OWNER(entry, struct sr_nat_connection, retire));
+}
+
+static void sr_nat_mapping_free(struct sr_epoch_entry *entry, void *slab) {
+  sr_slab_free((struct sr_slab *) slab,
+    SR_EPOCH_OWNER(entry, struct sr_nat_mapping, retire));
+}
+
+/* Undoes the setup of a mapping sr_nat_link_mapping() refused: its timer,
+   its host's count and its port, then retires it. Caller holds the shard
+   lock. */
+static void sr_nat_drop_unlinked(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  sr_timer_cancel(&(shard->wheel), &(mapping->timer));
+  mapping->host->mappings--;
+  sr_nat_host_put(shard, mapping->host);
+  sr_nat_port_put(nat, shard, sr_nat_pool_index(nat, mapping->ip_ext), mapping->ip_int,
+    mapping->type, mapping->aux_ext);
+  sr_epoch_retire(&(nat->epoch), &(mapping->retire), sr_nat_mapping_free,
+    &(nat->mapping_slab));
+}
+
+/* Adds conn to the connection index and the head of its mapping's
+   connection list, and arms its timer. Returns -1, with conn linked
+   nowhere and free to go straight back to the slab, if the index cannot
+   grow. Caller holds the lock of the mapping's shard. */
+static int sr_nat_link_conn(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, struct sr_nat_connection *conn) {
+  conn->mapping = mapping;
+  if (sr_hash_insert(&(shard->conn_index), conn) != 0) {
+    return -1;
+  }
+  conn->prev = NULL;
+  conn->next = mapping->conns;
+  if (mapping->conns) {
+    mapping->conns->prev = conn;
+  }
+  SR_PUBLISH(mapping->conns, conn);
+
+  sr_timer_init(&(conn->timer), SR_NAT_TIMER_CONN, conn);
+  sr_timer_schedule(&(shard->wheel), &(conn->timer), sr_nat_conn_deadline(nat, conn));
+  sr_timer_cancel(&(shard->wheel), &(mapping->timer));
+  return 0;
+}
+
+/* Takes conn off its mapping and the wheel. A TCP mapping left with no
+   connections is queued to go on the next tick. Does not free; the caller
+   retires conn. Caller holds the shard lock. */
+static void sr_nat_unlink_conn(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_connection *conn) {
+  struct sr_nat_mapping *mapping = conn->mapping;
+
+  if (conn->prev) {
+    SR_PUBLISH(conn->prev->next, conn->next);
+  }
+  else {
+    SR_PUBLISH(mapping->conns, conn->next);
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  sr_hash_remove(&(shard->conn_index), conn);
+  sr_timer_cancel(&(shard->wheel), &(conn->timer));
+  if (conn->flow_pinned) {
+    sr_flowcache_invalidate(nat->flows);
+  }
+  if (sr_nat_conn_half_open(conn->state)) {
+    sr_nat_conn_embryonic(shard, conn, 0);
+  }
+
+  if (mapping->conns == NULL) {
+    sr_timer_schedule(&(shard->wheel), &(mapping->timer), shard->wheel.now + 1);
+  }
+}
+
+/* Removes a mapping from every structure and retires it together with its
+   connections. Caller holds the shard lock. */
+static void sr_nat_free_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+  struct sr_nat_connection *conn, *next;
+
+  sr_nat_unlink_mapping(nat, shard, mapping);
+  sr_timer_cancel(&(shard->wheel), &(mapping->timer));
+  for (conn = mapping->conns; conn; conn = next) {
+    next = conn->next;
+    sr_hash_remove(&(shard->conn_index), conn);
+    sr_timer_cancel(&(shard->wheel), &(conn->timer));
+    if (conn->flow_pinned) {
+      sr_flowcache_invalidate(nat->flows);
+    }
+    if (sr_nat_conn_half_open(conn->state)) {
+      sr_nat_conn_embryonic(shard, conn, 0);
+    }
+    sr_epoch_retire(&(nat->epoch), &(conn->retire), sr_nat_conn_free,
+      &(nat->conn_slab));
+  }
+  mapping->host->mappings--;
+  sr_nat_host_put(shard, mapping->host);
+  sr_epoch_retire(&(nat->epoch), &(mapping->retire), sr_nat_mapping_free,
+    &(nat->mapping_slab));
+}
+
+/* Mapping timer fired. ICMP mappings go once idle for icmp_to; TCP mappings
+   go once they have no connections left. Caller holds the shard lock. */
+static void sr_nat_expire_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, time_t now) {
+  if (mapping->type == nat_mapping_icmp) {
+    time_t deadline = __atomic_load_n(&(mapping->last_updated), __ATOMIC_RELAXED) + nat->icmp_to;
+    if (deadline > now) {
+      sr_timer_schedule(&(shard->wheel), &(mapping->timer), deadline);
+      return;
+    }
+  }
+  else if (mapping->conns) {
+    return;
+  }
+  sr_nat_free_mapping(nat, shard, mapping);
+}
+
+/* Connection timer fired. Caller holds the shard lock. */
+static void sr_nat_expire_conn(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_connection *conn, time_t now) {
+  time_t deadline = sr_nat_conn_deadline(nat, conn);
+
+  if (deadline > now) {
+    sr_timer_schedule(&(shard->wheel), &(conn->timer), deadline);
+    return;
+  }
+  sr_nat_unlink_conn(nat, shard, conn);
+  sr_epoch_retire(&(nat->epoch), &(conn->retire), sr_nat_conn_free,
+    &(nat->conn_slab));
+}
+
+/* Drops the shard's oldest half-open connection. Returns 0 if it has none.
+   Caller holds the shard lock. */
+static int sr_nat_evict_embryonic(struct sr_nat *nat, struct sr_nat_shard *shard) {
+  struct sr_nat_connection *conn = shard->emb_head;
+
+  if (conn == NULL) {
+    return 0;
+  }
+  sr_nat_unlink_conn(nat, shard, conn);
+  sr_epoch_retire(&(nat->epoch), &(conn->retire), sr_nat_conn_free,
+    &(nat->conn_slab));
+  shard->evicted++;
+  return 1;
+}
+
+/* Timers set before the timeouts shrank would still fire at the old,
+   later deadlines. Under pressure this rechecks a bounded run of the
+   shard's connections each tick, clock-hand fashion, so every connection
+   is seen within a few ticks. Caller holds the shard lock. */
+static void sr_nat_reap(struct sr_nat *nat, struct sr_nat_shard *shard, time_t now) {
+  uint32_t n, cap = sr_hash_capacity(&(shard->conn_index));
+  struct sr_nat_connection *conn;
+
+  for (n = 0; n < SR_NAT_REAP_BATCH && n < cap; n++) {
+    shard->reap_hand %= cap;
+    conn = sr_hash_slot(&(shard->conn_index), shard->reap_hand++);
+    if (conn) {
+      sr_nat_expire_conn(nat, shard, conn, now);
+    }
+  }
+}
+
+int sr_nat_init(struct sr_instance *sr, int icmp_to, int tcp_est_to, int tcp_trans_to,
+  unsigned long max_flows, int port_blocks) { /* Initializes the nat */
   assert(sr);
   struct sr_nat *nat = sr->nat;
   assert(nat);
@@ -27,7 +551,13 @@ int sr_nat_init(struct sr_instance *sr, int icmp_to, int tcp_est_to, int tcp_tra
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+  int success = 0, i;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    success |= pthread_mutex_init(&(nat->shards[i].lock), &(nat->attr));
+  }
+  success |= pthread_mutex_init(&(nat->syn_lock), NULL);
+  success |= pthread_mutex_init(&(nat->dnat_lock), NULL);
+  success |= pthread_mutex_init(&(nat->ckpt_lock), NULL);
 
   /* Initialize timeout thread */
 
@@ -39,16 +569,65 @@ int sr_nat_init(struct sr_instance *sr, int icmp_to, int tcp_est_to, int tcp_tra
   
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  nat->mappings = NULL;
-  nat->next_port = MIN_PORT;
+  nat->flows = sr->flows;
+  if (sr_epoch_init(&(nat->epoch)) != 0) {
+    return -1;
+  }
+  if (sr_slab_init(&(nat->mapping_slab), sizeof(struct sr_nat_mapping), max_flows) != 0 ||
+      sr_slab_init(&(nat->conn_slab), sizeof(struct sr_nat_connection), max_flows) != 0) {
+    return -1;
+  }
+  /* port allocators and prefilter bitmaps come with the addresses, see
+     sr_nat_add_address() */
+  nat->pool_size = 0;
+  memset(nat->mapped, 0, sizeof(nat->mapped));
+  nat->dnat = NULL;
+  nat->dnat_path = NULL;
+  nat->dnat_reload = 0;
+  nat->ckpt_path = NULL;
+  nat->ckpt_pending = NULL;
+  nat->port_blocks = port_blocks;
+  nat->host_max_mappings = nat->host_max_half_open = 0;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    shard->mappings = NULL;
+    memset(shard->ports, 0, sizeof(shard->ports));
+    memset(shard->blocks, 0, sizeof(shard->blocks));
+    memset(shard->hosts, 0, sizeof(shard->hosts));
+    shard->nhosts = 0;
+    shard->refused_mappings = shard->refused_half_open = 0;
+    shard->emb_head = shard->emb_tail = NULL;
+    shard->evicted = 0;
+    shard->reap_hand = 0;
+    if (sr_hash_init(&(shard->int_index), SR_NAT_INDEX_SZ, sr_nat_int_hash, &(nat->epoch)) != 0 ||
+        sr_hash_init(&(shard->ext_index), SR_NAT_INDEX_SZ, sr_nat_ext_hash, &(nat->epoch)) != 0 ||
+        sr_hash_init(&(shard->conn_index), SR_NAT_INDEX_SZ, sr_nat_conn_hash, &(nat->epoch)) != 0) {
+      return -1;
+    }
+    sr_timerwheel_init(&(shard->wheel), time(NULL));
+  }
+  if (sr_synhold_init(&(nat->syns), SR_NAT_SYNHOLD) != 0) {
+    return -1;
+  }
 
   nat->icmp_to=icmp_to;
   nat->tcp_est_to=tcp_est_to;
   nat->tcp_trans_to=tcp_trans_to;
+  nat->mem_budget = 0;
+  nat->cur_est_to = tcp_est_to;
+  nat->cur_trans_to = tcp_trans_to;
 
   printf("ICMP TIMEOUT: %d\n", icmp_to);
   printf("TCP EST TIMEOUT: %d\n", tcp_est_to);
   printf("ICMP TIMEOUT: %d\n", tcp_trans_to);
+  if (max_flows) {
+    printf("MAX FLOWS: %lu\n", max_flows);
+  }
+  if (port_blocks) {
+    printf("PORT BLOCKS: %d ports, at most %d per host\n", SR_PORTBLOCK_SZ,
+      SR_PORTBLOCK_PER_HOST);
+  }
 
   /* Initialize any variables here */
 
@@ -58,376 +637,1115 @@ int sr_nat_init(struct sr_instance *sr, int icmp_to, int tcp_est_to, int tcp_tra
 
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  pthread_mutex_lock(&(nat->lock));
+  int i, j, err = 0;
 
+  /* a clean shutdown saves the very latest state */
+  if (nat->ckpt_path) {
+    sr_nat_checkpoint(nat);
+  }
 
   /* free nat memory here */
-  if(nat->mappings){
-    struct sr_nat_mapping *cur = NULL, *next = NULL;
-    cur = nat->mappings;
-    while(cur->next){
-      next = cur->next;
-      free(cur);
-      cur = next;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    while(shard->mappings){
+      sr_nat_free_mapping(nat, shard, shard->mappings);
     }
-    free(cur);
+    sr_hash_destroy(&(shard->int_index));
+    sr_hash_destroy(&(shard->ext_index));
+    sr_hash_destroy(&(shard->conn_index));
+    for (j = 0; j < nat->pool_size; j++) {
+      if (shard->ports[j]) {
+        sr_portalloc_destroy(&(shard->ports[j][nat_mapping_icmp]));
+        sr_portalloc_destroy(&(shard->ports[j][nat_mapping_tcp]));
+        free(shard->ports[j]);
+      }
+      if (shard->blocks[j]) {
+        sr_portblock_destroy(shard->blocks[j]);
+        free(shard->blocks[j]);
+      }
+    }
+  }
+  for (j = 0; j < nat->pool_size; j++) {
+    free(nat->mapped[j]);
   }
 
   pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+  sr_epoch_destroy(&(nat->epoch));
+  sr_slab_destroy(&(nat->conn_slab));
+  sr_slab_destroy(&(nat->mapping_slab));
+  sr_synhold_destroy(&(nat->syns));
+  sr_dnat_free(nat->dnat);
+  free(nat->dnat_path);
+  free(nat->ckpt_path);
+  free(nat->ckpt_pending);
+  err |= pthread_mutex_destroy(&(nat->dnat_lock));
+  err |= pthread_mutex_destroy(&(nat->ckpt_lock));
+  err |= pthread_mutex_destroy(&(nat->syn_lock));
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_unlock(&(nat->shards[i].lock));
+    err |= pthread_mutex_destroy(&(nat->shards[i].lock));
+  }
+  return err && pthread_mutexattr_destroy(&(nat->attr));
 
 }
 
 void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
   struct sr_instance *sr = sr_ptr;
   struct sr_nat *nat = sr->nat;
-  char outgoing_iface[sr_IFACE_NAMELEN];
+  int i, j;
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
-    
-    int mapping_time=0, conn_time =0;
+
     time_t curtime = time(NULL);
+    uint8_t syn[SR_SYNHOLD_PKT];
+    unsigned int syn_len;
+    uint32_t pressure = sr_nat_pressure(nat);
+
+    __atomic_store_n(&(nat->cur_est_to),
+      sr_nat_scale_timeout(nat->tcp_est_to, SR_NAT_EST_TO_MIN, pressure), __ATOMIC_RELAXED);
+    __atomic_store_n(&(nat->cur_trans_to),
+      sr_nat_scale_timeout(nat->tcp_trans_to, SR_NAT_TRANS_TO_MIN, pressure), __ATOMIC_RELAXED);
+
+    /* one shard at a time, so traffic on the others is never held up */
+    for(i = 0; i < SR_NAT_SHARDS; i++){
+      struct sr_nat_shard *shard = &(nat->shards[i]);
+      pthread_mutex_lock(&(shard->lock));
+      struct sr_timer *timer = sr_timerwheel_advance(&(shard->wheel), curtime), *next_timer = NULL;
+
+      /* only the timers that fell due are visited */
+      for(; timer; timer = next_timer){
+        next_timer = timer->next;
+        if(timer->kind == SR_NAT_TIMER_MAPPING){
+          sr_nat_expire_mapping(nat, shard, timer->data, curtime);
+        }
+        else{
+          sr_nat_expire_conn(nat, shard, timer->data, curtime);
+        }
+      }
+      if(pressure > SR_NAT_PRESSURE_LOW){
+        sr_nat_reap(nat, shard, curtime);
+      }
+      /* evictions only show in the pressure once reclaimed, so take a
+         bounded batch rather than waiting for it to drop */
+      for(j = 0; pressure >= SR_NAT_PRESSURE_HIGH && j < SR_NAT_EVICT_BATCH &&
+          sr_nat_evict_embryonic(nat, shard); j++){
+      }
+      pthread_mutex_unlock(&(shard->lock));
+    }
+
+    /* answer the unsolicited SYNs nobody inside picked up, one at a time
+       so the lock is not held while sending */
+    while(1){
+      pthread_mutex_lock(&(nat->syn_lock));
+      syn_len = sr_synhold_expire(&(nat->syns), curtime, syn);
+      pthread_mutex_unlock(&(nat->syn_lock));
+      if(syn_len == 0){
+        break;
+      }
+
+      uint8_t* ip_data = syn +  sizeof(sr_ethernet_hdr_t);
+      sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(ip_data);
+
+      sr_epoch_enter(&(sr->rt_epoch));
+      const struct sr_nexthop* nh = sr_lookup_nexthop(sr, iphdr->ip_src);
+
+      if(nh){
+        handle_icmp(sr, syn, syn_len, nh->iface, 3, 3);
+      }
+      sr_epoch_exit(&(sr->rt_epoch));
+    }
+
+    if(__atomic_exchange_n(&(nat->dnat_reload), 0, __ATOMIC_RELAXED) && nat->dnat_path){
+      sr_nat_load_static(nat, nat->dnat_path);
+    }
+
+    if(__atomic_load_n(&(nat->ckpt_path), __ATOMIC_ACQUIRE) && curtime >= nat->ckpt_next){
+      sr_nat_checkpoint(nat);
+      nat->ckpt_next = curtime + SR_NAT_CKPT_INTERVAL;
+    }
+
+    /* free whatever lookups can no longer be looking at */
+    sr_epoch_reclaim(&(nat->epoch));
+  }
+  return NULL;
+}
+
+void sr_nat_delete_conn(struct sr_nat *nat, struct sr_nat_connection *conn){
+  struct sr_nat_shard *shard = sr_nat_port_shard(nat, conn->mapping->aux_ext);
+  pthread_mutex_lock(&(shard->lock));
+  sr_nat_unlink_conn(nat, shard, conn);
+  sr_epoch_retire(&(nat->epoch), &(conn->retire), sr_nat_conn_free,
+    &(nat->conn_slab));
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Port allocators for pool address number n in one shard's slice. Returns
+   0 on success. Caller holds the shard lock. */
+static int sr_nat_shard_add_address(struct sr_nat *nat, struct sr_nat_shard *shard,
+  int n, uint16_t lo, uint16_t hi){
+  if(nat->port_blocks){
+    struct sr_portblock *pb = (struct sr_portblock *) malloc(sizeof(struct sr_portblock));
+    if(pb == NULL ||
+       sr_portblock_init(pb, lo, hi, MAX_HOSTS, sr_nat_block_event, &(nat->pool[n])) != 0){
+      free(pb);
+      return -1;
+    }
+    shard->blocks[n] = pb;
+    return 0;
+  }
+
+  struct sr_portalloc *ports = (struct sr_portalloc *)
+    calloc(SR_NAT_MAPPING_TYPES, sizeof(struct sr_portalloc));
+  if(ports == NULL ||
+     sr_portalloc_init(&(ports[nat_mapping_icmp]), lo, hi) != 0 ||
+     sr_portalloc_init(&(ports[nat_mapping_tcp]), lo, hi) != 0){
+    if(ports){
+      sr_portalloc_destroy(&(ports[nat_mapping_icmp]));
+      sr_portalloc_destroy(&(ports[nat_mapping_tcp]));
+    }
+    free(ports);
+    return -1;
+  }
+  shard->ports[n] = ports;
+  return 0;
+}
 
-    
-    struct sr_nat_mapping *mapping = nat->mappings;
-    while(mapping){
-      mapping_time = difftime(curtime,mapping->last_updated);
-      if (mapping->type == nat_mapping_icmp && mapping_time>=nat->icmp_to){
-        sr_nat_delete_mapping(nat,mapping);
+/* Reserves (on set) or gives back the dynamic-range external ports that the
+   rules in d forward, in the allocators of pool address pool, or of every
+   address if pool is -1. Ports that keep (which may be NULL) still forwards
+   on an address stay reserved. Caller holds dnat_lock. */
+static void sr_nat_reserve_static(struct sr_nat *nat, struct sr_dnat *d, int pool,
+  int on, struct sr_dnat *keep){
+  int i, j, n = pool < 0 ? nat->pool_size : pool + 1;
+  uint32_t k;
+
+  for(i = 0; i < SR_NAT_SHARDS; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    for(k = 0; k < d->nrules; k++){
+      struct sr_dnat_rule *r = &(d->rules[k]);
+      if(r->aux_ext < MIN_PORT || sr_nat_port_shard(nat, r->aux_ext) != shard){
+        continue;
       }
-      else if(mapping->type==nat_mapping_tcp)
-      {
-        if (mapping->conns == NULL){
-          sr_nat_delete_mapping(nat,mapping);
+      for(j = pool < 0 ? 0 : pool; j < n; j++){
+        if((r->ip_ext && r->ip_ext != nat->pool[j]) ||
+           (keep && sr_dnat_find_ext(keep, nat->pool[j], r->aux_ext))){
+          continue;
         }
-        else{
-          struct sr_nat_connection *prev=NULL, *conn = mapping->conns;
-          while(conn){
-            conn_time = difftime(curtime, conn->last_updated);
-            if(conn_time>=nat->tcp_est_to && conn->state == nat_conn_est)
-            {
-              sr_nat_delete_conn(mapping, prev, conn);
-            }
-            else if(conn_time>=nat->tcp_trans_to && conn->state != nat_conn_est)
-            {
-              sr_nat_delete_conn(mapping, prev, conn);
-            }
-            else if(conn_time>=6 && conn->packet != NULL){
-                uint8_t* ip_data = conn->packet +  sizeof(sr_ethernet_hdr_t);
-                sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(ip_data);
-
-                sr_longest_prefix_iface(sr, iphdr->ip_src, outgoing_iface);
-                struct sr_if* iface = sr_get_interface(sr, outgoing_iface);
-
-                handle_icmp(sr, conn->packet, conn->len, iface, 3, 3);
-              
-                sr_nat_delete_conn(mapping, prev, conn);
-
-              }
-              prev=conn;
-              conn=conn->next;
+        if(shard->blocks[j]){
+          if(on){
+            sr_portblock_reserve(shard->blocks[j], nat_mapping_tcp, r->aux_ext);
+          }
+          else{
+            sr_portblock_unreserve(shard->blocks[j], nat_mapping_tcp, r->aux_ext);
+          }
+        }
+        else if(shard->ports[j]){
+          if(on){
+            sr_portalloc_reserve(&(shard->ports[j][nat_mapping_tcp]), r->aux_ext);
+          }
+          else{
+            sr_portalloc_unreserve(&(shard->ports[j][nat_mapping_tcp]), r->aux_ext);
           }
         }
       }
-      mapping = mapping->next;
-      
-
     }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
 
-    pthread_mutex_unlock(&(nat->lock));
+/* The first rule in d, and in *ip_ext the address, whose external port a
+   live dynamic mapping holds on an address the rule applies to, or NULL.
+   Rules keep (which may be NULL) already had are skipped: their ports were
+   never free. Caller holds dnat_lock and has reserved d's ports, so no new
+   mapping can take one meanwhile. */
+static const struct sr_dnat_rule *sr_nat_static_conflict(struct sr_nat *nat,
+  struct sr_dnat *d, struct sr_dnat *keep, uint32_t *ip_ext){
+  struct sr_nat_shard *shard;
+  uint32_t k;
+  int j, held;
+
+  for(k = 0; k < d->nrules; k++){
+    struct sr_dnat_rule *r = &(d->rules[k]);
+    if(r->aux_ext < MIN_PORT){
+      continue;
+    }
+    shard = sr_nat_port_shard(nat, r->aux_ext);
+    pthread_mutex_lock(&(shard->lock));
+    for(j = 0, held = 0; j < nat->pool_size && !held; j++){
+      if((r->ip_ext && r->ip_ext != nat->pool[j]) ||
+         (keep && sr_dnat_find_ext(keep, nat->pool[j], r->aux_ext))){
+        continue;
+      }
+      if(sr_nat_find_external(shard, nat->pool[j], r->aux_ext, nat_mapping_tcp)){
+        *ip_ext = nat->pool[j];
+        held = 1;
+      }
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    if(held){
+      return r;
+    }
   }
   return NULL;
 }
-void sr_nat_delete_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *prev, 
-  struct sr_nat_connection *conn){
-  if (prev){
-    prev->next = conn->next;
+
+static void sr_nat_dnat_free(struct sr_epoch_entry *entry, void *arg){
+  sr_dnat_free((struct sr_dnat *)((char *) entry - offsetof(struct sr_dnat, retire)));
+}
+
+int sr_nat_add_address(struct sr_nat *nat, uint32_t ip){
+  int i, err = 0, n = nat->pool_size;
+
+  if(sr_nat_pool_index(nat, ip) >= 0){
+    return 0;
   }
-  else{
-    mapping->conns = conn->next;
+  if(n == SR_NAT_POOL_MAX){
+    return -1;
+  }
+  nat->pool[n] = ip;
+  if(nat->mapped[n] == NULL){
+    nat->mapped[n] = (uint32_t *) calloc(SR_NAT_MAPPING_TYPES * 65536 / 32, sizeof(uint32_t));
+    if(nat->mapped[n] == NULL){
+      return -1;
+    }
+  }
+  for(i = 0; i < SR_NAT_SHARDS && !err; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    int lo = MIN_PORT + i * SR_NAT_SLICE;
+    int hi = lo + SR_NAT_SLICE - 1 > MAX_PORT ? MAX_PORT : lo + SR_NAT_SLICE - 1;
+
+    pthread_mutex_lock(&(shard->lock));
+    /* a shard may keep allocators from an earlier attempt that failed part way */
+    if(shard->ports[n] == NULL && shard->blocks[n] == NULL){
+      err = sr_nat_shard_add_address(nat, shard, n, lo, hi);
+    }
+    pthread_mutex_unlock(&(shard->lock));
+  }
+  if(err){
+    return -1;
+  }
+  /* a reload either sees the new address or has finished before this */
+  pthread_mutex_lock(&(nat->dnat_lock));
+  if(nat->dnat){
+    sr_nat_reserve_static(nat, nat->dnat, n, 1, NULL);
   }
+  /* readers never look past pool_size */
+  __atomic_store_n(&(nat->pool_size), n + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&(nat->dnat_lock));
+  return 0;
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) 
-{
+int sr_nat_load_static(struct sr_nat *nat, const char *path){
+  const struct sr_dnat_rule *r;
+  struct sr_dnat *d, *old;
+  struct in_addr addr;
+  char *copy;
+
+  pthread_mutex_lock(&(nat->dnat_lock));
+  if((d = sr_dnat_load(path)) == NULL){
+    pthread_mutex_unlock(&(nat->dnat_lock));
+    return -1;
+  }
+  /* new ports are out of the allocators before the rules go live, and old
+     ones only go back once nothing forwards them */
+  sr_nat_reserve_static(nat, d, -1, 1, NULL);
+  /* a rule would take over the return traffic of a flow already on its
+     port, so the rules wait until no dynamic mapping holds one */
+  if((r = sr_nat_static_conflict(nat, d, nat->dnat, &(addr.s_addr)))){
+    sr_nat_reserve_static(nat, d, -1, 0, nat->dnat);
+    pthread_mutex_unlock(&(nat->dnat_lock));
+    fprintf(stderr, "DNAT: %s not loaded: port %u on %s is held by a dynamic mapping\n",
+      path, r->aux_ext, inet_ntoa(addr));
+    sr_dnat_free(d);
+    return -1;
+  }
+  if(path != nat->dnat_path && (copy = strdup(path))){
+    free(nat->dnat_path);
+    nat->dnat_path = copy;
+  }
+  old = __atomic_exchange_n(&(nat->dnat), d, __ATOMIC_ACQ_REL);
+  if(old){
+    sr_nat_reserve_static(nat, old, -1, 0, d);
+    sr_epoch_retire(&(nat->epoch), &(old->retire), sr_nat_dnat_free, NULL);
+  }
+  pthread_mutex_unlock(&(nat->dnat_lock));
+  printf("DNAT: %u static ports from %s\n", d->nrules, path);
+  return 0;
+}
+
+void sr_nat_reload_static(struct sr_nat *nat){
+  __atomic_store_n(&(nat->dnat_reload), 1, __ATOMIC_RELAXED);
+}
 
-  pthread_mutex_lock(&(nat->lock));
+/* Makes room for need elements of elem bytes in *array, which holds *size.
+   Returns 0 on success. */
+static int sr_nat_ckpt_grow(void **array, uint32_t *size, uint32_t need, size_t elem){
+  uint32_t n = *size ? *size : 1024;
+  void *p;
+
+  if(need <= *size){
+    return 0;
+  }
+  while(n < need){
+    n *= 2;
+  }
+  if((p = realloc(*array, n * elem)) == NULL){
+    return -1;
+  }
+  *array = p;
+  *size = n;
+  return 0;
+}
 
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *copy = NULL, *mapping = NULL;
-  mapping = nat->mappings;
-  while(mapping){
-    if(mapping->aux_ext == aux_ext && mapping->type == type){
-      mapping->last_updated = time(NULL);
-      copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-      memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+int sr_nat_checkpoint(struct sr_nat *nat){
+  struct sr_natckpt_hdr hdr;
+  struct sr_natckpt_mapping *m = NULL, *rec;
+  struct sr_natckpt_conn *c = NULL;
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+  uint32_t msize = 0, csize = 0;
+  int i, err = 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.npool = nat->pool_size;
+  memcpy(hdr.pool, nat->pool, hdr.npool * sizeof(uint32_t));
+
+  /* a shard at a time, copying out under its lock */
+  for(i = 0; i < SR_NAT_SHARDS && !err; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    for(mapping = shard->mappings; mapping && !err; mapping = mapping->next){
+      if(sr_nat_ckpt_grow((void **) &m, &msize, hdr.nmappings + 1, sizeof(*m)) != 0){
+        err = -1;
+        break;
+      }
+      rec = &(m[hdr.nmappings++]);
+      memset(rec, 0, sizeof(*rec));
+      rec->ip_int = mapping->ip_int;
+      rec->ip_ext = mapping->ip_ext;
+      rec->aux_int = mapping->aux_int;
+      rec->aux_ext = mapping->aux_ext;
+      rec->type = mapping->type;
+      rec->last_updated = __atomic_load_n(&(mapping->last_updated), __ATOMIC_RELAXED);
+      rec->first_conn = hdr.nconns;
+      for(conn = mapping->conns; conn; conn = conn->next){
+        if(sr_nat_ckpt_grow((void **) &c, &csize, hdr.nconns + 1, sizeof(*c)) != 0){
+          err = -1;
+          break;
+        }
+        memset(&(c[hdr.nconns]), 0, sizeof(*c));
+        c[hdr.nconns].ip_dst = conn->ip_dst;
+        c[hdr.nconns].aux_dst = conn->aux_dst;
+        c[hdr.nconns].state = conn->state;
+        c[hdr.nconns].syn_seen = conn->syn_seen;
+        c[hdr.nconns].fin_seen = conn->fin_seen;
+        c[hdr.nconns].last_updated = __atomic_load_n(&(conn->last_updated), __ATOMIC_RELAXED);
+        hdr.nconns++;
+        rec->nconns++;
+      }
     }
-    mapping = mapping->next;
+    pthread_mutex_unlock(&(shard->lock));
   }
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  if(!err){
+    hdr.saved_at = time(NULL);
+    pthread_mutex_lock(&(nat->ckpt_lock));
+    err = sr_natckpt_write(nat->ckpt_path, &hdr, m, c);
+    pthread_mutex_unlock(&(nat->ckpt_lock));
+  }
+  free(m);
+  free(c);
+  return err;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+/* Restores one checkpointed mapping and whichever of its connections are
+   still live at now. Returns 1 if restored, 0 if dropped, -1 if out of
+   memory. */
+static int sr_nat_restore_mapping(struct sr_nat *nat, const struct sr_natckpt *ck,
+  const struct sr_natckpt_mapping *m, time_t now){
+  struct sr_nat_shard *shard = sr_nat_host_shard(nat, m->ip_int);
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+  struct sr_nat_host *host;
+  const struct sr_natckpt_conn *c;
+  int pool = sr_nat_pool_index(nat, m->ip_ext), live = 0, claimed;
+  uint32_t k;
+
+  /* its port must be in its host's shard's slice, as if handed out here */
+  if(pool < 0 || m->type >= SR_NAT_MAPPING_TYPES || m->aux_ext < MIN_PORT ||
+     sr_nat_port_shard(nat, m->aux_ext) != shard){
+    return 0;
+  }
+  if(m->type == nat_mapping_icmp){
+    live = m->last_updated + nat->icmp_to > now;
+  }
+  for(k = 0; k < m->nconns; k++){
+    c = &(ck->conns[m->first_conn + k]);
+    live |= c->state <= nat_conn_time_wait &&
+      sr_nat_state_deadline(nat, c->state, c->last_updated) > now;
+  }
+  if(!live){
+    return 0;
+  }
 
-  pthread_mutex_lock(&(nat->lock));
+  pthread_mutex_lock(&(shard->lock));
+  if(sr_nat_find_internal(shard, m->ip_int, m->aux_int, m->type) ||
+     sr_nat_find_external(shard, m->ip_ext, m->aux_ext, m->type) ||
+     (host = sr_nat_host_get(shard, m->ip_int, 1)) == NULL){
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+  if((mapping = (struct sr_nat_mapping *) sr_slab_alloc(&(nat->mapping_slab))) == NULL){
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return -1;
+  }
+  if(nat->port_blocks){
+    claimed = sr_portblock_claim(shard->blocks[pool], m->ip_int, m->type, m->aux_ext);
+  }
+  else{
+    claimed = sr_portalloc_claim(&(shard->ports[pool][m->type]), m->aux_ext);
+  }
+  if(claimed != 0){
+    sr_slab_free(&(nat->mapping_slab), mapping);
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+  mapping->type = m->type;
+  mapping->ip_int = m->ip_int;
+  mapping->ip_ext = m->ip_ext;
+  mapping->aux_int = m->aux_int;
+  mapping->aux_ext = m->aux_ext;
+  mapping->last_updated = m->last_updated;
+  mapping->conns = NULL;
+  mapping->host = host;
+  mapping->flow_pinned = 0;
+  host->mappings++;
+  sr_timer_init(&(mapping->timer), SR_NAT_TIMER_MAPPING, mapping);
+  if(m->type == nat_mapping_icmp){
+    sr_timer_schedule(&(shard->wheel), &(mapping->timer), m->last_updated + nat->icmp_to);
+  }
+  else{
+    sr_timer_schedule(&(shard->wheel), &(mapping->timer), now + 1);
+  }
+  if(sr_nat_link_mapping(nat, shard, mapping) != 0){
+    /* the claimed port is still in the free ring until settled */
+    if(nat->port_blocks){
+      sr_portblock_settle(shard->blocks[pool]);
+    }
+    else{
+      sr_portalloc_settle(&(shard->ports[pool][m->type]));
+    }
+    sr_nat_drop_unlinked(nat, shard, mapping);
+    pthread_mutex_unlock(&(shard->lock));
+    return -1;
+  }
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL, *mapping = NULL;
-  mapping = nat->mappings;
-  while(mapping){
-    if(mapping->aux_int == aux_int && mapping->ip_int == ip_int && mapping->type == type){
-      mapping->last_updated = time(NULL);
-      copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-      memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
+  for(k = 0; k < m->nconns; k++){
+    c = &(ck->conns[m->first_conn + k]);
+    if(c->state > nat_conn_time_wait ||
+       sr_nat_state_deadline(nat, c->state, c->last_updated) <= now ||
+       sr_nat_find_conn(shard, m->ip_ext, m->aux_ext, c->ip_dst, c->aux_dst)){
+      continue;
+    }
+    if((conn = (struct sr_nat_connection *) sr_slab_alloc(&(nat->conn_slab))) == NULL){
+      break;
+    }
+    conn->ip_dst = c->ip_dst;
+    conn->aux_dst = c->aux_dst;
+    conn->state = c->state;
+    conn->syn_seen = c->syn_seen;
+    conn->fin_seen = c->fin_seen;
+    conn->flow_pinned = 0;
+    conn->last_updated = c->last_updated;
+    if(sr_nat_link_conn(nat, shard, mapping, conn) != 0){
+      sr_slab_free(&(nat->conn_slab), conn);
+      break;
+    }
+    if(sr_nat_conn_half_open(conn->state)){
+      sr_nat_conn_embryonic(shard, conn, 1);
     }
-    mapping = mapping->next;
   }
+  pthread_mutex_unlock(&(shard->lock));
+  return 1;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+int sr_nat_set_checkpoint(struct sr_nat *nat, const char *path){
+  char *copy = strdup(path);
+
+  if(copy == NULL){
+    return -1;
+  }
+  free(nat->ckpt_pending);
+  nat->ckpt_pending = copy;
+  return 0;
+}
+
+int sr_nat_restore_checkpoint(struct sr_nat *nat){
+  struct sr_natckpt ck;
+  char *path = nat->ckpt_pending;
+  time_t now = time(NULL);
+  uint32_t i, restored = 0;
+  int j, n, err = 0;
+
+  if(path == NULL){
+    return 0;
+  }
+  nat->ckpt_pending = NULL;
+  if(sr_natckpt_open(&ck, path) == 0){
+    for(i = 0; i < ck.hdr->nmappings && (n = sr_nat_restore_mapping(nat, &ck,
+        &(ck.mappings[i]), now)) >= 0; i++){
+      restored += n;
+    }
+    err = i < ck.hdr->nmappings ? -1 : 0;
+    /* the claims left their ports in the free rings until now */
+    for(j = 0; j < SR_NAT_SHARDS; j++){
+      struct sr_nat_shard *shard = &(nat->shards[j]);
+      pthread_mutex_lock(&(shard->lock));
+      for(n = 0; n < nat->pool_size; n++){
+        if(shard->blocks[n]){
+          sr_portblock_settle(shard->blocks[n]);
+        }
+        else if(shard->ports[n]){
+          sr_portalloc_settle(&(shard->ports[n][nat_mapping_icmp]));
+          sr_portalloc_settle(&(shard->ports[n][nat_mapping_tcp]));
+        }
+      }
+      pthread_mutex_unlock(&(shard->lock));
+    }
+    printf("NAT: restored %u of %u mappings from %s, saved %lds ago\n", restored,
+      ck.hdr->nmappings, path, (long)(now - ck.hdr->saved_at));
+    sr_natckpt_close(&ck);
+  }
+  nat->ckpt_next = now + SR_NAT_CKPT_INTERVAL;
+  __atomic_store_n(&(nat->ckpt_path), path, __ATOMIC_RELEASE);
+  return err;
+}
+
+int sr_nat_static_lookup_external(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate){
+  const struct sr_dnat_rule *r = NULL;
+  struct sr_dnat *d;
+
+  if(type != nat_mapping_tcp){
+    return 0;
+  }
+  sr_epoch_enter(&(nat->epoch));
+  if((d = SR_CONSUME(nat->dnat)) && (r = sr_dnat_find_ext(d, ip_ext, aux_ext))){
+    xlate->type = type;
+    xlate->ip_int = r->ip_int;
+    xlate->aux_int = r->aux_int;
+    xlate->ip_ext = ip_ext;
+    xlate->aux_ext = aux_ext;
+  }
+  sr_epoch_exit(&(nat->epoch));
+  return r != NULL;
+}
+
+int sr_nat_static_lookup_internal(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate){
+  const struct sr_dnat_rule *r;
+  struct sr_dnat *d;
+  uint32_t ip_ext = 0;
+  int pool;
+
+  if(type != nat_mapping_tcp){
+    return 0;
+  }
+  sr_epoch_enter(&(nat->epoch));
+  if((d = SR_CONSUME(nat->dnat)) && (r = sr_dnat_find_int(d, ip_int, aux_int))){
+    ip_ext = r->ip_ext;
+    /* a rule for every address answers from the host's own one */
+    if(ip_ext == 0 && (pool = sr_nat_host_pool(nat, ip_int)) >= 0){
+      ip_ext = nat->pool[pool];
+    }
+    if(ip_ext){
+      xlate->type = type;
+      xlate->ip_int = ip_int;
+      xlate->aux_int = aux_int;
+      xlate->ip_ext = ip_ext;
+      xlate->aux_ext = r->aux_ext;
+    }
+  }
+  sr_epoch_exit(&(nat->epoch));
+  return ip_ext != 0;
+}
+
+int sr_nat_is_external_ip(struct sr_nat *nat, uint32_t ip){
+  return sr_nat_pool_index(nat, ip) >= 0;
+}
+
+int sr_nat_ext_mapped(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type){
+  int n = sr_nat_pool_index(nat, ip_ext);
+  uint32_t bit = (uint32_t)type * 65536 + aux_ext;
+
+  if(n < 0){
+    return 0;
+  }
+  return (__atomic_load_n(&(nat->mapped[n][bit / 32]), __ATOMIC_ACQUIRE) >> (bit % 32)) & 1;
+}
+
+void sr_nat_set_host_limits(struct sr_nat *nat, uint32_t max_mappings,
+  uint32_t max_half_open){
+  nat->host_max_mappings = max_mappings;
+  nat->host_max_half_open = max_half_open;
+}
+
+void sr_nat_set_mem_budget(struct sr_nat *nat, uint64_t budget){
+  nat->mem_budget = budget;
+}
+
+void sr_nat_pressure_stats(struct sr_nat *nat, struct sr_nat_pressure_stats *stats){
+  int i;
+  memset(stats, 0, sizeof(*stats));
+  stats->budget = nat->mem_budget;
+  stats->used = sr_nat_mem_used(nat);
+  stats->pressure = sr_nat_pressure(nat);
+  stats->tcp_est_to = __atomic_load_n(&(nat->cur_est_to), __ATOMIC_RELAXED);
+  stats->tcp_trans_to = __atomic_load_n(&(nat->cur_trans_to), __ATOMIC_RELAXED);
+  for(i = 0; i < SR_NAT_SHARDS; i++){
+    pthread_mutex_lock(&(nat->shards[i].lock));
+    stats->evicted += nat->shards[i].evicted;
+    pthread_mutex_unlock(&(nat->shards[i].lock));
+  }
+}
+
+void sr_nat_host_stats(struct sr_nat *nat, struct sr_nat_host_stats *stats){
+  int i;
+  memset(stats, 0, sizeof(*stats));
+  for(i = 0; i < SR_NAT_SHARDS; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    stats->hosts += shard->nhosts;
+    stats->refused_mappings += shard->refused_mappings;
+    stats->refused_half_open += shard->refused_half_open;
+    pthread_mutex_unlock(&(shard->lock));
+  }
+}
+
+static void sr_nat_fill_xlate(const struct sr_nat_mapping *mapping,
+  struct sr_nat_xlate *xlate) {
+  xlate->type = mapping->type;
+  xlate->ip_int = mapping->ip_int;
+  xlate->ip_ext = mapping->ip_ext;
+  xlate->aux_int = mapping->aux_int;
+  xlate->aux_ext = mapping->aux_ext;
+}
+
+/* Heap copy for the malloc-returning wrappers. Only the translation fields
+   are meaningful; list pointers are cleared. */
+static struct sr_nat_mapping *sr_nat_copy_xlate(const struct sr_nat_xlate *xlate) {
+  struct sr_nat_mapping *copy = (struct sr_nat_mapping *) calloc(1, sizeof(struct sr_nat_mapping));
+
+  if(copy == NULL){
+    return NULL;
+  }
+  copy->type = xlate->type;
+  copy->ip_int = xlate->ip_int;
+  copy->ip_ext = xlate->ip_ext;
+  copy->aux_int = xlate->aux_int;
+  copy->aux_ext = xlate->aux_ext;
+  copy->last_updated = time(NULL);
   return copy;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+int sr_nat_lookup_external_r(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate) {
+  int found = 0;
+
+  sr_epoch_enter(&(nat->epoch));
+  struct sr_nat_mapping *mapping = sr_nat_find_external(sr_nat_port_shard(nat, aux_ext),
+    ip_ext, aux_ext, type);
+  if(mapping){
+    __atomic_store_n(&(mapping->last_updated), time(NULL), __ATOMIC_RELAXED);
+    sr_nat_fill_xlate(mapping, xlate);
+    found = 1;
+  }
+  sr_epoch_exit(&(nat->epoch));
+  return found;
+}
+
+int sr_nat_lookup_internal_r(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_xlate *xlate) {
+  int found = 0;
+
+  sr_epoch_enter(&(nat->epoch));
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(sr_nat_host_shard(nat, ip_int),
+    ip_int, aux_int, type);
+  if(mapping){
+    __atomic_store_n(&(mapping->last_updated), time(NULL), __ATOMIC_RELAXED);
+    sr_nat_fill_xlate(mapping, xlate);
+    found = 1;
+  }
+  sr_epoch_exit(&(nat->epoch));
+  return found;
+}
+
+/* Get the mapping associated with given external (ip, port) pair.
+   You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) 
+{
+  struct sr_nat_xlate xlate;
+  if(!sr_nat_lookup_external_r(nat, ip_ext, aux_ext, type, &xlate))
+    return NULL;
+  return sr_nat_copy_xlate(&xlate);
+}
+
+/* Get the mapping associated with given internal (ip, port) pair.
+   You must free the returned structure if it is not NULL. */
+struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  struct sr_nat_xlate xlate;
+  if(!sr_nat_lookup_internal_r(nat, ip_int, aux_int, type, &xlate))
+    return NULL;
+  return sr_nat_copy_xlate(&xlate);
+}
+
+/* Insert a new mapping into the nat's mapping table and describe it in
+   *xlate.
+ */
+int sr_nat_insert_mapping_r(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_xlate *xlate) {
+  struct sr_nat_shard *shard = sr_nat_host_shard(nat, ip_int);
+  int pool = sr_nat_host_pool(nat, ip_int);
 
-  pthread_mutex_lock(&(nat->lock));
+  if(pool < 0){
+    return 0;
+  }
+  pthread_mutex_lock(&(shard->lock));
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = NULL, *runner=NULL, *copy=NULL;
+  struct sr_nat_mapping *mapping = NULL;
+  struct sr_nat_host *host = sr_nat_host_get(shard, ip_int, 1);
 
-  mapping = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
+  if(host == NULL){
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+  if(nat->host_max_mappings && host->mappings >= nat->host_max_mappings){
+    shard->refused_mappings++;
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+  if(sr_nat_pressure(nat) >= 100){
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+
+  mapping = (struct sr_nat_mapping *) sr_slab_alloc(&(nat->mapping_slab));
+  if(mapping == NULL){
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
   time_t curtime = time(NULL);
   mapping->ip_int = ip_int;
   mapping->aux_int = aux_int;
   mapping->type = type;
-  mapping->ip_ext = nat->ip_ext;
-  if (type == nat_mapping_icmp){
-    mapping->aux_ext = aux_int;
-  }
-  else{
-    mapping->aux_ext = nat->next_port;
+  mapping->ip_ext = nat->pool[pool];
+  int port = sr_nat_port_get(nat, shard, pool, ip_int, type);
+  if(port < 0){
+    sr_slab_free(&(nat->mapping_slab), mapping);
+    sr_nat_host_put(shard, host);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
   }
+  mapping->aux_ext = port;
+  mapping->host = host;
+  host->mappings++;
   
   mapping->last_updated = curtime;
   mapping->next = NULL;
   mapping->conns = NULL;
+  mapping->flow_pinned = 0;
 
-  if(nat->next_port>MAX_PORT){
-    nat->next_port=MIN_PORT;
+  /* a TCP mapping lives as long as its connections; until the first one is
+     tracked it only gets a tick's grace */
+  sr_timer_init(&(mapping->timer), SR_NAT_TIMER_MAPPING, mapping);
+  if(type == nat_mapping_icmp){
+    sr_timer_schedule(&(shard->wheel), &(mapping->timer), curtime + nat->icmp_to);
   }
   else{
-    nat->next_port++;
+    sr_timer_schedule(&(shard->wheel), &(mapping->timer), curtime + 1);
   }
-  
-  if(nat->mappings){
-    runner = nat->mappings;
-    while(runner->next){
-      runner = runner->next;
+
+  if(sr_nat_link_mapping(nat, shard, mapping) != 0){
+    sr_nat_drop_unlinked(nat, shard, mapping);
+    pthread_mutex_unlock(&(shard->lock));
+    return 0;
+  }
+  sr_nat_fill_xlate(mapping, xlate);
+
+  pthread_mutex_unlock(&(shard->lock));
+  return 1;
+}
+
+/* Insert a new mapping into the nat's mapping table.
+   Actually returns a copy to the new mapping, for thread safety.
+ */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+  struct sr_nat_xlate xlate;
+  if(!sr_nat_insert_mapping_r(nat, ip_int, aux_int, type, &xlate))
+    return NULL;
+  return sr_nat_copy_xlate(&xlate);
+}
+
+/* Advances conn's state for a segment with the given flags sent in the given
+   direction. Flags are tested as a mask, so ECE/CWR/PSH/URG never get in
+   the way. Caller holds the shard lock. */
+static void sr_nat_conn_track(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_connection *conn, uint8_t flags, int direction) {
+  sr_nat_conn_states old = conn->state;
+
+  if (flags & tcp_flag_rst) {
+    conn->state = nat_conn_time_wait;
+  }
+  else if (flags & tcp_flag_syn) {
+    if (conn->state == nat_conn_time_wait && !(flags & tcp_flag_ack)) {
+      /* the 5-tuple is being reused for a new connection */
+      conn->state = nat_conn_syn;
+      conn->syn_seen = direction;
+      conn->fin_seen = 0;
+    }
+    else {
+      /* a retransmitted SYN from the same side changes nothing */
+      conn->syn_seen |= direction;
+      if (conn->state == nat_conn_syn && conn->syn_seen == (OUTGOING | INCOMING)) {
+        conn->state = nat_conn_synack;
+      }
     }
-    runner->next = mapping;
   }
-  else{
-    nat->mappings = mapping;
+  else if (flags & tcp_flag_fin) {
+    if (conn->state != nat_conn_time_wait) {
+      conn->fin_seen |= direction;
+      conn->state = conn->fin_seen == (OUTGOING | INCOMING) ? nat_conn_fin2 : nat_conn_fin1;
+    }
+  }
+  else if (flags & tcp_flag_ack) {
+    if (conn->state == nat_conn_synack) {
+      conn->state = nat_conn_est;
+    }
+    else if (conn->state == nat_conn_fin2) {
+      /* last ACK of the close */
+      conn->state = nat_conn_time_wait;
+    }
   }
 
-  copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-  memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  if (conn->state == old) {
+    return;
+  }
+  if (sr_nat_conn_half_open(old) != sr_nat_conn_half_open(conn->state)) {
+    sr_nat_conn_embryonic(shard, conn, !sr_nat_conn_half_open(old));
+  }
+  if (old == nat_conn_est && conn->flow_pinned) {
+    /* the fast path must stop treating it as established */
+    conn->flow_pinned = 0;
+    sr_flowcache_invalidate(nat->flows);
+  }
+  /* the deadline may have moved closer; the lazy check at fire time only
+     handles it moving further away */
+  conn->last_updated = time(NULL);
+  sr_timer_schedule(&(shard->wheel), &(conn->timer), sr_nat_conn_deadline(nat, conn));
 }
 
-void sr_tcp_conn_handle(struct sr_instance *sr, struct sr_nat_mapping *copy, uint8_t * packet, int len, int direction){
+int sr_tcp_conn_handle(struct sr_instance *sr, struct sr_nat_xlate *xlate, uint8_t * packet, int len, int direction){
   struct sr_nat *nat = sr->nat;
 
   sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
   assert(iphdr->ip_p == ip_protocol_tcp);
   sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
-  pthread_mutex_lock(&(nat->lock));
-
-  struct sr_nat_mapping *mapping = nat->mappings;
-  while(mapping){
-    if (mapping->aux_ext == copy->aux_ext)
-      break;
-    mapping = mapping->next;
-  }
-  printf("check1\n");
   uint32_t ip_dst;
   uint16_t aux_dst;
   if(direction == INCOMING){
-    ip_dst = ntohs(iphdr->ip_src);
-    aux_dst = ntohs(tcp_header->aux_src);
+    ip_dst = iphdr->ip_src;
+    aux_dst = tcp_header->aux_src;
   }
   else{
-    ip_dst = ntohs(iphdr->ip_dst);
-    aux_dst = ntohs(tcp_header->aux_dst);
+    ip_dst = iphdr->ip_dst;
+    aux_dst = tcp_header->aux_dst;
   }
-  
 
-  struct sr_nat_connection *conn = mapping->conns;
+  struct sr_nat_shard *shard = sr_nat_port_shard(nat, xlate->aux_ext);
+  pthread_mutex_lock(&(shard->lock));
+
+  struct sr_nat_connection *conn = sr_nat_find_conn(shard, xlate->ip_ext, xlate->aux_ext, ip_dst, aux_dst);
 
-  while(conn){
-    if(conn->ip_dst == ip_dst && conn->aux_dst == aux_dst)
-      break;
-    conn=conn->next;
-  }
-  printf("check2\n");
   if (conn==NULL){/*connection don't exist mon*/
-    if(tcp_header->flags != tcp_flag_syn){
-      pthread_mutex_unlock(&(nat->lock));
-      return;
+    if((tcp_header->flags & (tcp_flag_syn | tcp_flag_ack | tcp_flag_fin | tcp_flag_rst)) != tcp_flag_syn){
+      pthread_mutex_unlock(&(shard->lock));
+      return 1;
+    }
+    struct sr_nat_mapping *mapping = sr_nat_find_external(shard, xlate->ip_ext, xlate->aux_ext, nat_mapping_tcp);
+    if(mapping == NULL){
+      pthread_mutex_unlock(&(shard->lock));
+      return 1;
+    }
+    if(nat->host_max_half_open &&
+       mapping->host->half_open >= nat->host_max_half_open){
+      shard->refused_half_open++;
+      pthread_mutex_unlock(&(shard->lock));
+      return 0;
+    }
+    /* near the budget a new connection pushes out the oldest half-open
+       one; at the budget with none to push out it is not let in */
+    if(sr_nat_pressure(nat) >= SR_NAT_PRESSURE_HIGH &&
+       !sr_nat_evict_embryonic(nat, shard) && sr_nat_pressure(nat) >= 100){
+      pthread_mutex_unlock(&(shard->lock));
+      return 0;
+    }
+    conn = (struct sr_nat_connection *) sr_slab_alloc(&(nat->conn_slab));
+    if(conn == NULL){
+      pthread_mutex_unlock(&(shard->lock));
+      return 1;
     }
-    conn = malloc(sizeof(struct sr_nat_connection));
     conn->ip_dst=ip_dst;
     conn->aux_dst=aux_dst;
     conn->state=nat_conn_syn;
-    conn->packet = NULL;
-    conn->next = NULL;
-
-    struct sr_nat_connection *runner = mapping->conns;
-    if(runner){
-      while(runner->next){
-        runner=runner->next;
-      }
-      runner->next = conn;
-    }
-    else{
-      mapping->conns = conn;
-    }
-  }
-
-  if(conn->state == nat_conn_syn){
-    /*Look for syn+ack*/  
-    if (tcp_header->flags == tcp_flag_syn+tcp_flag_ack){
-      conn->state=nat_conn_synack;
+    conn->syn_seen = direction;
+    conn->fin_seen = 0;
+    conn->flow_pinned = 0;
+    conn->last_updated = time(NULL);
+    if(sr_nat_link_conn(nat, shard, mapping, conn) != 0){
+      sr_slab_free(&(nat->conn_slab), conn);
+      pthread_mutex_unlock(&(shard->lock));
+      return 1;
     }
+    sr_nat_conn_embryonic(shard, conn, 1);
   }
-  else if(conn->state == nat_conn_synack){
-    if (tcp_header->flags == tcp_flag_ack){
-        conn->state=nat_conn_est;
-      }
+  else{
+    sr_nat_conn_track(nat, shard, conn, tcp_header->flags, direction);
   }
 
   conn->last_updated = time(NULL);
 
 
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
+  return 1;
 }
 
-struct sr_nat_mapping *sr_nat_insert_unsol_mapping(struct sr_nat *nat, uint8_t *packet, int len){
-  sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
-  assert(iphdr->ip_p == ip_protocol_tcp);
-  sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
-  pthread_mutex_lock(&(nat->lock));
-
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = NULL, *runner=NULL, *copy=NULL;
-
-  mapping = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-  time_t curtime = time(NULL);
-  mapping->ip_int = htonl(0);
-  mapping->aux_int = htonl(0);
-  mapping->type = nat_mapping_tcp;
-  mapping->ip_ext = nat->ip_ext;
-  mapping->aux_ext = nat->next_port;
-
-  mapping->last_updated = curtime;
-  mapping->next = NULL;
-
-  struct sr_nat_connection *conn = malloc(sizeof(struct sr_nat_connection));
-  conn->ip_dst=ntohs(iphdr->ip_src);
-  conn->aux_dst=ntohs(tcp_header->aux_src);
-  conn->state=nat_conn_unest;
-  conn->packet = packet;
-  conn->len=len;
-  conn->next = NULL;
-  conn->last_updated = curtime;
-  mapping->conns = conn;
-
-  if(nat->next_port>MAX_PORT){
-    nat->next_port=MIN_PORT;
-  }
-  else{
-    nat->next_port++;
+void sr_nat_port_stats(struct sr_nat *nat, sr_nat_mapping_type type,
+  struct sr_nat_port_stats *stats)
+{
+  int i, j, n = __atomic_load_n(&(nat->pool_size), __ATOMIC_ACQUIRE);
+  memset(stats, 0, sizeof(*stats));
+  for(i = 0; i < SR_NAT_SHARDS; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+    pthread_mutex_lock(&(shard->lock));
+    for(j = 0; j < n; j++){
+      if(nat->port_blocks){
+        struct sr_portblock *pb = shard->blocks[j];
+        stats->capacity += sr_portblock_capacity(pb);
+        stats->in_use += pb->in_use[type];
+        stats->allocs += pb->allocs[type];
+        stats->exhausted += pb->exhausted[type];
+        stats->hosts += pb->nhosts;
+        stats->blocks_assigned += pb->assigned;
+        stats->blocks_released += pb->released;
+      }
+      else{
+        struct sr_portalloc *pa = &(shard->ports[j][type]);
+        stats->capacity += pa->size;
+        stats->in_use += pa->size - pa->count;
+        stats->allocs += pa->allocs;
+        stats->exhausted += pa->exhausted;
+      }
+    }
+    pthread_mutex_unlock(&(shard->lock));
   }
-  
-  if(nat->mappings){
-    runner = nat->mappings;
-    while(runner->next){
-      runner = runner->next;
+}
+
+time_t *sr_nat_flow_pin(struct sr_nat *nat, const struct sr_nat_xlate *xlate,
+  uint32_t ip_remote, uint16_t aux_remote)
+{
+  struct sr_nat_shard *shard = sr_nat_port_shard(nat, xlate->aux_ext);
+  time_t *touch = NULL;
+
+  pthread_mutex_lock(&(shard->lock));
+  if(xlate->type == nat_mapping_icmp){
+    struct sr_nat_mapping *mapping = sr_nat_find_external(shard, xlate->ip_ext, xlate->aux_ext, nat_mapping_icmp);
+    if(mapping){
+      mapping->flow_pinned = 1;
+      touch = &(mapping->last_updated);
     }
-    runner->next = mapping;
   }
   else{
-    nat->mappings = mapping;
+    struct sr_nat_connection *conn = sr_nat_find_conn(shard, xlate->ip_ext, xlate->aux_ext,
+      ip_remote, aux_remote);
+    if(conn && conn->state == nat_conn_est){
+      conn->flow_pinned = 1;
+      touch = &(conn->last_updated);
+    }
   }
+  pthread_mutex_unlock(&(shard->lock));
+  return touch;
+}
 
-  copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-  memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+void sr_nat_mem_stats(struct sr_nat *nat, struct sr_slab_stats *mappings,
+  struct sr_slab_stats *conns)
+{
+  sr_slab_stats(&(nat->mapping_slab), mappings);
+  sr_slab_stats(&(nat->conn_slab), conns);
 }
 
+/* Removes the live mapping with the same (ip_ext, aux_ext, type) as copy and frees
+   it along with its connections. copy may be the live mapping itself or a
+   copy handed out by a lookup; in the latter case the caller still owns (and
+   must free) copy. */
 void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_mapping *copy)
 {
-  pthread_mutex_lock(&(nat->lock));
   if(copy==NULL)
     return;
-  struct sr_nat_mapping *mapping = nat->mappings, *prev=NULL;
-  while(mapping){
-    if (mapping->aux_ext == copy->aux_ext)
-      break;
-    prev = mapping;
-    mapping = mapping->next;
-  }
-  if(prev == NULL){
-    nat->mappings = copy->next;
+  struct sr_nat_shard *shard = sr_nat_port_shard(nat, copy->aux_ext);
+  pthread_mutex_lock(&(shard->lock));
+  struct sr_nat_mapping *mapping = sr_nat_find_external(shard, copy->ip_ext, copy->aux_ext, copy->type);
+  if(mapping){
+    sr_nat_free_mapping(nat, shard, mapping);
   }
-  else{
-    prev->next = copy->next;
-  }
-  free(copy);
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
 }
 
-struct sr_nat_mapping *sr_nat_lookup_waiting_syn(struct sr_nat *nat, uint32_t ip_dst, uint16_t aux_dst)
+int sr_nat_hold_syn(struct sr_nat *nat, uint8_t *packet, int len)
 {
-  pthread_mutex_lock(&(nat->lock));
-
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL, *mapping = NULL;
-  mapping = nat->mappings;
-  while(mapping){
-    if(mapping->aux_int == htonl(0) && mapping->ip_int == htonl(0)){
-        struct sr_nat_connection *conn = mapping->conns;
-        while(conn){
-          if(conn->ip_dst == ip_dst && conn->aux_dst == aux_dst)
-          {
-            copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-            memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-            break;
-          }
-          conn=conn->next;
-        }
-    }
-    mapping = mapping->next;
+  sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
+  assert(iphdr->ip_p == ip_protocol_tcp);
+  sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+  int held;
+
+  pthread_mutex_lock(&(nat->syn_lock));
+  held = sr_synhold_add(&(nat->syns), iphdr->ip_src, tcp_header->aux_src,
+    iphdr->ip_dst, tcp_header->aux_dst, packet, len, time(NULL) + SR_NAT_UNSOL_SYN_TO);
+  pthread_mutex_unlock(&(nat->syn_lock));
+  return held;
+}
+
+void sr_nat_cancel_syn(struct sr_nat *nat, uint32_t ip_remote, uint16_t aux_remote)
+{
+  /* nearly always nothing is held, and then the lock is not worth taking */
+  if(__atomic_load_n(&(nat->syns.count), __ATOMIC_RELAXED) == 0){
+    return;
   }
+  pthread_mutex_lock(&(nat->syn_lock));
+  sr_synhold_cancel(&(nat->syns), ip_remote, aux_remote);
+  pthread_mutex_unlock(&(nat->syn_lock));
+}
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+void sr_nat_syn_stats(struct sr_nat *nat, struct sr_nat_syn_stats *stats)
+{
+  pthread_mutex_lock(&(nat->syn_lock));
+  stats->capacity = nat->syns.size;
+  stats->held = nat->syns.count;
+  stats->accepted = nat->syns.held;
+  stats->duplicates = nat->syns.duplicates;
+  stats->dropped = nat->syns.dropped;
+  stats->cancelled = nat->syns.cancelled;
+  stats->expired = nat->syns.expired;
+  pthread_mutex_unlock(&(nat->syn_lock));
 }
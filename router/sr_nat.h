@@ -11,8 +11,18 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_hash.h"
+#include "sr_portalloc.h"
+#include "sr_portblock.h"
+#include "sr_synhold.h"
+#include "sr_dnat.h"
+#include "sr_natckpt.h"
+#include "sr_timerwheel.h"
+#include "sr_epoch.h"
+#include "sr_slab.h"
+#include "sr_flowcache.h"
 
-#define MAX_HOSTS 256 
+#define MAX_HOSTS 256 /* host table buckets per port-block allocator */
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 #define FIN 1
@@ -27,34 +37,69 @@
 #define MAX_PACKET_VOL 1024
 #define INCOMING 2
 #define OUTGOING 1
+#define SR_NAT_UNSOL_SYN_TO 6 /* seconds an unsolicited inbound SYN is held */
+#define SR_NAT_SYNHOLD 1024 /* unsolicited SYNs held at once */
+#define SR_NAT_TIME_WAIT_TO 4 /* seconds a closed connection lingers */
+#define SR_NAT_SHARDS 4 /* independent NAT partitions, see struct sr_nat_shard */
+#define SR_NAT_POOL_MAX 16 /* external addresses */
+#define SR_NAT_HOST_BUCKETS 1024 /* per shard, for the per-host counters */
+#define SR_NAT_CKPT_INTERVAL 10 /* seconds between checkpoints */
+
+/* Memory pressure, as a percentage of the budget given to
+   sr_nat_set_mem_budget(). From LOW upwards the TCP timeouts shrink
+   linearly, reaching their floors at HIGH; at HIGH and above the oldest
+   half-open connections are evicted to make room. */
+#define SR_NAT_PRESSURE_LOW 50
+#define SR_NAT_PRESSURE_HIGH 90
+#define SR_NAT_TRANS_TO_MIN 10 /* seconds */
+#define SR_NAT_EST_TO_MIN 60
+#define SR_NAT_REAP_BATCH 256 /* connection slots per shard rechecked per tick under pressure */
+#define SR_NAT_EVICT_BATCH 64 /* half-open connections per shard evicted per tick */
 
 typedef enum {
   nat_mapping_icmp,
   nat_mapping_tcp
   /* nat_mapping_udp, */
 } sr_nat_mapping_type;
+#define SR_NAT_MAPPING_TYPES 2
 
 typedef enum {
-  nat_conn_unest,
-  nat_conn_syn,
-  nat_conn_synack,
+  nat_conn_syn,       /* SYN seen from one side */
+  nat_conn_synack,    /* SYN seen from both sides (SYN+ACK or simultaneous open) */
   nat_conn_est,
-  nat_conn_fin1,
-  nat_conn_fin1ack,
-  nat_conn_fin2
+  nat_conn_fin1,      /* FIN seen from one side */
+  nat_conn_fin2,      /* FIN seen from both sides, waiting for the last ACK */
+  nat_conn_time_wait  /* closed by FIN handshake or RST; expires quickly */
   /* nat_mapping_udp, */
 } sr_nat_conn_states;
 
 struct sr_nat_connection {
   /* add TCP connection state data members here */
-  uint32_t ip_dst;
+  uint32_t ip_dst; /* remote endpoint, network byte order */
   uint16_t aux_dst;
 
   sr_nat_conn_states state;
-  int len;
-  uint8_t* packet;
+  uint8_t syn_seen; /* directions (OUTGOING/INCOMING) that have sent a SYN */
+  uint8_t fin_seen; /* and a FIN */
   time_t last_updated;
+  struct sr_timer timer; /* fires at the deadline for the current state */
+  struct sr_nat_mapping *mapping; /* owning mapping */
+  int flow_pinned; /* the forwarding fast path refreshes last_updated */
+  struct sr_epoch_entry retire;
+  struct sr_nat_connection *prev;
   struct sr_nat_connection *next;
+  /* the shard's half-open connections, oldest first */
+  struct sr_nat_connection *emb_prev;
+  struct sr_nat_connection *emb_next;
+};
+
+/* What one internal host holds, for the per-host limits. Lives in the
+   host's shard while the host has mappings. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  uint32_t mappings;
+  uint32_t half_open; /* connections of those mappings not yet established */
+  struct sr_nat_host *next; /* hash chain */
 };
 
 struct sr_nat_mapping {
@@ -64,42 +109,241 @@ struct sr_nat_mapping {
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
+  struct sr_timer timer; /* ICMP idle timeout; TCP: armed while conns is empty */
   struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  struct sr_nat_host *host; /* the internal host, for its limits */
+  int flow_pinned; /* the forwarding fast path refreshes last_updated */
+  struct sr_epoch_entry retire;
+  struct sr_nat_mapping *prev;
   struct sr_nat_mapping *next;
 };
 
+/* The fields of a mapping the forwarding path needs. Filled in by the _r
+   lookup/insert variants into storage owned by the caller, so translating a
+   packet does not touch the allocator. */
+struct sr_nat_xlate {
+  sr_nat_mapping_type type;
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+};
+
+/* Port allocator usage for one mapping type, see sr_nat_port_stats(). */
+struct sr_nat_port_stats {
+  uint32_t capacity;     /* ports in MIN_PORT..MAX_PORT, times the pool size */
+  uint32_t in_use;       /* held by live mappings or static rules */
+  uint64_t allocs;       /* mappings ever given a port */
+  uint64_t exhausted;    /* mappings refused for lack of a free port */
+  /* port-block mode only, and the same for every type */
+  uint32_t hosts;        /* internal hosts holding blocks */
+  uint64_t blocks_assigned;
+  uint64_t blocks_released;
+};
+
+/* Memory budget state, see sr_nat_pressure_stats(). */
+struct sr_nat_pressure_stats {
+  uint64_t budget;              /* bytes; 0: no budget */
+  uint64_t used;                /* bytes held by mappings and connections */
+  uint32_t pressure;            /* used as a percentage of budget */
+  uint16_t tcp_est_to;          /* timeouts currently applied */
+  uint16_t tcp_trans_to;
+  uint64_t evicted;             /* half-open connections evicted */
+};
+
+/* Unsolicited inbound SYNs, see sr_nat_syn_stats(). */
+struct sr_nat_syn_stats {
+  uint32_t capacity;            /* SYNs that can be held at once */
+  uint32_t held;                /* held now */
+  uint64_t accepted;            /* SYNs taken in */
+  uint64_t duplicates;          /* retransmissions of one already held */
+  uint64_t dropped;             /* refused because the holding area was full */
+  uint64_t cancelled;           /* answered by a SYN from inside */
+  uint64_t expired;             /* answered with ICMP port unreachable */
+};
+
+/* Per-host admission control, see sr_nat_host_stats(). */
+struct sr_nat_host_stats {
+  uint32_t hosts;               /* internal hosts with mappings */
+  uint64_t refused_mappings;    /* inserts refused by the mapping limit */
+  uint64_t refused_half_open;   /* connections refused by the half-open limit */
+};
+
+/* One partition of the NAT. Outbound traffic picks its shard by hashing the
+   internal address, so all of a host's mappings live in one shard; each
+   shard hands out external ports from its own slice of MIN_PORT..MAX_PORT,
+   so inbound traffic finds the shard from the destination port alone (see
+   sr_nat_port_shard()). A mapping's connections live in the mapping's shard.
+   Nothing ever needs two shard locks at once. */
+struct sr_nat_shard {
+  struct sr_nat_mapping *mappings;
+  struct sr_hash int_index; /* keyed on (ip_int, aux_int, type) */
+  struct sr_hash ext_index; /* keyed on (ip_ext, aux_ext, type) */
+  struct sr_hash conn_index; /* TCP connections, keyed on (ip_ext, aux_ext, ip_dst, aux_dst) */
+  /* this shard's external ports / icmp ids, one pair of allocators per
+     pool address: ports[pool index][type] */
+  struct sr_portalloc *ports[SR_NAT_POOL_MAX];
+  /* the same in port-block mode, one allocator per pool address */
+  struct sr_portblock *blocks[SR_NAT_POOL_MAX];
+  struct sr_nat_host *hosts[SR_NAT_HOST_BUCKETS];
+  uint32_t nhosts;
+  uint64_t refused_mappings;
+  uint64_t refused_half_open;
+  struct sr_nat_connection *emb_head; /* half-open connections, oldest first */
+  struct sr_nat_connection *emb_tail;
+  uint64_t evicted;
+  uint32_t reap_hand; /* next conn_index slot the reaper looks at */
+  struct sr_timerwheel wheel; /* mapping and connection expiry */
+  /* serializes writers only; lookups run in epoch sections */
+  pthread_mutex_t lock;
+};
+
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
-  uint32_t ip_ext;
-  uint16_t next_port;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  /* External addresses, network byte order. A host's mappings all use the
+     address its ip_int hashes to, for as long as the pool does not change.
+     Addresses are only ever added, by a single thread. */
+  uint32_t pool[SR_NAT_POOL_MAX];
+  int pool_size;
+  /* Prefilter for inbound traffic: one bit per external port and type for
+     each pool address, set while a mapping holds the port. Indexed
+     mapped[pool index][type * 65536 + port]. Written with atomics under the
+     owning shard's lock, read without any lock. */
+  uint32_t *mapped[SR_NAT_POOL_MAX];
+  int port_blocks; /* hosts get ports in blocks, see sr_portblock.h */
+  uint32_t host_max_mappings; /* per internal host; 0: no limit */
+  uint32_t host_max_half_open;
+  struct sr_epoch epoch; /* reclaims what lock-free lookups may still see */
+  struct sr_slab mapping_slab; /* every sr_nat_mapping comes from here */
+  struct sr_slab conn_slab; /* and every sr_nat_connection from here */
+  struct sr_flowcache *flows; /* invalidated when pinned state goes away */
 
   /* timeout values */
   uint16_t icmp_to;
   uint16_t tcp_est_to;
   uint16_t tcp_trans_to;
+  /* memory budget in bytes (0: none) and the TCP timeouts it currently
+     allows; the timeout thread recomputes them every tick */
+  uint64_t mem_budget;
+  uint16_t cur_est_to;
+  uint16_t cur_trans_to;
+  /* Static forwarding rules, NULL if none. Replaced whole on reload and
+     read in epoch sections. dnat_lock serializes reloads with each other
+     and with new pool addresses, which need the rules' ports reserved. */
+  struct sr_dnat *dnat;
+  char *dnat_path;
+  int dnat_reload; /* set to have the timeout thread reload dnat_path */
+  pthread_mutex_t dnat_lock;
+  /* Checkpoint file, NULL if none. Set once restored from, then written
+     by the timeout thread every SR_NAT_CKPT_INTERVAL seconds and by
+     sr_nat_destroy(); ckpt_lock keeps the two from writing at once. Until
+     the pool is complete the file waits in ckpt_pending. */
+  char *ckpt_path;
+  char *ckpt_pending;
+  time_t ckpt_next;
+  pthread_mutex_t ckpt_lock;
+  /* unsolicited inbound SYNs, and the lock that guards them */
+  struct sr_synhold syns;
+  pthread_mutex_t syn_lock;
   /* threading */
-  pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
 };
 
 
-int sr_nat_init(struct sr_instance *sr, int tcmp_to, int tcp_est_to, int tcp_trans_to);     /* Initializes the nat */
+/* Initializes the nat. max_flows caps both the number of mappings and the
+   number of tracked connections; 0 means no cap. With port_blocks set,
+   external ports are handed to internal hosts SR_PORTBLOCK_SZ at a time. */
+int sr_nat_init(struct sr_instance *sr, int tcmp_to, int tcp_est_to, int tcp_trans_to,
+  unsigned long max_flows, int port_blocks);
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 void sr_nat_delete_mapping(struct sr_nat *nat, struct sr_nat_mapping *map);
-void sr_nat_delete_conn(struct sr_nat_mapping *mapping, struct sr_nat_connection *prev, 
-  struct sr_nat_connection *conn);
+void sr_nat_delete_conn(struct sr_nat *nat, struct sr_nat_connection *conn);
+
+/* Adds ip (network byte order) to the pool of external addresses. Returns 0
+   on success or if it is already there, -1 if the pool is full or out of
+   memory. */
+int sr_nat_add_address(struct sr_nat *nat, uint32_t ip);
+
+/* Non-zero if ip is one of the NAT's external addresses. */
+int sr_nat_is_external_ip(struct sr_nat *nat, uint32_t ip);
 
-void sr_tcp_conn_handle(struct sr_instance *sr, struct sr_nat_mapping *map, 
+/* Limits what one internal host may hold: max_mappings mappings of any type
+   and max_half_open TCP connections that are not yet established. 0 means
+   no limit. Inserts over a limit fail without touching the allocators. */
+void sr_nat_set_host_limits(struct sr_nat *nat, uint32_t max_mappings,
+  uint32_t max_half_open);
+void sr_nat_host_stats(struct sr_nat *nat, struct sr_nat_host_stats *stats);
+
+/* Caps the memory held by mappings and connections at budget bytes (0: no
+   cap). As it fills up, TCP timeouts shrink towards SR_NAT_TRANS_TO_MIN and
+   SR_NAT_EST_TO_MIN, and then the oldest half-open connections are evicted
+   first. */
+void sr_nat_set_mem_budget(struct sr_nat *nat, uint64_t budget);
+void sr_nat_pressure_stats(struct sr_nat *nat, struct sr_nat_pressure_stats *stats);
+
+/* Tracks the TCP segment in packet, already translated with xlate. Returns 0
+   if the segment would open a connection its internal host may not have
+   (see sr_nat_set_host_limits()) or the memory budget has no room for, and
+   must be dropped; 1 otherwise. */
+int sr_tcp_conn_handle(struct sr_instance *sr, struct sr_nat_xlate *xlate,
   uint8_t * packet, int len, int direction);
 
-/* Get the mapping associated with given external port.
+/* Loads static forwarding rules from path (see sr_dnat.h) in place of the
+   current ones. Their external ports are taken out of the dynamic
+   allocators, on every pool address a rule applies to, and those of
+   dropped rules are given back. Returns -1, keeping the current rules, if
+   the file does not load or (reported on stderr) a new rule's port is held
+   by a live dynamic mapping. */
+int sr_nat_load_static(struct sr_nat *nat, const char *path);
+
+/* Has the timeout thread reload the last rules file loaded on its next
+   tick. Safe to call from a signal handler. */
+void sr_nat_reload_static(struct sr_nat *nat);
+
+/* Translation by static rule, ahead of the dynamic mappings: fill in *xlate
+   and return 1 if a rule forwards external port ip_ext:aux_ext / covers
+   internal endpoint ip_int:aux_int (ports in host byte order), else return
+   0. Take no lock and allocate nothing. Only TCP has rules. */
+int sr_nat_static_lookup_external(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate);
+int sr_nat_static_lookup_internal(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate);
+
+/* Keeps the NAT's mappings and connections in a checkpoint at path. Call
+   once, after the static rules are set up. Nothing is read or written
+   until sr_nat_restore_checkpoint(). Returns -1 if out of memory. */
+int sr_nat_set_checkpoint(struct sr_nat *nat, const char *path);
+
+/* Restores the mappings and connections checkpointed at the path given to
+   sr_nat_set_checkpoint(), if there is a checkpoint, and from then on
+   saves them there every SR_NAT_CKPT_INTERVAL seconds and on
+   sr_nat_destroy(). Call once the pool is complete, i.e. once the
+   interface addresses are known. Only mappings on an address in the pool
+   come back: an address since dropped from the configuration stays
+   dropped. So do entries that expired while the router was down, or whose
+   external port is no longer free. An unusable checkpoint is reported and
+   left to be overwritten. Does nothing without a pending checkpoint.
+   Returns -1 if out of memory. */
+int sr_nat_restore_checkpoint(struct sr_nat *nat);
+
+/* Writes the checkpoint now. Returns 0 on success. */
+int sr_nat_checkpoint(struct sr_nat *nat);
+
+/* Cheap check for the inbound path, taking no lock: returns 0 if no mapping
+   of the given type holds ip_ext:aux_ext (port in host byte order), so the
+   packet can be turned away without a lookup. Non-zero only means a lookup
+   is worth doing. */
+int sr_nat_ext_mapped(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type);
+
+/* Get the mapping associated with given external (ip, port) pair.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
 /* Get the mapping associated with given internal (ip, port) pair.
    You must free the returned structure if it is not NULL. */
@@ -107,12 +351,54 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+   You must free the returned structure if it is not NULL.
+   Returns NULL if no external port is free. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int,  uint16_t aux_int,  
   sr_nat_mapping_type type );
 
-struct sr_nat_mapping *sr_nat_insert_unsol_mapping(struct sr_nat *nat, uint8_t *packet, int len);
-struct sr_nat_mapping *sr_nat_lookup_waiting_syn(struct sr_nat *nat, uint32_t ip_dst, uint16_t aux_dst);
+/* Allocation-free variants of the three calls above. They fill in *xlate and
+   return 1 on success, or return 0 (leaving *xlate untouched) if there is no
+   such mapping / it could not be created. Inserts fail when every external
+   port for the type on the host's external address is held by a live
+   mapping. */
+int sr_nat_lookup_external_r(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext,
+  sr_nat_mapping_type type, struct sr_nat_xlate *xlate);
+int sr_nat_lookup_internal_r(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_xlate *xlate);
+int sr_nat_insert_mapping_r(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_xlate *xlate);
+
+/* Snapshot of the external port allocators for one mapping type, summed
+   over the shards. */
+void sr_nat_port_stats(struct sr_nat *nat, sr_nat_mapping_type type,
+  struct sr_nat_port_stats *stats);
+
+/* Called by the forwarding path before it caches a translated flow. Returns
+   the idle timestamp that each cached packet must refresh in place of a NAT
+   lookup: the ICMP mapping's, or the TCP connection's to (ip_remote,
+   aux_remote). Returns NULL if the flow must not be cached, i.e. the TCP
+   connection is not established. The state is marked so that its removal
+   invalidates the flow cache; the pointer must only be used while the cache
+   generation it was stored under is current, inside an epoch section. */
+time_t *sr_nat_flow_pin(struct sr_nat *nat, const struct sr_nat_xlate *xlate,
+  uint32_t ip_remote, uint16_t aux_remote);
+
+/* Usage of the mapping and connection pools. */
+void sr_nat_mem_stats(struct sr_nat *nat, struct sr_slab_stats *mappings,
+  struct sr_slab_stats *conns);
+
+/* Holds an unsolicited inbound TCP SYN (packet, len: the whole frame; only
+   its head is copied) for SR_NAT_UNSOL_SYN_TO seconds. If no SYN from
+   inside to its sender cancels it by then, the timeout thread answers it
+   with an ICMP port unreachable. Returns 0 if the holding area is full and
+   the SYN must be dropped. */
+int sr_nat_hold_syn(struct sr_nat *nat, uint8_t *packet, int len);
+
+/* Called for every outbound SYN to ip_remote:aux_remote (network byte
+   order): forgets the SYNs held from that endpoint, since an internal host
+   is opening the connection itself. */
+void sr_nat_cancel_syn(struct sr_nat *nat, uint32_t ip_remote, uint16_t aux_remote);
+void sr_nat_syn_stats(struct sr_nat *nat, struct sr_nat_syn_stats *stats);
 
 #endif
\ No newline at end of file
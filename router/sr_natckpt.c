@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sr_natckpt.h"
+
+/* Syncs the directory holding path, so a rename into it is on disk too.
+   Returns 0 on success. */
+static int sr_natckpt_sync_dir(const char *path) {
+  char *copy = strdup(path);
+  int fd, err = -1;
+
+  if (copy == NULL) {
+    return -1;
+  }
+  if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0) {
+    err = fsync(fd);
+    close(fd);
+  }
+  free(copy);
+  return err;
+}
+
+/* Bytes a checkpoint with these counts takes. */
+static size_t sr_natckpt_size(uint32_t nmappings, uint32_t nconns) {
+  return sizeof(struct sr_natckpt_hdr) + (size_t) nmappings * sizeof(struct sr_natckpt_mapping) +
+    (size_t) nconns * sizeof(struct sr_natckpt_conn);
+}
+
+int sr_natckpt_write(const char *path, struct sr_natckpt_hdr *hdr,
+  const struct sr_natckpt_mapping *mappings, const struct sr_natckpt_conn *conns) {
+  size_t len = sr_natckpt_size(hdr->nmappings, hdr->nconns), n;
+  char *tmp, *base;
+  int fd, err = -1;
+
+  hdr->magic = SR_NATCKPT_MAGIC;
+  hdr->version = SR_NATCKPT_VERSION;
+  hdr->hdr_size = sizeof(struct sr_natckpt_hdr);
+  hdr->mapping_size = sizeof(struct sr_natckpt_mapping);
+  hdr->conn_size = sizeof(struct sr_natckpt_conn);
+
+  if ((tmp = (char *) malloc(strlen(path) + 5)) == NULL) {
+    return -1;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+    perror(tmp);
+    free(tmp);
+    return -1;
+  }
+  if (ftruncate(fd, len) == 0 &&
+      (base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+    memcpy(base, hdr, sizeof(*hdr));
+    n = sizeof(*hdr);
+    memcpy(base + n, mappings, hdr->nmappings * sizeof(*mappings));
+    n += hdr->nmappings * sizeof(*mappings);
+    memcpy(base + n, conns, hdr->nconns * sizeof(*conns));
+    err = msync(base, len, MS_SYNC);
+    munmap(base, len);
+  }
+  if (err == 0) {
+    err = fsync(fd);
+  }
+  close(fd);
+  /* only a complete file ever takes the name, and the new name is only
+     safe once the directory is synced as well */
+  if (err == 0 && (err = rename(tmp, path)) == 0) {
+    err = sr_natckpt_sync_dir(path);
+  }
+  else {
+    unlink(tmp);
+  }
+  if (err != 0) {
+    perror(path);
+  }
+  free(tmp);
+  return err;
+}
+
+int sr_natckpt_open(struct sr_natckpt *ck, const char *path) {
+  const struct sr_natckpt_hdr *hdr;
+  struct stat st;
+  const char *why = NULL;
+  uint32_t i;
+  int fd;
+
+  memset(ck, 0, sizeof(*ck));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct sr_natckpt_hdr)) {
+    close(fd);
+    fprintf(stderr, "NAT checkpoint %s is truncated\n", path);
+    return -1;
+  }
+  ck->len = st.st_size;
+  ck->base = mmap(NULL, ck->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ck->base == MAP_FAILED) {
+    ck->base = NULL;
+    perror(path);
+    return -1;
+  }
+
+  hdr = ck->hdr = (const struct sr_natckpt_hdr *) ck->base;
+  ck->mappings = (const struct sr_natckpt_mapping *)(hdr + 1);
+  if (hdr->magic != SR_NATCKPT_MAGIC) {
+    why = "is not a NAT checkpoint";
+  }
+  else if (hdr->version != SR_NATCKPT_VERSION || hdr->hdr_size != sizeof(struct sr_natckpt_hdr) ||
+           hdr->mapping_size != sizeof(struct sr_natckpt_mapping) ||
+           hdr->conn_size != sizeof(struct sr_natckpt_conn)) {
+    why = "has another layout";
+  }
+  else if (hdr->npool > SR_NATCKPT_POOL_MAX ||
+           hdr->nmappings > (ck->len - sizeof(*hdr)) / sizeof(struct sr_natckpt_mapping) ||
+           ck->len != sr_natckpt_size(hdr->nmappings, hdr->nconns)) {
+    why = "is truncated";
+  }
+  else {
+    ck->conns = (const struct sr_natckpt_conn *)(ck->mappings + hdr->nmappings);
+  }
+  for (i = 0; why == NULL && i < hdr->nmappings; i++) {
+    if (ck->mappings[i].first_conn > hdr->nconns ||
+        ck->mappings[i].nconns > hdr->nconns - ck->mappings[i].first_conn) {
+      why = "is corrupt";
+    }
+  }
+  if (why) {
+    fprintf(stderr, "NAT checkpoint %s %s\n", path, why);
+    sr_natckpt_close(ck);
+    return -1;
+  }
+  return 0;
+}
+
+void sr_natckpt_close(struct sr_natckpt *ck) {
+  if (ck->base) {
+    munmap(ck->base, ck->len);
+  }
+  memset(ck, 0, sizeof(*ck));
+}
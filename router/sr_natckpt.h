@@ -0,0 +1,85 @@
+/* On-disk checkpoint of the NAT's mappings and connections.
+
+   The NAT writes its table to a file every few seconds and on shutdown, and
+   a restarted router reads it back, so connections through the box survive
+   a crash or an upgrade. The file is a fixed header followed by two flat
+   arrays, mappings and then connections; each mapping names the run of
+   connections that belong to it. Nothing in it is a pointer, so it can be
+   used straight from a read-only mapping of the file, without parsing.
+
+   A checkpoint is written to a temporary file that is synced and then
+   renamed over the old one, and the directory is synced after the rename,
+   so a crash part way leaves the previous checkpoint intact. The header
+   records the layout version and the size of each record; a file written
+   by an incompatible build is refused as a whole rather than misread.
+
+   Port allocator state is not stored: it follows from the mappings, and
+   the NAT rebuilds it as it restores them. The module does no locking of
+   its own. */
+
+#ifndef SR_NATCKPT_H
+#define SR_NATCKPT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define SR_NATCKPT_MAGIC 0x4e415443u /* "NATC" */
+#define SR_NATCKPT_VERSION 1
+#define SR_NATCKPT_POOL_MAX 16
+
+struct sr_natckpt_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t hdr_size;      /* sizeof of each record, as written */
+  uint32_t mapping_size;
+  uint32_t conn_size;
+  uint32_t npool;
+  int64_t saved_at;       /* time() when written */
+  uint32_t pool[SR_NATCKPT_POOL_MAX]; /* external addresses, in pool order */
+  uint32_t nmappings;
+  uint32_t nconns;
+};
+
+struct sr_natckpt_mapping {
+  uint32_t ip_int;        /* network byte order */
+  uint32_t ip_ext;
+  uint16_t aux_int;       /* host byte order */
+  uint16_t aux_ext;
+  uint32_t type;
+  int64_t last_updated;
+  uint32_t first_conn;    /* its connections are conns[first_conn..+nconns) */
+  uint32_t nconns;
+};
+
+struct sr_natckpt_conn {
+  uint32_t ip_dst;        /* network byte order */
+  uint16_t aux_dst;
+  uint8_t state;
+  uint8_t syn_seen;
+  uint8_t fin_seen;
+  uint8_t pad[7];
+  int64_t last_updated;
+};
+
+/* A checkpoint file mapped for reading. */
+struct sr_natckpt {
+  void *base;
+  size_t len;
+  const struct sr_natckpt_hdr *hdr;
+  const struct sr_natckpt_mapping *mappings;
+  const struct sr_natckpt_conn *conns;
+};
+
+/* Writes hdr (its counts and pool filled in by the caller) and the records
+   to path, replacing any earlier checkpoint only once the new one is safely
+   on disk. Returns 0 on success. */
+int sr_natckpt_write(const char *path, struct sr_natckpt_hdr *hdr,
+  const struct sr_natckpt_mapping *mappings, const struct sr_natckpt_conn *conns);
+
+/* Maps the checkpoint at path and checks that it is complete and has this
+   build's layout. Returns 0 on success, 1 if there is no file, -1 (after
+   saying why on stderr) if it is unusable. */
+int sr_natckpt_open(struct sr_natckpt *ck, const char *path);
+void sr_natckpt_close(struct sr_natckpt *ck);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_portalloc.h"
+
+#define INUSE_WORD(port) ((port) >> 5)
+#define INUSE_BIT(port)  (1u << ((port) & 31))
+
+int sr_portalloc_init(struct sr_portalloc *pa, uint16_t lo, uint16_t hi) {
+  uint32_t i;
+
+  memset(pa, 0, sizeof(*pa));
+  pa->lo = lo;
+  pa->hi = hi;
+  pa->size = (uint32_t)hi - lo + 1;
+  pa->ring = (uint16_t *) malloc(pa->size * sizeof(uint16_t));
+  if (pa->ring == NULL) {
+    return -1;
+  }
+  for (i = 0; i < pa->size; i++) {
+    pa->ring[i] = (uint16_t)(lo + i);
+  }
+  pa->head = 0;
+  pa->count = pa->size;
+  return 0;
+}
+
+void sr_portalloc_destroy(struct sr_portalloc *pa) {
+  free(pa->ring);
+  pa->ring = NULL;
+  pa->count = 0;
+}
+
+int sr_portalloc_get(struct sr_portalloc *pa) {
+  uint16_t port;
+
+  if (pa->count == 0) {
+    pa->exhausted++;
+    return -1;
+  }
+  port = pa->ring[pa->head];
+  pa->head = (pa->head + 1) % pa->size;
+  pa->count--;
+  pa->inuse[INUSE_WORD(port)] |= INUSE_BIT(port);
+  pa->allocs++;
+  return port;
+}
+
+void sr_portalloc_put(struct sr_portalloc *pa, uint16_t port) {
+  if (port < pa->lo || port > pa->hi || !sr_portalloc_inuse(pa, port)) {
+    return;
+  }
+  pa->inuse[INUSE_WORD(port)] &= ~INUSE_BIT(port);
+  if (pa->reserved[INUSE_WORD(port)] & INUSE_BIT(port)) {
+    return;
+  }
+  pa->ring[(pa->head + pa->count) % pa->size] = port;
+  pa->count++;
+}
+
+/* Drops the ports now in use or reserved from the ring, keeping the order
+   of the rest. */
+static void sr_portalloc_compact(struct sr_portalloc *pa) {
+  uint32_t i, n;
+  uint16_t p;
+
+  for (i = 0, n = 0; i < pa->count; i++) {
+    p = pa->ring[(pa->head + i) % pa->size];
+    if (!((pa->inuse[INUSE_WORD(p)] | pa->reserved[INUSE_WORD(p)]) & INUSE_BIT(p))) {
+      pa->ring[(pa->head + n++) % pa->size] = p;
+    }
+  }
+  pa->count = n;
+}
+
+int sr_portalloc_claim(struct sr_portalloc *pa, uint16_t port) {
+  if (port < pa->lo || port > pa->hi || sr_portalloc_inuse(pa, port) ||
+      (pa->reserved[INUSE_WORD(port)] & INUSE_BIT(port))) {
+    return -1;
+  }
+  pa->inuse[INUSE_WORD(port)] |= INUSE_BIT(port);
+  pa->allocs++;
+  return 0;
+}
+
+void sr_portalloc_settle(struct sr_portalloc *pa) {
+  sr_portalloc_compact(pa);
+}
+
+void sr_portalloc_reserve(struct sr_portalloc *pa, uint16_t port) {
+  if (port < pa->lo || port > pa->hi || (pa->reserved[INUSE_WORD(port)] & INUSE_BIT(port))) {
+    return;
+  }
+  pa->reserved[INUSE_WORD(port)] |= INUSE_BIT(port);
+  if (sr_portalloc_inuse(pa, port)) {
+    return;  /* sr_portalloc_put() will keep it out */
+  }
+  sr_portalloc_compact(pa);
+}
+
+void sr_portalloc_unreserve(struct sr_portalloc *pa, uint16_t port) {
+  if (port < pa->lo || port > pa->hi || !(pa->reserved[INUSE_WORD(port)] & INUSE_BIT(port))) {
+    return;
+  }
+  pa->reserved[INUSE_WORD(port)] &= ~INUSE_BIT(port);
+  if (!sr_portalloc_inuse(pa, port)) {
+    pa->ring[(pa->head + pa->count) % pa->size] = port;
+    pa->count++;
+  }
+}
+
+int sr_portalloc_inuse(const struct sr_portalloc *pa, uint16_t port) {
+  return (pa->inuse[INUSE_WORD(port)] & INUSE_BIT(port)) != 0;
+}
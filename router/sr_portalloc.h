@@ -0,0 +1,64 @@
+/* External port (or ICMP id) allocator for the NAT.
+
+   Free ports sit in a FIFO ring, so both allocate and release are O(1) and a
+   released port goes to the back of the line: it is the last one to be handed
+   out again, which keeps stray packets for a dead mapping from landing on a
+   fresh one. A bitmap of ports in use guards against double release and lets
+   callers test a port without touching the ring.
+
+   A port can be reserved, e.g. for a static forwarding rule: it is taken
+   out of the ring (or kept out once released, if it was in use) until it is
+   unreserved again.
+
+   The allocator does no locking of its own. */
+
+#ifndef SR_PORTALLOC_H
+#define SR_PORTALLOC_H
+
+#include <inttypes.h>
+
+struct sr_portalloc {
+  uint16_t lo;            /* first port handed out */
+  uint16_t hi;            /* last port handed out (inclusive) */
+  uint16_t *ring;         /* free ports, oldest release first */
+  uint32_t head;          /* index of the next port to hand out */
+  uint32_t count;         /* ports currently in the ring */
+  uint32_t size;          /* hi - lo + 1 */
+  uint32_t inuse[65536 / 32];
+  uint32_t reserved[65536 / 32];
+
+  /* counters */
+  uint64_t allocs;        /* successful allocations */
+  uint64_t exhausted;     /* allocations refused because the ring was empty */
+};
+
+/* Fills the ring with lo..hi. Returns 0 on success. */
+int sr_portalloc_init(struct sr_portalloc *pa, uint16_t lo, uint16_t hi);
+void sr_portalloc_destroy(struct sr_portalloc *pa);
+
+/* Hands out the least recently released port, or returns -1 if every port in
+   the range is taken. */
+int sr_portalloc_get(struct sr_portalloc *pa);
+
+/* Returns a port to the back of the ring. Ports outside the range or not
+   currently allocated are ignored. */
+void sr_portalloc_put(struct sr_portalloc *pa, uint16_t port);
+
+/* Marks this particular port allocated, as sr_portalloc_get() might have
+   handed it out, e.g. to restore saved state. Returns -1 if it is out of
+   range, reserved or already in use. Claimed ports stay in the ring until
+   sr_portalloc_settle(), which takes time linear in the range, so a batch
+   of claims is followed by one settle before the next sr_portalloc_get(). */
+int sr_portalloc_claim(struct sr_portalloc *pa, uint16_t port);
+void sr_portalloc_settle(struct sr_portalloc *pa);
+
+/* Keeps port from being handed out until sr_portalloc_unreserve(). Takes
+   time linear in the range; meant for configuration changes, not for the
+   packet path. Ports outside the range are ignored. */
+void sr_portalloc_reserve(struct sr_portalloc *pa, uint16_t port);
+void sr_portalloc_unreserve(struct sr_portalloc *pa, uint16_t port);
+
+/* Non-zero if port is currently allocated. */
+int sr_portalloc_inuse(const struct sr_portalloc *pa, uint16_t port);
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_portblock.h"
+#include "sr_hash.h"
+
+#define SR_PORTBLOCK_WORDS (SR_PORTBLOCK_SZ / 32)
+
+static struct sr_portblock_host **sr_portblock_bucket(struct sr_portblock *pb, uint32_t ip) {
+  return &(pb->hosts[sr_hash_mix32(ip) % pb->nbuckets]);
+}
+
+static struct sr_portblock_host *sr_portblock_host(struct sr_portblock *pb, uint32_t ip) {
+  struct sr_portblock_host *h;
+
+  for (h = *sr_portblock_bucket(pb, ip); h; h = h->next) {
+    if (h->ip == ip) {
+      return h;
+    }
+  }
+  return NULL;
+}
+
+static uint16_t sr_portblock_first(struct sr_portblock *pb, uint16_t block) {
+  return (uint16_t)(pb->lo + block * SR_PORTBLOCK_SZ);
+}
+
+int sr_portblock_init(struct sr_portblock *pb, uint16_t lo, uint16_t hi,
+  uint32_t nbuckets, sr_portblock_event_fn event, void *arg) {
+  uint32_t nblocks = ((uint32_t)hi - lo + 1) / SR_PORTBLOCK_SZ;
+
+  memset(pb, 0, sizeof(*pb));
+  if (nblocks == 0 || nbuckets == 0) {
+    return -1;
+  }
+  pb->lo = lo;
+  pb->nbuckets = nbuckets;
+  pb->event = event;
+  pb->arg = arg;
+  pb->hosts = (struct sr_portblock_host **) calloc(nbuckets, sizeof(struct sr_portblock_host *));
+  if (pb->hosts == NULL) {
+    return -1;
+  }
+  if (sr_portalloc_init(&(pb->free), 0, (uint16_t)(nblocks - 1)) != 0) {
+    free(pb->hosts);
+    pb->hosts = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void sr_portblock_destroy(struct sr_portblock *pb) {
+  struct sr_portblock_host *h, *next;
+  uint32_t i;
+
+  for (i = 0; pb->hosts && i < pb->nbuckets; i++) {
+    for (h = pb->hosts[i]; h; h = next) {
+      next = h->next;
+      free(h);
+    }
+  }
+  free(pb->hosts);
+  pb->hosts = NULL;
+  sr_portalloc_destroy(&(pb->free));
+}
+
+/* Takes a free bit of the given kind in the host's i-th block, searching
+   round from the hint so a port just given back is not the next one out.
+   Returns the port or -1. */
+static int sr_portblock_take(struct sr_portblock *pb, struct sr_portblock_host *h,
+  int i, int kind) {
+  uint32_t *map = h->map[i][kind];
+  uint32_t *res = &(pb->reserved[kind][h->block[i] * SR_PORTBLOCK_WORDS]);
+  int n, w, bit;
+
+  for (n = 0; n < SR_PORTBLOCK_WORDS; n++) {
+    w = (h->hint[i] + n) % SR_PORTBLOCK_WORDS;
+    if ((map[w] | res[w]) != 0xffffffff) {
+      bit = __builtin_ctz(~(map[w] | res[w]));
+      map[w] |= 1u << bit;
+      h->used[i]++;
+      h->hint[i] = (uint16_t)((w + 1) % SR_PORTBLOCK_WORDS);
+      return sr_portblock_first(pb, h->block[i]) + w * 32 + bit;
+    }
+  }
+  return -1;
+}
+
+/* Gives the host's i-th block back to the pool, and the host record with its
+   last block. */
+static void sr_portblock_release(struct sr_portblock *pb, struct sr_portblock_host *h,
+  int i) {
+  struct sr_portblock_host **pp;
+
+  if (pb->event) {
+    pb->event(pb->arg, 0, h->ip, sr_portblock_first(pb, h->block[i]),
+      sr_portblock_first(pb, h->block[i]) + SR_PORTBLOCK_SZ - 1);
+  }
+  sr_portalloc_put(&(pb->free), h->block[i]);
+  pb->released++;
+  h->nblocks--;
+  if (i != h->nblocks) {
+    h->block[i] = h->block[h->nblocks];
+    h->used[i] = h->used[h->nblocks];
+    h->hint[i] = h->hint[h->nblocks];
+    memcpy(h->map[i], h->map[h->nblocks], sizeof(h->map[i]));
+  }
+  if (h->nblocks > 0) {
+    return;
+  }
+  for (pp = sr_portblock_bucket(pb, h->ip); *pp != h; pp = &((*pp)->next)) {
+  }
+  *pp = h->next;
+  free(h);
+  pb->nhosts--;
+}
+
+/* The host record for ip, created if it has none yet. */
+static struct sr_portblock_host *sr_portblock_host_add(struct sr_portblock *pb, uint32_t ip) {
+  struct sr_portblock_host **bucket = sr_portblock_bucket(pb, ip);
+  struct sr_portblock_host *h = sr_portblock_host(pb, ip);
+
+  if (h || (h = (struct sr_portblock_host *) calloc(1, sizeof(struct sr_portblock_host))) == NULL) {
+    return h;
+  }
+  h->ip = ip;
+  h->next = *bucket;
+  *bucket = h;
+  pb->nhosts++;
+  return h;
+}
+
+/* Puts block, just taken off the free pool, into a new slot of h, which must
+   have one. Returns the slot. */
+static int sr_portblock_assign(struct sr_portblock *pb, struct sr_portblock_host *h,
+  int block) {
+  int i = h->nblocks++;
+
+  h->block[i] = (uint16_t) block;
+  h->used[i] = 0;
+  h->hint[i] = 0;
+  memset(h->map[i], 0, sizeof(h->map[i]));
+  pb->assigned++;
+  if (pb->event) {
+    pb->event(pb->arg, 1, h->ip, sr_portblock_first(pb, block),
+      sr_portblock_first(pb, block) + SR_PORTBLOCK_SZ - 1);
+  }
+  return i;
+}
+
+int sr_portblock_get(struct sr_portblock *pb, uint32_t ip, int kind) {
+  struct sr_portblock_host *h = sr_portblock_host(pb, ip);
+  int i, port;
+
+  for (i = 0; h && i < h->nblocks; i++) {
+    if ((port = sr_portblock_take(pb, h, i, kind)) >= 0) {
+      pb->in_use[kind]++;
+      pb->allocs[kind]++;
+      return port;
+    }
+  }
+
+  /* the host needs a (first or further) block */
+  if ((h && h->nblocks == SR_PORTBLOCK_PER_HOST) || pb->free.count == 0 ||
+      (h == NULL && (h = sr_portblock_host_add(pb, ip)) == NULL)) {
+    pb->exhausted[kind]++;
+    return -1;
+  }
+  i = sr_portblock_assign(pb, h, sr_portalloc_get(&(pb->free)));
+
+  port = sr_portblock_take(pb, h, i, kind);
+  if (port < 0) {
+    /* every port of the block is reserved for this kind */
+    sr_portblock_release(pb, h, i);
+    pb->exhausted[kind]++;
+    return -1;
+  }
+  pb->in_use[kind]++;
+  pb->allocs[kind]++;
+  return port;
+}
+
+void sr_portblock_put(struct sr_portblock *pb, uint32_t ip, int kind, uint16_t port) {
+  struct sr_portblock_host *h = sr_portblock_host(pb, ip);
+  uint32_t off = 0;
+  int i;
+
+  for (i = 0; h && i < h->nblocks; i++) {
+    off = (uint32_t)(port - sr_portblock_first(pb, h->block[i]));
+    if (port >= sr_portblock_first(pb, h->block[i]) && off < SR_PORTBLOCK_SZ) {
+      break;
+    }
+  }
+  if (h == NULL || i == h->nblocks ||
+      !(h->map[i][kind][off / 32] & (1u << (off % 32)))) {
+    return;
+  }
+  h->map[i][kind][off / 32] &= ~(1u << (off % 32));
+  h->used[i]--;
+  pb->in_use[kind]--;
+  if (h->used[i] > 0) {
+    return;
+  }
+
+  /* last port of the block */
+  sr_portblock_release(pb, h, i);
+}
+
+/* Bit for port in pb->reserved[kind], or -1 if no block covers it. */
+static int sr_portblock_reserved_bit(struct sr_portblock *pb, uint16_t port) {
+  if (port < pb->lo || (uint32_t)(port - pb->lo) >= sr_portblock_capacity(pb)) {
+    return -1;
+  }
+  return port - pb->lo;
+}
+
+int sr_portblock_claim(struct sr_portblock *pb, uint32_t ip, int kind, uint16_t port) {
+  struct sr_portblock_host *h = sr_portblock_host(pb, ip);
+  int bit = sr_portblock_reserved_bit(pb, port), block, off, i;
+
+  if (bit < 0 || (pb->reserved[kind][bit / 32] & (1u << (bit % 32)))) {
+    return -1;
+  }
+  block = bit / SR_PORTBLOCK_SZ;
+  off = bit % SR_PORTBLOCK_SZ;
+  for (i = 0; h && i < h->nblocks && h->block[i] != block; i++) {
+  }
+  if (h == NULL || i == h->nblocks) {
+    /* the block must still be in the pool, and the host have room for it */
+    if ((h && h->nblocks == SR_PORTBLOCK_PER_HOST) || sr_portalloc_inuse(&(pb->free), block) ||
+        (h == NULL && (h = sr_portblock_host_add(pb, ip)) == NULL)) {
+      return -1;
+    }
+    sr_portalloc_claim(&(pb->free), (uint16_t) block);
+    i = sr_portblock_assign(pb, h, block);
+  }
+  else if (h->map[i][kind][off / 32] & (1u << (off % 32))) {
+    return -1;
+  }
+  h->map[i][kind][off / 32] |= 1u << (off % 32);
+  h->used[i]++;
+  pb->in_use[kind]++;
+  pb->allocs[kind]++;
+  return 0;
+}
+
+void sr_portblock_settle(struct sr_portblock *pb) {
+  sr_portalloc_settle(&(pb->free));
+}
+
+void sr_portblock_reserve(struct sr_portblock *pb, int kind, uint16_t port) {
+  int bit = sr_portblock_reserved_bit(pb, port);
+
+  if (bit >= 0) {
+    pb->reserved[kind][bit / 32] |= 1u << (bit % 32);
+  }
+}
+
+void sr_portblock_unreserve(struct sr_portblock *pb, int kind, uint16_t port) {
+  int bit = sr_portblock_reserved_bit(pb, port);
+
+  if (bit >= 0) {
+    pb->reserved[kind][bit / 32] &= ~(1u << (bit % 32));
+  }
+}
+
+uint32_t sr_portblock_capacity(const struct sr_portblock *pb) {
+  return pb->free.size * SR_PORTBLOCK_SZ;
+}
@@ -0,0 +1,98 @@
+/* Port-block allocator for the NAT.
+
+   Instead of handing out external ports one at a time from a shared pool,
+   each internal host is given whole blocks of SR_PORTBLOCK_SZ contiguous
+   ports and takes its flows' ports from those. Allocating a port for a flow
+   is then a bit search in the host's own blocks; the shared pool is only
+   touched (and an event only reported) when a host needs another block or
+   gives back its last port in one. A host never holds more than
+   SR_PORTBLOCK_PER_HOST blocks, which bounds how much of the port space one
+   host can take.
+
+   A block covers the same port numbers for every kind (the NAT uses one
+   kind per mapping type), each with its own bitmap, and goes back to the
+   pool once it is empty for all of them. Free blocks are reused least
+   recently released first.
+
+   Ports can be reserved per kind, e.g. for static forwarding rules; a
+   reserved port is skipped when searching a block, whoever holds it.
+
+   The allocator does no locking of its own. */
+
+#ifndef SR_PORTBLOCK_H
+#define SR_PORTBLOCK_H
+
+#include <inttypes.h>
+#include "sr_portalloc.h"
+
+#define SR_PORTBLOCK_SZ       512   /* ports per block, multiple of 32 */
+#define SR_PORTBLOCK_PER_HOST 4     /* blocks one host may hold */
+#define SR_PORTBLOCK_KINDS    2     /* independent port spaces per block */
+
+/* Called when a block is assigned to (assigned != 0) or released by host
+   ip. lo..hi is the block's port range. */
+typedef void (*sr_portblock_event_fn)(void *arg, int assigned, uint32_t ip,
+  uint16_t lo, uint16_t hi);
+
+struct sr_portblock_host {
+  uint32_t ip;
+  int nblocks;
+  uint16_t block[SR_PORTBLOCK_PER_HOST];  /* block numbers */
+  uint16_t used[SR_PORTBLOCK_PER_HOST];   /* ports taken, all kinds */
+  uint16_t hint[SR_PORTBLOCK_PER_HOST];   /* bitmap word to search first */
+  uint32_t map[SR_PORTBLOCK_PER_HOST][SR_PORTBLOCK_KINDS][SR_PORTBLOCK_SZ / 32];
+  struct sr_portblock_host *next;         /* hash chain */
+};
+
+struct sr_portblock {
+  uint16_t lo;                  /* first port of block 0 */
+  struct sr_portalloc free;     /* free block numbers */
+  struct sr_portblock_host **hosts;
+  uint32_t nbuckets;
+  sr_portblock_event_fn event;
+  void *arg;
+  uint32_t reserved[SR_PORTBLOCK_KINDS][65536 / 32]; /* bit n: port lo + n */
+
+  /* counters */
+  uint32_t nhosts;              /* hosts holding a block */
+  uint32_t in_use[SR_PORTBLOCK_KINDS];
+  uint64_t allocs[SR_PORTBLOCK_KINDS];
+  uint64_t exhausted[SR_PORTBLOCK_KINDS]; /* no port in the host's blocks and no block to add */
+  uint64_t assigned;            /* blocks handed to hosts */
+  uint64_t released;            /* and given back */
+};
+
+/* Splits lo..hi into as many whole blocks as fit; a short tail is left
+   unused. The host table gets nbuckets chains. event may be NULL. Returns 0
+   on success. */
+int sr_portblock_init(struct sr_portblock *pb, uint16_t lo, uint16_t hi,
+  uint32_t nbuckets, sr_portblock_event_fn event, void *arg);
+
+/* Releases every host record. Outstanding ports become invalid. */
+void sr_portblock_destroy(struct sr_portblock *pb);
+
+/* Hands host ip a port of the given kind, or returns -1 if its blocks are
+   full and it may not, or cannot, get another. */
+int sr_portblock_get(struct sr_portblock *pb, uint32_t ip, int kind);
+
+/* Gives back a port obtained from sr_portblock_get() for the same host and
+   kind. Anything else is ignored. */
+void sr_portblock_put(struct sr_portblock *pb, uint32_t ip, int kind, uint16_t port);
+
+/* Gives host ip this particular port, e.g. to restore saved state: the
+   block holding it must be free or already the host's. Returns -1 if it
+   cannot have it. As with sr_portalloc_claim(), a batch of claims is
+   followed by sr_portblock_settle() before the next sr_portblock_get(). */
+int sr_portblock_claim(struct sr_portblock *pb, uint32_t ip, int kind, uint16_t port);
+void sr_portblock_settle(struct sr_portblock *pb);
+
+/* Keeps port of the given kind from being handed out until
+   sr_portblock_unreserve(). A host already holding it keeps it until it
+   gives it back. */
+void sr_portblock_reserve(struct sr_portblock *pb, int kind, uint16_t port);
+void sr_portblock_unreserve(struct sr_portblock *pb, int kind, uint16_t port);
+
+/* Ports in whole blocks, i.e. what the allocator can ever hand out per kind. */
+uint32_t sr_portblock_capacity(const struct sr_portblock *pb);
+
+#endif
@@ -24,6 +24,7 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_flowcache.h"
 
 #define OP_ARP_REQUEST 1
 #define OP_ARP_REPLY 2
@@ -82,6 +83,7 @@ void sr_handlepacket(struct sr_instance *sr,
 	assert(packet);
 	assert(interface);
 	struct sr_if* out_iface = 0;
+	struct sr_if* in_iface = 0;
 
 	struct sr_arpreq *req;
 	struct sr_arpcache *cache = &(sr->cache);
@@ -104,12 +106,12 @@ void sr_handlepacket(struct sr_instance *sr,
 
 		else if(arp_hdr->ar_op == htons(arp_op_reply)){
 			req = sr_arpcache_insert(cache, arp_hdr->ar_sha, arp_hdr->ar_sip);
+			sr_flowcache_invalidate(sr->flows);
 			struct sr_packet *pkt, *nxt;
         
         	for (pkt = req->packets; pkt; pkt = nxt) {
         		/*handle_ip(sr, pkt->buf, pkt->len, pkt->iface);*/
-        		out_iface = sr_get_interface(sr, pkt->iface);
-		      	assert(out_iface);
+        		out_iface = pkt->iface;
 		      /* update ethernet header */
 		      	sr_ethernet_hdr_t* ethernet_hdr = (sr_ethernet_hdr_t *)(pkt->buf);
 		      	memcpy(ethernet_hdr->ether_dhost, arp_hdr->ar_sha, sizeof(uint8_t)*ETHER_ADDR_LEN);
@@ -119,14 +121,11 @@ void sr_handlepacket(struct sr_instance *sr,
 
 		      	sr_ip_hdr_t* ip_hdr = (sr_ip_hdr_t *)(pkt->buf + sizeof(struct sr_ethernet_hdr));
 
-		      	ip_hdr->ip_ttl--;
-		      	bzero(&(ip_hdr->ip_sum), 2);
-		      	uint16_t ip_cksum = cksum(ip_hdr, sizeof(struct sr_ip_hdr));
-		      	ip_hdr->ip_sum = ip_cksum;
+		      	ip_decrement_ttl(ip_hdr);
 
 		      	printf("Send packet:\n");
 		      	/*print_hdrs(pkt->buf, pkt->len);*/
-		      	sr_send_packet(sr, pkt->buf, pkt->len, pkt->iface);
+		      	sr_send_packet_if(sr, pkt->buf, pkt->len, pkt->iface);
             	nxt = pkt->next;
             }
             sr_arpreq_destroy(cache, req);
@@ -136,7 +135,21 @@ void sr_handlepacket(struct sr_instance *sr,
 	
 	else if (ethtype == ethertype_ip) {
 
-		handle_ip(sr, packet, len, interface);
+		/* resolved once here; the forwarding paths get the interface */
+		in_iface = sr_get_interface(sr, interface);
+		if(in_iface == 0){
+			fprintf(stderr, "PACKET FROM UNKNOWN INTERFACE %s, DROPPING \n", interface);
+			return;
+		}
+
+		/* next hops from route lookups stay good until this is left,
+		   whatever route changes come meanwhile */
+		sr_epoch_enter(&(sr->rt_epoch));
+		if(!sr_flowcache_forward(sr, packet, len)){
+			sr_flowcache_begin(sr->flows, packet, len);
+			handle_ip(sr, packet, len, in_iface);
+		}
+		sr_epoch_exit(&(sr->rt_epoch));
 		
 		/*send_arprequest(sr, htonl(3232236033));*/
 		
@@ -156,12 +169,11 @@ void sr_handlepacket(struct sr_instance *sr,
 void handle_ip(struct sr_instance* sr, 
 		uint8_t * packet/* lent */,
         unsigned int len,
-        char* name/* sent from*/)
+        struct sr_if* in_iface/* sent from*/)
 
 {
 	struct sr_if* iface = 0;
-	char outgoing_iface[sr_IFACE_NAMELEN];
-	bzero(outgoing_iface, sr_IFACE_NAMELEN);
+	const struct sr_nexthop* nh = 0;
 	struct sr_arpcache *cache = &(sr->cache);
 	uint8_t* ip_data = packet +  sizeof(sr_ethernet_hdr_t);
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(ip_data);
@@ -171,8 +183,8 @@ void handle_ip(struct sr_instance* sr,
 	sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t*) packet;
 
 	if((iphdr->ip_p == ip_protocol_icmp) && (icmp_hdr->icmp_type == 3) && (icmp_hdr->icmp_code == 1)){
-		printf("IM HERE with %s\n", name);
-			iface = sr_get_interface(sr, name);
+		printf("IM HERE with %s\n", in_iface->name);
+			iface = in_iface;
 			print_addr_ip_int(ntohl(iface->ip));
 			handle_icmp(sr, packet, len, iface, 3, 1);
 			return;
@@ -180,8 +192,15 @@ void handle_ip(struct sr_instance* sr,
 
 	/* check if this packet is for one of the router's interfaces*/
 	iface = sr_get_interface_byip(sr, iphdr->ip_dst);
-	if(sr->nat && iphdr->ip_dst==sr->nat->ip_ext){
-		handle_nat(sr, packet, len, name, FORWARD);
+	if(sr->nat && sr_nat_is_external_ip(sr->nat, iphdr->ip_dst)){
+		/* from inside (not in through an interface holding a NAT address)
+		   to a port the NAT forwards: turn it straight round */
+		if(iphdr->ip_p == ip_protocol_tcp &&
+			!sr_nat_is_external_ip(sr->nat, in_iface->ip) &&
+			handle_nat_hairpin(sr, packet, len, in_iface)){
+			return;
+		}
+		handle_nat(sr, packet, len, in_iface, FORWARD);
 		printf("it hath returned\n");
 		return;
 	}
@@ -201,15 +220,15 @@ void handle_ip(struct sr_instance* sr,
 	/*print_hdr_ip(ip_data);*/
 
 	printf("%d\n", ntohl(iphdr->ip_dst));
-	struct sr_arpentry* entry = sr_arpcache_lookup(cache, iphdr->ip_dst);
+	nh = sr_lookup_nexthop(sr, iphdr->ip_dst);
+	printf("OUT ON: %s\n", nh ? nh->iface->name : "");
 
-	sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-	printf("OUT ON: %s\n", outgoing_iface);
+	struct sr_arpentry* entry = nh ? sr_arpcache_lookup(cache, sr_nexthop_ip(nh, iphdr->ip_dst)) : 0;
 
 	
 	if(iphdr->ip_ttl <=1){
 		printf("Sending TYPE 11 ICMP\n" );
-		iface = sr_get_interface(sr, name);
+		iface = in_iface;
 		handle_icmp(sr, packet, len,iface, 11, 0);
 		return;
 	}
@@ -217,36 +236,37 @@ void handle_ip(struct sr_instance* sr,
 
 	if(entry && entry->valid == 1){/*cache hit*/
 		
-		iface = sr_get_interface(sr, outgoing_iface);
+		iface = nh->iface;
 		memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
 		memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
 
-		iphdr->ip_sum = 0;
-		iphdr->ip_ttl--;
-		iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
+		ip_decrement_ttl(iphdr);
 
-		if(sr->nat && sr->nat->ip_ext != iphdr->ip_src){
-			handle_nat(sr, packet, len, name, FORWARD);
+		if(sr->nat && !sr_nat_is_external_ip(sr->nat, iphdr->ip_src)){
+			handle_nat(sr, packet, len, in_iface, FORWARD);
 		}
 		else{
-			if (sr_send_packet(sr, packet, len, iface->name) == -1 ) {
+			if (sr_send_packet_if(sr, packet, len, iface) == -1 ) {
 				fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 			}
+			else{
+				sr_flowcache_fill(sr->flows, packet, iface, NULL);
+			}
 		}
 		
 		
 	}
-	else if(outgoing_iface[0]!=0){ 
+	else if(nh){ 
 		if(sr->nat){
-			handle_nat(sr, packet, len, name, QUEUE);
+			handle_nat(sr, packet, len, in_iface, QUEUE);
 		}else{
-			sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+			sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, nh->iface);
 		}
 		
 		
 	}
 	else{
-		iface = sr_get_interface(sr, name);
+		iface = in_iface;
 		handle_icmp(sr, packet, len,iface, 3, 0);
 	}
 }
@@ -256,10 +276,14 @@ void handle_icmp(struct sr_instance* sr,
 				struct sr_if* iface, 
 				int type, int code)
 {
-	char outgoing_iface[sr_IFACE_NAMELEN];
+	const struct sr_nexthop* nh = sr_lookup_nexthop(sr, ((sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t)))->ip_src);
 
 
 	struct sr_arpcache *cache = &(sr->cache);
+	if(nh == 0){
+		fprintf(stderr, "NO ROUTE BACK FOR ICMP \n");
+		return;
+	}
 	if(type == 3 || type == 11){
 		int new_len = sizeof(sr_ethernet_hdr_t)+ sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t) + sizeof(uint8_t)*ICMP_DATA_SIZE;
 		uint8_t* new_packet = (uint8_t*) malloc(new_len);
@@ -281,7 +305,7 @@ void handle_icmp(struct sr_instance* sr,
 	printf("%d\n", sizeof(sr_ip_hdr_t) +8);
 	memcpy(icmp_payload, ip_data, sizeof(uint8_t)*ICMP_DATA_SIZE);
 
-	struct sr_arpentry* entry = sr_arpcache_lookup(cache, ip_hdr->ip_src);
+	struct sr_arpentry* entry = sr_arpcache_lookup(cache, sr_nexthop_ip(nh, ip_hdr->ip_src));
 	
 
 	uint8_t* icmp_data = packet +  sizeof(sr_ethernet_hdr_t)+  sizeof(sr_ip_hdr_t);
@@ -318,8 +342,7 @@ void handle_icmp(struct sr_instance* sr,
 		icmp_hdr->icmp_sum = cksum(icmp_hdr, (len-(sizeof(sr_ethernet_hdr_t)+ sizeof(sr_ip_hdr_t))));
 
 	}
-	sr_longest_prefix_iface(sr, ip_hdr->ip_src, outgoing_iface);
-	out_iface = sr_get_interface(sr, outgoing_iface);
+	out_iface = nh->iface;
 	ip_hdr->ip_ttl = 100;
 	ip_hdr->ip_dst = ip_src;	
 	ip_hdr->ip_src = iface->ip;
@@ -335,28 +358,24 @@ void handle_icmp(struct sr_instance* sr,
 		ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
 		/*cksum(ip_data, sizeof(sr_ip_hdr_t));*/
 		
-		if (sr_send_packet(sr, packet, len, outgoing_iface) == -1 ) {
+		if (sr_send_packet_if(sr, packet, len, out_iface) == -1 ) {
 					fprintf(stderr, "CANNOT SEND ICMP PACKET \n");
 				}
 	}
 	else{
 		
-		printf("cache miss %s\n", outgoing_iface);
-		sr_arpcache_queuereq(cache, ip_hdr->ip_dst, packet, len, outgoing_iface);
+		printf("cache miss %s\n", out_iface->name);
+		sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, ip_hdr->ip_dst), packet, len, out_iface);
 	}
 
 }
 
 
 
-void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name)
+void send_arprequest(struct sr_instance* sr, uint32_t ip, struct sr_if* iface)
 {
 	unsigned int len=42;
 	/* Assume MAC address is not found in ARP cache. We are using the next IP hop*/
-	struct sr_if* iface = 0;
-
-
-	iface = sr_get_interface(sr, name);
 	uint8_t broadcast_addr[ETHER_ADDR_LEN]  = {255, 255, 255, 255, 255, 255};
 	
 	uint8_t* arp_packet = (uint8_t*) malloc(len);
@@ -382,7 +401,7 @@ void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name)
 	bzero(arp_hdr->ar_tha, sizeof(uint8_t)*ETHER_ADDR_LEN);
 	arp_hdr->ar_tip = ip;
 	
-	if (sr_send_packet(sr, arp_packet, len, iface->name) == -1 ) {
+	if (sr_send_packet_if(sr, arp_packet, len, iface) == -1 ) {
 		fprintf(stderr, "CANNOT SEND ARP REQUEST \n");
 	}
 	
@@ -412,11 +431,18 @@ void send_arpreply(struct sr_instance* sr,
 	sr_arp_hdr_t *arp_hdr = (sr_arp_hdr_t *)(arp_data);
 	
 	/*if (arp_hdr->ar_op == htons(OP_ARP_REQUEST)){*/
+		uint32_t tip = arp_hdr->ar_tip;
 		arp_hdr->ar_op = htons(OP_ARP_REPLY);
 		memcpy(arp_hdr->ar_tha, arp_hdr->ar_sha, arp_hdr->ar_hln);
 		arp_hdr->ar_tip = arp_hdr->ar_sip;
 		memcpy(arp_hdr->ar_sha, iface->addr, arp_hdr->ar_hln);
-		arp_hdr->ar_sip = iface->ip;	
+		/* NAT pool addresses are answered for with the interface's MAC */
+		if(sr->nat && sr_nat_is_external_ip(sr->nat, tip)){
+			arp_hdr->ar_sip = tip;
+		}
+		else{
+			arp_hdr->ar_sip = iface->ip;
+		}
 	/*}*/
 	/*printf("IP ADDRESS: %lu \n", ntohl(arp_hdr->ar_tip));*/
 	/*TODO:
@@ -440,17 +466,75 @@ void send_arpreply(struct sr_instance* sr,
 	
 }
 
+/* NAT field rewrites. Each patches the checksums covering the field it
+   changes (RFC 1624) rather than summing the packet again, so the cost does
+   not depend on the payload length. */
+
+/* Rewrites the ICMP query id (the NAT'd "port" for ICMP). */
+static void nat_set_icmp_id(sr_icmp_hdr_t *icmp_hdr, uint16_t id)
+{
+	uint16_t new_id = htons(id);
+	icmp_hdr->icmp_sum = cksum_adjust16(icmp_hdr->icmp_sum, icmp_hdr->icmp_id, new_id);
+	icmp_hdr->icmp_id = new_id;
+}
+
+/* Rewrites the source (or, with dst set, destination) address. The TCP
+   checksum covers it too, through the pseudo-header. */
+static void nat_set_ip(sr_ip_hdr_t *iphdr, sr_tcp_hdr_t *tcp_header, int dst, uint32_t ip)
+{
+	uint32_t old_ip = dst ? iphdr->ip_dst : iphdr->ip_src;
+	iphdr->ip_sum = cksum_adjust32(iphdr->ip_sum, old_ip, ip);
+	if(tcp_header){
+		tcp_header->checksum = cksum_adjust32(tcp_header->checksum, old_ip, ip);
+	}
+	if(dst){
+		iphdr->ip_dst = ip;
+	}
+	else{
+		iphdr->ip_src = ip;
+	}
+}
+
+/* Rewrites the TCP source (or destination) port. */
+static void nat_set_tcp_port(sr_tcp_hdr_t *tcp_header, int dst, uint16_t port)
+{
+	uint16_t new_port = htons(port);
+	uint16_t old_port = dst ? tcp_header->aux_dst : tcp_header->aux_src;
+	tcp_header->checksum = cksum_adjust16(tcp_header->checksum, old_port, new_port);
+	if(dst){
+		tcp_header->aux_dst = new_port;
+	}
+	else{
+		tcp_header->aux_src = new_port;
+	}
+}
+
+/* Hands a translated flow that was just sent to the flow cache, provided the
+   NAT lets it go (see sr_nat_flow_pin()). */
+static void nat_fill_flow(struct sr_instance *sr, uint8_t *packet, const struct sr_if *iface,
+	struct sr_nat_xlate *xlate, uint32_t ip_remote, uint16_t aux_remote)
+{
+	time_t *touch;
+
+	if(sr->flows == NULL || !sr->flows->pending_ok){
+		return;
+	}
+	touch = sr_nat_flow_pin(sr->nat, xlate, ip_remote, aux_remote);
+	if(touch){
+		sr_flowcache_fill(sr->flows, packet, iface, touch);
+	}
+}
+
 void handle_nat(struct sr_instance* sr,
 				uint8_t* packet,
 				int len,
-				const char* name,
+				struct sr_if* in_iface,
 				int action)
 {
 	struct sr_if* iface=0;
-	char outgoing_iface[sr_IFACE_NAMELEN];
-	bzero(outgoing_iface, sr_IFACE_NAMELEN);
+	const struct sr_nexthop* nh = 0;
 	int aux_int;
-	struct sr_nat_mapping *copy;
+	struct sr_nat_xlate xlate;
 	uint8_t* ip_data = packet +  sizeof(sr_ethernet_hdr_t);
 	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(ip_data);
 	struct sr_arpcache *cache = &(sr->cache);
@@ -461,34 +545,38 @@ void handle_nat(struct sr_instance* sr,
 
 	if(iphdr->ip_p == ip_protocol_icmp){
 		aux_int = ntohs(icmp_hdr->icmp_id);
-		if(iphdr->ip_dst==sr->nat->ip_ext){
+		if(sr_nat_is_external_ip(sr->nat, iphdr->ip_dst)){
 
 			
 			printf("%lu\n", aux_int);
-			copy = sr_nat_lookup_external(sr->nat, aux_int, nat_mapping_icmp);
-			
-			if(copy){
-				iphdr->ip_dst = copy->ip_int;
-				struct sr_arpentry* entry = sr_arpcache_lookup(cache, iphdr->ip_dst);
-				sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-				iface = sr_get_interface(sr, outgoing_iface);
+			/* the prefilter turns away ids nobody holds without a lookup */
+			if(sr_nat_ext_mapped(sr->nat, iphdr->ip_dst, aux_int, nat_mapping_icmp) &&
+				sr_nat_lookup_external_r(sr->nat, iphdr->ip_dst, aux_int, nat_mapping_icmp, &xlate)){
+				nat_set_ip(iphdr, NULL, 1, xlate.ip_int);
+				nat_set_icmp_id(icmp_hdr, xlate.aux_int);
+				if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+					fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+					return;
+				}
+				iface = nh->iface;
+				struct sr_arpentry* entry = sr_arpcache_lookup(cache, sr_nexthop_ip(nh, iphdr->ip_dst));
 				if(entry && entry->valid == 1){/*cache hit*/
 					
 					
 					memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
 					memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
 
-					iphdr->ip_sum = 0;
-					iphdr->ip_ttl--;
-					iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
-					if (sr_send_packet(sr, packet, len, iface->name) == -1 ) {
+					ip_decrement_ttl(iphdr);
+					if (sr_send_packet_if(sr, packet, len, iface) == -1 ) {
 						fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 					}
+					else{
+						nat_fill_flow(sr, packet, iface, &xlate, iphdr->ip_src, 0);
+					}
 				}
 				else{
-					sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+					sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, iface);
 				}
-				free(copy);
 			}
 			else{
 				iface = sr_get_interface_byip(sr, iphdr->ip_dst);
@@ -502,141 +590,216 @@ void handle_nat(struct sr_instance* sr,
 
 		if(action == QUEUE){
 			
-			copy = sr_nat_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_icmp);
-			if(copy==NULL){
-				copy = sr_nat_insert_mapping(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_icmp);
+			if(!sr_nat_lookup_internal_r(sr->nat, iphdr->ip_src, aux_int, nat_mapping_icmp, &xlate) &&
+				!sr_nat_insert_mapping_r(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_icmp, &xlate)){
+				fprintf(stderr, "NO NAT MAPPING (PORTS EXHAUSTED OR HOST LIMIT), DROPPING PACKET \n");
+				return;
+			}
+			nat_set_ip(iphdr, NULL, 0, xlate.ip_ext);
+			nat_set_icmp_id(icmp_hdr, xlate.aux_ext);
+			if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+				fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+				return;
 			}
-			iphdr->ip_src = copy->ip_ext;
-			sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-			sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+			sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, nh->iface);
 			
 		}
 		else if(action == FORWARD){
 			
-			copy = sr_nat_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_icmp);
-			if(copy==NULL){
-				copy = sr_nat_insert_mapping(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_icmp);
+			if(!sr_nat_lookup_internal_r(sr->nat, iphdr->ip_src, aux_int, nat_mapping_icmp, &xlate) &&
+				!sr_nat_insert_mapping_r(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_icmp, &xlate)){
+				fprintf(stderr, "NO NAT MAPPING (PORTS EXHAUSTED OR HOST LIMIT), DROPPING PACKET \n");
+				return;
 			}
-			iphdr->ip_src = copy->ip_ext;
-			iphdr->ip_sum = 0;
-			iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
-			sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-			if (sr_send_packet(sr, packet, len, outgoing_iface) == -1 ) {
+			nat_set_ip(iphdr, NULL, 0, xlate.ip_ext);
+			nat_set_icmp_id(icmp_hdr, xlate.aux_ext);
+			if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+				fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+				return;
+			}
+			if (sr_send_packet_if(sr, packet, len, nh->iface) == -1 ) {
 				fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 			}
+			else{
+				nat_fill_flow(sr, packet, nh->iface, &xlate, iphdr->ip_dst, 0);
+			}
 		}
-		free(copy);
 	}
 	else if(iphdr->ip_p == ip_protocol_tcp){
 		sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
 		
 
-		if(iphdr->ip_dst==sr->nat->ip_ext){
+		if(sr_nat_is_external_ip(sr->nat, iphdr->ip_dst)){
 			aux_int = ntohs(tcp_header->aux_dst);
 			
-			copy = sr_nat_lookup_external(sr->nat, aux_int, nat_mapping_tcp);
-			
-			if(copy){
-				iphdr->ip_dst = copy->ip_int;
-				tcp_header->aux_dst= htons(copy->aux_int);
-				struct sr_arpentry* entry = sr_arpcache_lookup(cache, iphdr->ip_dst);
-				sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-				iface = sr_get_interface(sr, outgoing_iface);
-				sr_tcp_conn_handle(sr, copy, packet, len, INCOMING);
+			/* static rules first; then the prefilter turns away ports nobody
+			   holds without a lookup */
+			if(sr_nat_static_lookup_external(sr->nat, iphdr->ip_dst, aux_int, nat_mapping_tcp, &xlate) ||
+				(sr_nat_ext_mapped(sr->nat, iphdr->ip_dst, aux_int, nat_mapping_tcp) &&
+				sr_nat_lookup_external_r(sr->nat, iphdr->ip_dst, aux_int, nat_mapping_tcp, &xlate))){
+				nat_set_ip(iphdr, tcp_header, 1, xlate.ip_int);
+				nat_set_tcp_port(tcp_header, 1, xlate.aux_int);
+				if(!sr_tcp_conn_handle(sr, &xlate, packet, len, INCOMING)){
+					return;
+				}
+				if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+					fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+					return;
+				}
+				iface = nh->iface;
+				struct sr_arpentry* entry = sr_arpcache_lookup(cache, sr_nexthop_ip(nh, iphdr->ip_dst));
 				if(entry && entry->valid == 1){/*cache hit*/
 					
 					
 					memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
 					memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
 
-					iphdr->ip_sum = 0;
-					iphdr->ip_ttl--;
-					iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
-					tcp_header->checksum= tcp_cksum(packet,len);
-					if (sr_send_packet(sr, packet, len, iface->name) == -1 ) {
+					ip_decrement_ttl(iphdr);
+					if (sr_send_packet_if(sr, packet, len, iface) == -1 ) {
 						fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 					}
+					else{
+						nat_fill_flow(sr, packet, iface, &xlate, iphdr->ip_src, tcp_header->aux_src);
+					}
 				}
 				else{
-					tcp_header->checksum= tcp_cksum(packet,len);
-					sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+					sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, iface);
 				}
-				free(copy);
 			}
 			else if(aux_int <= 1023){
 				
-				iface = sr_get_interface(sr, name);
+				iface = in_iface;
 				handle_icmp(sr, packet, len,iface, 3, 3);
 			}
-			else{/* this is when we keep an uncolicited syn*/
-				uint8_t* new_packet = (uint8_t*) malloc(len);
-				memcpy(new_packet, packet, len);
-				copy = sr_nat_insert_unsol_mapping(sr->nat, packet, len);
-
+			else if((tcp_header->flags & (tcp_flag_syn | tcp_flag_ack | tcp_flag_rst)) != tcp_flag_syn){
+				/* stray segment for a port nobody holds: dropped, nothing to keep */
+			}
+			else if(!sr_nat_hold_syn(sr->nat, packet, len)){/* this is when we keep an uncolicited syn*/
+				fprintf(stderr, "TOO MANY UNSOLICITED SYNS HELD, DROPPING PACKET \n");
 			}
 			return;
 		}
 
 		aux_int = ntohs(tcp_header->aux_src);
 		
+		/* a host inside opening the connection answers any SYN held from the
+		   other end */
+		if(tcp_header->flags & tcp_flag_syn){
+			sr_nat_cancel_syn(sr->nat, iphdr->ip_dst, tcp_header->aux_dst);
+		}
 
 		if(action == QUEUE){
-			copy = sr_nat_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp);
-			if(copy==NULL){
-				copy = sr_nat_lookup_waiting_syn(sr->nat, iphdr->ip_dst, tcp_header->aux_dst);
-				sr_nat_delete_mapping(sr->nat, copy);
-				copy = sr_nat_insert_mapping(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_tcp);
+			if(!sr_nat_static_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp, &xlate) &&
+				!sr_nat_lookup_internal_r(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp, &xlate) &&
+				!sr_nat_insert_mapping_r(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_tcp, &xlate)){
+				fprintf(stderr, "NO NAT MAPPING (PORTS EXHAUSTED OR HOST LIMIT), DROPPING PACKET \n");
+				return;
 			}
-			iphdr->ip_src = copy->ip_ext;
-			
-        	tcp_header->aux_src= htons(copy->aux_ext);
-        	tcp_header->checksum= tcp_cksum(packet,len);
-        	sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-			sr_tcp_conn_handle(sr, copy, packet, len, OUTGOING);
-			sr_arpcache_queuereq(cache, iphdr->ip_dst, packet, len, outgoing_iface);
+			nat_set_ip(iphdr, tcp_header, 0, xlate.ip_ext);
+			nat_set_tcp_port(tcp_header, 0, xlate.aux_ext);
+			if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+				fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+				return;
+			}
+			if(!sr_tcp_conn_handle(sr, &xlate, packet, len, OUTGOING)){
+				return;
+			}
+			sr_arpcache_queuereq(cache, sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, nh->iface);
 		}
 		else if(action == FORWARD){
-			copy = sr_nat_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp);
-			if(copy==NULL){
-				copy = sr_nat_insert_mapping(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_tcp);
+			if(!sr_nat_static_lookup_internal(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp, &xlate) &&
+				!sr_nat_lookup_internal_r(sr->nat, iphdr->ip_src, aux_int, nat_mapping_tcp, &xlate) &&
+				!sr_nat_insert_mapping_r(sr->nat, iphdr->ip_src,  aux_int,  nat_mapping_tcp, &xlate)){
+				fprintf(stderr, "NO NAT MAPPING (PORTS EXHAUSTED OR HOST LIMIT), DROPPING PACKET \n");
+				return;
 			}
-			iphdr->ip_src = copy->ip_ext;
-			iphdr->ip_sum = 0;
-			iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
-			tcp_header->aux_src= htons(copy->aux_ext);
-        	tcp_header->checksum= tcp_cksum(packet,len);
-			sr_longest_prefix_iface(sr, iphdr->ip_dst, outgoing_iface);
-			sr_tcp_conn_handle(sr, copy, packet, len, OUTGOING);
-			if (sr_send_packet(sr, packet, len, outgoing_iface) == -1 ) {
+			nat_set_ip(iphdr, tcp_header, 0, xlate.ip_ext);
+			nat_set_tcp_port(tcp_header, 0, xlate.aux_ext);
+			if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+				fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+				return;
+			}
+			if(!sr_tcp_conn_handle(sr, &xlate, packet, len, OUTGOING)){
+				return;
+			}
+			if (sr_send_packet_if(sr, packet, len, nh->iface) == -1 ) {
 				fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
 			}
+			else{
+				nat_fill_flow(sr, packet, nh->iface, &xlate, iphdr->ip_dst, tcp_header->aux_dst);
+			}
 		}
-		free(copy);
 
 	}
 }
-uint16_t tcp_cksum(uint8_t* packet, int len){
-
-  sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr));
-  sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
 
-  sr_tcp_pshdr_t *tcp_pshdr = calloc(1,sizeof(struct sr_tcp_pshdr));
-  tcp_pshdr->ip_src = iphdr->ip_src;
-  tcp_pshdr->ip_dst = iphdr->ip_dst;
-  tcp_pshdr->ip_p = iphdr->ip_p;
-  uint16_t tcp_length = len-sizeof(struct sr_ethernet_hdr)-sizeof(struct sr_ip_hdr);
-  tcp_pshdr->len = htons(tcp_length);
-
-  tcp_header->checksum = 0; 
+/* Traffic from inside to one of the NAT's own addresses (hairpinning).
+   Both ends are translated in one pass, as if the packet had gone out and
+   come back in: the source by the sender's own mapping, the destination by
+   the mapping or static rule that owns the external port. Each mapping
+   tracks the segment from its own side, and the packet goes straight back
+   out towards the internal destination. Returns 0, leaving the packet
+   alone, if nothing owns the destination port, so the caller can treat it
+   as ordinary inbound traffic. TCP only: an ICMP query id could not carry
+   both translations. */
+int handle_nat_hairpin(struct sr_instance* sr,
+				uint8_t* packet,
+				int len,
+				struct sr_if* in_iface)
+{
+	struct sr_if* iface=0;
+	const struct sr_nexthop* nh = 0;
+	struct sr_nat_xlate from, to;
+	sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t*) packet;
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+	sr_tcp_hdr_t *tcp_header = (sr_tcp_hdr_t *)(packet+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t));
+	uint16_t aux_dst = ntohs(tcp_header->aux_dst), aux_src = ntohs(tcp_header->aux_src);
+
+	if(!sr_nat_static_lookup_external(sr->nat, iphdr->ip_dst, aux_dst, nat_mapping_tcp, &to) &&
+		!(sr_nat_ext_mapped(sr->nat, iphdr->ip_dst, aux_dst, nat_mapping_tcp) &&
+		sr_nat_lookup_external_r(sr->nat, iphdr->ip_dst, aux_dst, nat_mapping_tcp, &to))){
+		return 0;
+	}
+	if(iphdr->ip_ttl <= 1){
+		handle_icmp(sr, packet, len, in_iface, 11, 0);
+		return 1;
+	}
+	if(!sr_nat_static_lookup_internal(sr->nat, iphdr->ip_src, aux_src, nat_mapping_tcp, &from) &&
+		!sr_nat_lookup_internal_r(sr->nat, iphdr->ip_src, aux_src, nat_mapping_tcp, &from) &&
+		!sr_nat_insert_mapping_r(sr->nat, iphdr->ip_src, aux_src, nat_mapping_tcp, &from)){
+		fprintf(stderr, "NO NAT MAPPING (PORTS EXHAUSTED OR HOST LIMIT), DROPPING PACKET \n");
+		return 1;
+	}
 
-  uint8_t *total_tcp = calloc(1, sizeof(struct sr_tcp_pshdr)+tcp_length);
-  memcpy(total_tcp,tcp_pshdr, sizeof(struct sr_tcp_pshdr));
-  memcpy((total_tcp+sizeof(struct sr_tcp_pshdr)), tcp_header, tcp_length);
+	/* the source first: the destination's mapping sees the segment come
+	   from the sender's external endpoint */
+	nat_set_ip(iphdr, tcp_header, 0, from.ip_ext);
+	nat_set_tcp_port(tcp_header, 0, from.aux_ext);
+	if(!sr_tcp_conn_handle(sr, &from, packet, len, OUTGOING) ||
+		!sr_tcp_conn_handle(sr, &to, packet, len, INCOMING)){
+		return 1;
+	}
+	nat_set_ip(iphdr, tcp_header, 1, to.ip_int);
+	nat_set_tcp_port(tcp_header, 1, to.aux_int);
 
-  uint16_t checksum = cksum(total_tcp, sizeof(struct sr_tcp_pshdr)+tcp_length);
-  
-  free(tcp_pshdr);
-  free(total_tcp);
+	if(!(nh = sr_lookup_nexthop(sr, iphdr->ip_dst))){
+		fprintf(stderr, "NO ROUTE, DROPPING PACKET \n");
+		return 1;
+	}
+	iface = nh->iface;
+	struct sr_arpentry* entry = sr_arpcache_lookup(&(sr->cache), sr_nexthop_ip(nh, iphdr->ip_dst));
+	if(entry && entry->valid == 1){/*cache hit*/
+		memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(uint8_t)*ETHER_ADDR_LEN);
+		memcpy(eth_hdr->ether_shost, iface->addr, sizeof(uint8_t)*ETHER_ADDR_LEN);
 
-  return checksum;
-}
\ No newline at end of file
+		ip_decrement_ttl(iphdr);
+		if (sr_send_packet_if(sr, packet, len, iface) == -1 ) {
+			fprintf(stderr, "CANNOT FORWARD IP PACKET \n");
+		}
+	}
+	else{
+		sr_arpcache_queuereq(&(sr->cache), sr_nexthop_ip(nh, iphdr->ip_dst), packet, len, iface);
+	}
+	free(entry);
+	return 1;
+}
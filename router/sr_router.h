@@ -15,6 +15,7 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_epoch.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -35,6 +36,8 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_flowcache;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -53,11 +56,23 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
+    struct sr_fib* fib; /* compiled from routing_table, for lookups */
+    int fib_engine; /* SR_FIB_POPTRIE or SR_FIB_DIR24 */
+    /* Routes change at run time. rt_lock serializes the changes and
+       guards routing_table; fib is replaced whole on every change and
+       read in rt_epoch sections, so lookups take no lock. */
+    pthread_mutex_t rt_lock;
+    struct sr_epoch rt_epoch;
+    char* rt_path; /* file the routes were last loaded from */
+    int rt_reload; /* set to have the ARP thread reload rt_path */
+    const char* rt_cmd_path; /* route command file, or 0 */
+    int rt_cmd; /* set to have the ARP thread run rt_cmd_path */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
     FILE* logfile;
 
     struct sr_nat* nat;
+    struct sr_flowcache* flows; /* established-flow fast path */
 };
 
 /* -- sr_main.c -- */
@@ -65,18 +80,19 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packet_if(struct sr_instance* , uint8_t* , unsigned int , const struct sr_if*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-void handle_ip(struct sr_instance* sr, uint8_t * packet/* lent */,unsigned int len, char* name);
+void handle_ip(struct sr_instance* sr, uint8_t * packet/* lent */,unsigned int len, struct sr_if* in_iface);
 void handle_icmp(struct sr_instance* sr, uint8_t * packet, int len, struct sr_if* iface, int type, int code);
-void send_arprequest(struct sr_instance* sr, uint32_t ip, char* name);
+void send_arprequest(struct sr_instance* sr, uint32_t ip, struct sr_if* iface);
 void send_arpreply(struct sr_instance* sr, uint8_t* packet, unsigned int len, const char* name);
-void handle_nat(struct sr_instance* sr, uint8_t* packet, int len, const char* name, int action);
-uint16_t tcp_cksum(uint8_t* packet, int len);
+void handle_nat(struct sr_instance* sr, uint8_t* packet, int len, struct sr_if* in_iface, int action);
+int handle_nat_hairpin(struct sr_instance* sr, uint8_t* packet, int len, struct sr_if* in_iface);
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
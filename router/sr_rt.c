@@ -21,6 +21,13 @@
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_flowcache.h"
+#include "sr_fib.h"
+
+static struct sr_rt* sr_append_rt_entry(struct sr_rt** head, struct sr_rt* tail,
+        struct in_addr dest, struct in_addr gw, struct in_addr mask, char* if_name);
+static void sr_free_rt_list(struct sr_rt* entry);
+static int sr_publish_fib(struct sr_instance* sr);
 
 /*---------------------------------------------------------------------
  * Method:
@@ -38,7 +45,10 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt* routes = 0;
+    struct sr_rt* tail = 0;
+    char* path = 0;
+    int ret = 0;
 
     /* -- REQUIRES -- */
     assert(filename);
@@ -50,6 +60,8 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
 
     fp = fopen(filename,"r");
 
+    /* the new table is read in full off to the side, so a bad line
+       leaves the current one in place */
     while( fgets(line,BUFSIZ,fp) != 0)
     {
         sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
@@ -58,78 +70,393 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
             fprintf(stderr,
                     "Error loading routing table, cannot convert %s to valid IP\n",
                     dest);
-            return -1; 
+            ret = -1;
+            break;
         }
         if(inet_aton(gw,&gw_addr) == 0)
         { 
             fprintf(stderr,
                     "Error loading routing table, cannot convert %s to valid IP\n",
                     gw);
-            return -1; 
+            ret = -1;
+            break;
         }
         if(inet_aton(mask,&mask_addr) == 0)
         { 
             fprintf(stderr,
                     "Error loading routing table, cannot convert %s to valid IP\n",
                     mask);
-            return -1; 
+            ret = -1;
+            break;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+        /* appending at a remembered tail keeps big tables linear to load */
+        tail = sr_append_rt_entry(&routes,tail,dest_addr,gw_addr,mask_addr,iface);
+        if(tail == 0)
+        {
+            fprintf(stderr,"Error loading routing table, out of memory\n");
+            ret = -1;
+            break;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
     } /* -- while -- */
+    fclose(fp);
+
+    if(ret != 0)
+    {
+        sr_free_rt_list(routes);
+        return -1;
+    }
+
+    printf("Loading routing table from server, clear local routing table.\n");
+    pthread_mutex_lock(&(sr->rt_lock));
+    tail = sr->routing_table;
+    sr->routing_table = routes;
+    if(sr_publish_fib(sr) != 0)
+    {
+        sr->routing_table = tail;
+        tail = routes;
+        ret = -1;
+    }
+    else if(filename != sr->rt_path && (path = strdup(filename)))
+    {
+        free(sr->rt_path);
+        sr->rt_path = path;
+    }
+    pthread_mutex_unlock(&(sr->rt_lock));
 
-    return 0; /* -- success -- */
+    /* whichever table is out of use; only writers ever walk the list */
+    sr_free_rt_list(tail);
+    return ret;
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_append_rt_entry(..)
+ * Scope: Local
  *
+ * Adds a route after tail, the last entry of the list at *head (or 0 to
+ * find it), and returns the new last entry, or 0, leaving the list as
+ * it was, if there is no memory for it. Leaves the FIB alone.
  *---------------------------------------------------------------------*/
 
-void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
-struct in_addr gw, struct in_addr mask,char* if_name)
+static struct sr_rt* sr_append_rt_entry(struct sr_rt** head, struct sr_rt* tail,
+        struct in_addr dest, struct in_addr gw, struct in_addr mask, char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt* entry = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
-    assert(sr);
+    assert(head);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
+    entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    if(entry == 0)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        return 0;
+    }
+    entry->next = 0;
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
 
-        return;
+    /* -- empty list special case -- */
+    if(*head == 0)
+    {
+        *head = entry;
+        return entry;
     }
 
     /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+    if(tail == 0)
+    {
+        tail = *head;
+        while(tail->next){
+          tail = tail->next;
+        }
+    }
+    tail->next = entry;
+    return entry;
+} /* -- sr_append_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_free_rt_list(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_free_rt_list(struct sr_rt* entry)
+{
+    struct sr_rt* next = 0;
+
+    for(; entry; entry = next)
+    {
+        next = entry->next;
+        free(entry);
+    }
+} /* -- sr_free_rt_list -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_retired(..)
+ * Scope: Local
+ *
+ * Frees a FIB once no lookup can still be in it.
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_retired(struct sr_epoch_entry* entry, void* arg)
+{
+    sr_fib_free(SR_EPOCH_OWNER(entry, struct sr_fib, retire));
+} /* -- sr_fib_retired -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_publish_fib(..)
+ * Scope: Local
+ *
+ * Compiles the routing table into a new FIB and swaps it in for the old
+ * one, which is retired rather than freed: lookups already under way
+ * finish in it. Returns -1, leaving the old FIB in use, if the table
+ * cannot be compiled. Called with rt_lock held.
+ *---------------------------------------------------------------------*/
+
+static int sr_publish_fib(struct sr_instance* sr)
+{
+    struct sr_fib* fib = sr_fib_build(sr->routing_table, sr->if_list, sr->fib_engine);
+    struct sr_fib* old = 0;
+
+    if(fib == 0)
+    {
+        fprintf(stderr, "Cannot compile the routing table\n");
+        return -1;
+    }
+    old = __atomic_exchange_n(&(sr->fib), fib, __ATOMIC_ACQ_REL);
+    if(old)
+    {
+        sr_epoch_retire(&(sr->rt_epoch), &(old->retire), sr_fib_retired, 0);
+    }
+    sr_flowcache_invalidate(sr->flows);
+    return 0;
+} /* -- sr_publish_fib -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_update_fib(..)
+ * Scope: Global
+ *
+ * Compiles the routing table into a new FIB in place of the old one.
+ * Called whenever the interfaces the routes name change.
+ *---------------------------------------------------------------------*/
+
+void sr_update_fib(struct sr_instance* sr)
+{
+    pthread_mutex_lock(&(sr->rt_lock));
+    sr_publish_fib(sr);
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_update_fib -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_add_rt_entry(..)
+ * Scope: Global
+ *
+ * Adds a route and puts it in effect. Returns -1, leaving the table as
+ * it was, if there is no memory for it or the table cannot be compiled
+ * with it.
+ *---------------------------------------------------------------------*/
+
+int sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
+struct in_addr gw, struct in_addr mask,char* if_name)
+{
+    struct sr_rt* entry = 0;
+    struct sr_rt** link = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    entry = sr_append_rt_entry(&(sr->routing_table),0,dest,gw,mask,if_name);
+    if(entry == 0)
+    {
+        ret = -1;
+    }
+    else if(sr_publish_fib(sr) != 0)
+    {
+        for(link = &(sr->routing_table); *link != entry; link = &((*link)->next));
+        *link = 0;
+        free(entry);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&(sr->rt_lock));
+    return ret;
+} /* -- sr_add_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_del_rt_entry(..)
+ * Scope: Global
+ *
+ * Removes every route for dest/mask. Returns -1 if there is none, or if
+ * the table cannot be compiled without them, in which case they stay.
+ *---------------------------------------------------------------------*/
+
+int sr_del_rt_entry(struct sr_instance* sr, struct in_addr dest, struct in_addr mask)
+{
+    struct sr_rt* removed = 0;
+    struct sr_rt** rm_tail = &removed;
+    struct sr_rt** link = 0;
+    struct sr_rt* entry = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    for(link = &(sr->routing_table); (entry = *link); )
+    {
+        if(entry->dest.s_addr == dest.s_addr && entry->mask.s_addr == mask.s_addr)
+        {
+            *link = entry->next;
+            entry->next = 0;
+            *rm_tail = entry;
+            rm_tail = &(entry->next);
+        }
+        else
+        {
+            link = &(entry->next);
+        }
     }
+    if(removed == 0)
+    {
+        ret = -1;
+    }
+    else if(sr_publish_fib(sr) != 0)
+    {
+        /* all for one prefix, so at the end they keep their precedence */
+        *link = removed;
+        removed = 0;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&(sr->rt_lock));
+
+    sr_free_rt_list(removed);
+    return ret;
+} /* -- sr_del_rt_entry -- */
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+/*---------------------------------------------------------------------
+ * Method: sr_reload_rt(..)
+ * Scope: Global
+ *
+ * Asks for the routes to be reloaded from the file they last came from.
+ * Only sets a flag, so it is safe in a signal handler; sr_rt_periodic()
+ * does the work.
+ *---------------------------------------------------------------------*/
+
+void sr_reload_rt(struct sr_instance* sr)
+{
+    __atomic_store_n(&(sr->rt_reload), 1, __ATOMIC_RELAXED);
+} /* -- sr_reload_rt -- */
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+/*---------------------------------------------------------------------
+ * Method: sr_rt_command(..)
+ * Scope: Global
+ *
+ * Asks for the route command file to be run. Only sets a flag, like
+ * sr_reload_rt().
+ *---------------------------------------------------------------------*/
 
-} /* -- sr_add_entry -- */
+void sr_rt_command(struct sr_instance* sr)
+{
+    __atomic_store_n(&(sr->rt_cmd), 1, __ATOMIC_RELAXED);
+} /* -- sr_rt_command -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_run_rt_commands(..)
+ * Scope: Global
+ *
+ * Runs the route changes in filename, one per line:
+ *
+ *   add <dest> <gateway> <mask> <interface>
+ *   del <dest> <mask>
+ *
+ * Blank lines and lines starting with # are skipped. Each change takes
+ * effect on its own, so a bad line is reported and the rest still run.
+ * Returns -1 if the file cannot be read or any line failed.
+ *---------------------------------------------------------------------*/
+
+int sr_run_rt_commands(struct sr_instance* sr, const char* filename)
+{
+    FILE* fp;
+    char  line[BUFSIZ];
+    char  verb[8];
+    char  dest[32];
+    char  gw[32];
+    char  mask[32];
+    char  iface[sr_IFACE_NAMELEN];
+    struct in_addr dest_addr;
+    struct in_addr gw_addr;
+    struct in_addr mask_addr;
+    int n = 0;
+    int ret = 0;
+
+    /* -- REQUIRES -- */
+    assert(filename);
+    if((fp = fopen(filename,"r")) == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    while( fgets(line,BUFSIZ,fp) != 0)
+    {
+        n = sscanf(line,"%7s %31s %31s %31s %31s",verb,dest,gw,mask,iface);
+        if(n <= 0 || verb[0] == '#')
+        {
+            continue;
+        }
+        if(strcmp(verb,"add") == 0 && n == 5 && inet_aton(dest,&dest_addr)
+                && inet_aton(gw,&gw_addr) && inet_aton(mask,&mask_addr))
+        {
+            if(sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface) == 0)
+            {
+                printf("Added route %s/%s via %s on %s\n",dest,mask,gw,iface);
+                continue;
+            }
+        }
+        /* del has no gateway, so its mask lands in gw */
+        else if(strcmp(verb,"del") == 0 && n == 3 && inet_aton(dest,&dest_addr)
+                && inet_aton(gw,&mask_addr))
+        {
+            if(sr_del_rt_entry(sr,dest_addr,mask_addr) == 0)
+            {
+                printf("Deleted routes to %s/%s\n",dest,gw);
+                continue;
+            }
+        }
+        fprintf(stderr,"Route command failed: %s",line);
+        ret = -1;
+    } /* -- while -- */
+    fclose(fp);
+    return ret;
+} /* -- sr_run_rt_commands -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_periodic(..)
+ * Scope: Global
+ *
+ * Called every second from the ARP cache thread: does any reload, then
+ * any route commands, asked for and frees the FIBs no lookup can still
+ * be using.
+ *---------------------------------------------------------------------*/
+
+void sr_rt_periodic(struct sr_instance* sr)
+{
+    char* path = 0;
+
+    if(__atomic_exchange_n(&(sr->rt_reload), 0, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&(sr->rt_lock));
+        path = sr->rt_path ? strdup(sr->rt_path) : 0;
+        pthread_mutex_unlock(&(sr->rt_lock));
+        if(path && sr_load_rt(sr, path) == 0)
+        {
+            printf("Reloaded routing table from %s\n", path);
+        }
+        free(path);
+    }
+    if(__atomic_exchange_n(&(sr->rt_cmd), 0, __ATOMIC_RELAXED) && sr->rt_cmd_path)
+    {
+        sr_run_rt_commands(sr, sr->rt_cmd_path);
+    }
+    sr_epoch_reclaim(&(sr->rt_epoch));
+} /* -- sr_rt_periodic -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -179,44 +506,40 @@ void sr_print_routing_entry(struct sr_rt* entry)
 
 } /* -- sr_print_routing_entry -- */
 
-void sr_longest_prefix_iface(struct sr_instance* sr, uint32_t ip, char* iface){
-    struct sr_rt* rt_walker = 0;
-    /*char iface[sr_IFACE_NAMELEN];*/
-    uint32_t diff=0, subnet = 0, x=0;
-    
-    if(sr->routing_table == 0)
+/*---------------------------------------------------------------------
+ * Method: sr_lookup_nexthop(..)
+ * Scope: Global
+ *
+ * Next hop of the longest-prefix route for ip, or 0 if no route covers
+ * ip or its interface is not known. Call it in an rt_epoch section; the
+ * record stays good until the section is left.
+ *---------------------------------------------------------------------*/
+
+const struct sr_nexthop* sr_lookup_nexthop(struct sr_instance* sr, uint32_t ip)
+{
+    const struct sr_fib* fib = SR_CONSUME(sr->fib);
+    const struct sr_nexthop* nh = 0;
+
+    if(fib == 0)
     {
         printf(" *warning* Routing table empty \n");
-        return ;
+        return 0;
     }
 
-    rt_walker = sr->routing_table;
-    subnet = ntohl(rt_walker->dest.s_addr & rt_walker->mask.s_addr);
-    diff = ntohl(ip & rt_walker->mask.s_addr);
-    /*printf("diff : %lu\n", diff);
-    printf("subnet: %lu\n", subnet);
-    /*comment to self : lowest diff of integer subtraction between ip's will give you longest prefix*/
-    /*
-    printf("Destination Address: %lu\n", ntohl(rt_walker->dest.s_addr));
-    printf("Looking for: %lu\n", ip);
-    printf("Looking for: %lu\n", ntohl(ip));
-    printf("Destination Address: %lu\n", diff);*/
-
-    if(diff == subnet){
-        memcpy(iface, rt_walker->interface, sr_IFACE_NAMELEN);
-    }
-    while(rt_walker->next)
-    {
-        rt_walker = rt_walker->next; 
-        subnet = ntohl(rt_walker->dest.s_addr & rt_walker->mask.s_addr);
-        diff = ntohl(ip & rt_walker->mask.s_addr);
-        if(diff == subnet){
-            /*printf("%d\n", diff);*/
-            
-            memcpy(iface, rt_walker->interface, sr_IFACE_NAMELEN);
-        }
-        
-    }
-    /*printf("OUTGOING INTEERFACE: %s\n", iface);*/
-    return;
-}
+    nh = sr_fib_lookup(fib, ip);
+    return nh && nh->iface ? nh : 0;
+} /* -- sr_lookup_nexthop -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_nexthop_ip(..)
+ * Scope: Global
+ *
+ * The address to ARP for to reach ip through nh: the route's gateway,
+ * or ip itself if the route is on-link (gateway 0.0.0.0). A gateway
+ * equal to ip comes to the same.
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_nexthop_ip(const struct sr_nexthop* nh, uint32_t ip)
+{
+    return nh->gw.s_addr ? nh->gw.s_addr : ip;
+} /* -- sr_nexthop_ip -- */
@@ -36,13 +36,35 @@ struct sr_rt
     struct sr_rt* next;
 };
 
+/* ----------------------------------------------------------------------------
+ * struct sr_nexthop
+ *
+ * Where a route lookup says to send a packet: the egress interface, whose
+ * addr and ip are the source MAC and IP to use, and the route's gateway.
+ * Routes sharing both share one record.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_nexthop
+{
+    struct sr_if* iface; /* 0 while the interface is not known */
+    struct in_addr gw;
+};
+
 
 int sr_load_rt(struct sr_instance*,const char*);
-void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
+int sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+int sr_del_rt_entry(struct sr_instance*, struct in_addr, struct in_addr);
+void sr_reload_rt(struct sr_instance* sr);
+void sr_rt_command(struct sr_instance* sr);
+int sr_run_rt_commands(struct sr_instance* sr, const char* filename);
+void sr_rt_periodic(struct sr_instance* sr);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
-void sr_longest_prefix_iface(struct sr_instance* sr, uint32_t ip, char* iface);
+void sr_update_fib(struct sr_instance* sr);
+const struct sr_nexthop* sr_lookup_nexthop(struct sr_instance* sr, uint32_t ip);
+uint32_t sr_nexthop_ip(const struct sr_nexthop* nh, uint32_t ip);
 
 
 #endif  /* --  sr_RT_H -- */
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_slab.h"
+
+#define SR_SLAB_ALIGN 16
+
+/* Free objects and chunks are chained through their first word. */
+#define SR_SLAB_NEXT(obj) (*(void **)(obj))
+
+/* Hands a dying thread's cached objects back to the shared list. */
+static void sr_slab_cache_release(void *arg) {
+  struct sr_slab_cache *c = (struct sr_slab_cache *) arg, **pp;
+  struct sr_slab *s = c->slab;
+
+  pthread_mutex_lock(&(s->lock));
+  while (c->free) {
+    void *obj = c->free;
+    c->free = SR_SLAB_NEXT(obj);
+    SR_SLAB_NEXT(obj) = s->free;
+    s->free = obj;
+  }
+  for (pp = &(s->caches); *pp; pp = &((*pp)->next)) {
+    if (*pp == c) {
+      *pp = c->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(s->lock));
+  free(c);
+}
+
+int sr_slab_init(struct sr_slab *s, size_t size, uint64_t limit) {
+  if (size < sizeof(void *)) {
+    size = sizeof(void *);
+  }
+  s->size = (size + SR_SLAB_ALIGN - 1) & ~(size_t)(SR_SLAB_ALIGN - 1);
+  s->limit = limit;
+  s->created = s->in_use = s->peak = 0;
+  s->allocs = s->failures = 0;
+  s->free = NULL;
+  s->chunks = NULL;
+  s->caches = NULL;
+  if (pthread_key_create(&(s->key), sr_slab_cache_release) != 0) {
+    return -1;
+  }
+  return pthread_mutex_init(&(s->lock), NULL);
+}
+
+void sr_slab_destroy(struct sr_slab *s) {
+  struct sr_slab_cache *c, *cnext;
+  void *chunk, *next;
+
+  pthread_key_delete(s->key);
+  for (c = s->caches; c; c = cnext) {
+    cnext = c->next;
+    free(c);
+  }
+  for (chunk = s->chunks; chunk; chunk = next) {
+    next = SR_SLAB_NEXT(chunk);
+    free(chunk);
+  }
+  s->caches = NULL;
+  s->chunks = NULL;
+  s->free = NULL;
+  pthread_mutex_destroy(&(s->lock));
+}
+
+/* This thread's cache, created on first use. */
+static struct sr_slab_cache *sr_slab_cache(struct sr_slab *s) {
+  struct sr_slab_cache *c = pthread_getspecific(s->key);
+
+  if (c == NULL) {
+    c = (struct sr_slab_cache *) calloc(1, sizeof(struct sr_slab_cache));
+    if (c == NULL) {
+      return NULL;
+    }
+    c->slab = s;
+    pthread_mutex_lock(&(s->lock));
+    c->next = s->caches;
+    s->caches = c;
+    pthread_mutex_unlock(&(s->lock));
+    pthread_setspecific(s->key, c);
+  }
+  return c;
+}
+
+/* Carves a new chunk onto the shared list, no more than the cap allows.
+   Caller holds the lock. */
+static void sr_slab_grow(struct sr_slab *s) {
+  uint64_t n = SR_SLAB_CHUNK, i;
+  char *chunk;
+
+  if (s->limit && s->limit - s->created < n) {
+    n = s->limit - s->created;
+  }
+  if (n == 0) {
+    return;
+  }
+  chunk = (char *) malloc(SR_SLAB_ALIGN + n * s->size);
+  if (chunk == NULL) {
+    return;
+  }
+  SR_SLAB_NEXT(chunk) = s->chunks;
+  s->chunks = chunk;
+  for (i = 0; i < n; i++) {
+    void *obj = chunk + SR_SLAB_ALIGN + i * s->size;
+    SR_SLAB_NEXT(obj) = s->free;
+    s->free = obj;
+  }
+  s->created += n;
+}
+
+/* Moves up to a batch from the shared list into c. */
+static void sr_slab_refill(struct sr_slab *s, struct sr_slab_cache *c) {
+  int n;
+
+  pthread_mutex_lock(&(s->lock));
+  if (s->free == NULL) {
+    sr_slab_grow(s);
+  }
+  for (n = 0; n < SR_SLAB_BATCH && s->free; n++) {
+    void *obj = s->free;
+    s->free = SR_SLAB_NEXT(obj);
+    SR_SLAB_NEXT(obj) = c->free;
+    c->free = obj;
+    c->count++;
+  }
+  pthread_mutex_unlock(&(s->lock));
+}
+
+/* Moves a batch from c back to the shared list. */
+static void sr_slab_trim(struct sr_slab *s, struct sr_slab_cache *c) {
+  int n;
+
+  pthread_mutex_lock(&(s->lock));
+  for (n = 0; n < SR_SLAB_BATCH && c->free; n++) {
+    void *obj = c->free;
+    c->free = SR_SLAB_NEXT(obj);
+    c->count--;
+    SR_SLAB_NEXT(obj) = s->free;
+    s->free = obj;
+  }
+  pthread_mutex_unlock(&(s->lock));
+}
+
+void *sr_slab_alloc(struct sr_slab *s) {
+  struct sr_slab_cache *c = sr_slab_cache(s);
+  uint64_t in_use, peak;
+  void *obj;
+
+  if (c && c->free == NULL) {
+    sr_slab_refill(s, c);
+  }
+  if (c == NULL || c->free == NULL) {
+    __atomic_add_fetch(&(s->failures), 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  obj = c->free;
+  c->free = SR_SLAB_NEXT(obj);
+  c->count--;
+
+  __atomic_add_fetch(&(s->allocs), 1, __ATOMIC_RELAXED);
+  in_use = __atomic_add_fetch(&(s->in_use), 1, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&(s->peak), __ATOMIC_RELAXED);
+  while (in_use > peak &&
+         !__atomic_compare_exchange_n(&(s->peak), &peak, in_use, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return obj;
+}
+
+void sr_slab_free(struct sr_slab *s, void *obj) {
+  struct sr_slab_cache *c = sr_slab_cache(s);
+
+  __atomic_sub_fetch(&(s->in_use), 1, __ATOMIC_RELAXED);
+  if (c == NULL) {
+    /* no cache for this thread; go straight to the shared list */
+    pthread_mutex_lock(&(s->lock));
+    SR_SLAB_NEXT(obj) = s->free;
+    s->free = obj;
+    pthread_mutex_unlock(&(s->lock));
+    return;
+  }
+  SR_SLAB_NEXT(obj) = c->free;
+  c->free = obj;
+  if (++c->count > SR_SLAB_CACHE_MAX) {
+    sr_slab_trim(s, c);
+  }
+}
+
+void sr_slab_stats(struct sr_slab *s, struct sr_slab_stats *stats) {
+  pthread_mutex_lock(&(s->lock));
+  stats->limit = s->limit;
+  stats->created = s->created;
+  pthread_mutex_unlock(&(s->lock));
+  stats->in_use = __atomic_load_n(&(s->in_use), __ATOMIC_RELAXED);
+  stats->peak = __atomic_load_n(&(s->peak), __ATOMIC_RELAXED);
+  stats->allocs = __atomic_load_n(&(s->allocs), __ATOMIC_RELAXED);
+  stats->failures = __atomic_load_n(&(s->failures), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,78 @@
+/* Fixed-size object pool for the NAT's per-flow records.
+
+   Objects are carved out of large chunks obtained from malloc and are never
+   handed back to it until the pool is destroyed, so memory per flow is one
+   object plus nothing, and a busy NAT does not fragment the heap.
+
+   Each thread keeps a small cache of free objects and allocates from and
+   frees to it without any locking. Only when its cache runs dry (or grows
+   past SR_SLAB_CACHE_MAX) does a thread touch the shared free list, moving
+   a batch of objects at a time under the pool lock.
+
+   The pool can be capped: once limit objects exist, allocation fails until
+   one is freed. Objects parked in another thread's cache count towards the
+   cap, so up to SR_SLAB_CACHE_MAX objects per thread may be unusable by the
+   others at any time. */
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define SR_SLAB_CHUNK     256   /* objects carved per malloc */
+#define SR_SLAB_BATCH     32    /* objects moved between cache and shared list */
+#define SR_SLAB_CACHE_MAX 64    /* a thread cache above this is trimmed */
+
+struct sr_slab;
+
+/* One per thread that has used the pool. */
+struct sr_slab_cache {
+  struct sr_slab *slab;
+  void *free;                   /* objects linked through their first word */
+  uint32_t count;
+  struct sr_slab_cache *next;
+};
+
+struct sr_slab_stats {
+  uint64_t limit;               /* 0: no cap */
+  uint64_t created;             /* objects carved from chunks */
+  uint64_t in_use;              /* handed out and not yet freed */
+  uint64_t peak;                /* highest in_use seen */
+  uint64_t allocs;              /* successful allocations */
+  uint64_t failures;            /* allocations refused by the cap or malloc */
+};
+
+struct sr_slab {
+  size_t size;                  /* object size, rounded up for alignment */
+  uint64_t limit;
+  uint64_t created;
+  uint64_t in_use;
+  uint64_t peak;
+  uint64_t allocs;
+  uint64_t failures;
+  void *free;                   /* shared free list */
+  void *chunks;                 /* every chunk, linked through its first word */
+  struct sr_slab_cache *caches; /* every thread cache */
+  pthread_key_t key;            /* this thread's cache */
+  pthread_mutex_t lock;         /* everything but the thread caches */
+};
+
+/* Sets up a pool of size-byte objects, at most limit of them (0 for no
+   cap). Returns 0 on success. */
+int sr_slab_init(struct sr_slab *s, size_t size, uint64_t limit);
+
+/* Releases every chunk. Objects still handed out become invalid. */
+void sr_slab_destroy(struct sr_slab *s);
+
+/* Returns an uninitialized object, or NULL if the pool is at its cap or out
+   of memory. */
+void *sr_slab_alloc(struct sr_slab *s);
+
+/* Gives obj back to the pool. obj must have come from sr_slab_alloc(s). */
+void sr_slab_free(struct sr_slab *s, void *obj);
+
+void sr_slab_stats(struct sr_slab *s, struct sr_slab_stats *stats);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_synhold.h"
+
+static uint32_t sr_synhold_remote_hash(uint32_t ip_remote, uint16_t aux_remote) {
+  return sr_hash_mix32(ip_remote ^ sr_hash_mix32(aux_remote));
+}
+
+static uint32_t sr_synhold_hash(const void *entry) {
+  const struct sr_synhold_entry *e = entry;
+  return sr_synhold_remote_hash(e->ip_remote, e->aux_remote);
+}
+
+static int sr_synhold_match_remote(const void *entry, const void *key) {
+  const struct sr_synhold_entry *e = entry, *k = key;
+  return e->ip_remote == k->ip_remote && e->aux_remote == k->aux_remote;
+}
+
+static int sr_synhold_match(const void *entry, const void *key) {
+  const struct sr_synhold_entry *e = entry, *k = key;
+  return sr_synhold_match_remote(entry, key) &&
+    e->ip_ext == k->ip_ext && e->aux_ext == k->aux_ext;
+}
+
+int sr_synhold_init(struct sr_synhold *sh, uint32_t size) {
+  uint32_t i;
+
+  memset(sh, 0, sizeof(*sh));
+  if (size == 0) {
+    return -1;
+  }
+  sh->pool = (struct sr_synhold_entry *) calloc(size, sizeof(struct sr_synhold_entry));
+  if (sh->pool == NULL) {
+    return -1;
+  }
+  if (sr_hash_init(&(sh->index), size, sr_synhold_hash, NULL) != 0) {
+    free(sh->pool);
+    sh->pool = NULL;
+    return -1;
+  }
+  sh->size = size;
+  for (i = 0; i < size; i++) {
+    sh->pool[i].next = sh->free;
+    sh->free = &(sh->pool[i]);
+  }
+  return 0;
+}
+
+void sr_synhold_destroy(struct sr_synhold *sh) {
+  sr_hash_destroy(&(sh->index));
+  free(sh->pool);
+  sh->pool = NULL;
+  sh->free = sh->head = sh->tail = NULL;
+  sh->count = 0;
+}
+
+/* Unlinks e from the index and the arrival list and gives it back. */
+static void sr_synhold_release(struct sr_synhold *sh, struct sr_synhold_entry *e) {
+  sr_hash_remove(&(sh->index), e);
+  if (e->prev) {
+    e->prev->next = e->next;
+  }
+  else {
+    sh->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  }
+  else {
+    sh->tail = e->prev;
+  }
+  e->prev = NULL;
+  e->next = sh->free;
+  sh->free = e;
+  sh->count--;
+}
+
+int sr_synhold_add(struct sr_synhold *sh, uint32_t ip_remote, uint16_t aux_remote,
+  uint32_t ip_ext, uint16_t aux_ext, const uint8_t *packet, unsigned int len,
+  time_t expires) {
+  struct sr_synhold_entry key, *e;
+
+  key.ip_remote = ip_remote;
+  key.aux_remote = aux_remote;
+  key.ip_ext = ip_ext;
+  key.aux_ext = aux_ext;
+  if (sr_hash_find(&(sh->index), sr_synhold_hash(&key), &key, sr_synhold_match)) {
+    sh->duplicates++;
+    return 1;
+  }
+  if ((e = sh->free) == NULL) {
+    sh->dropped++;
+    return 0;
+  }
+
+  e->ip_remote = ip_remote;
+  e->aux_remote = aux_remote;
+  e->ip_ext = ip_ext;
+  e->aux_ext = aux_ext;
+  e->expires = expires;
+  e->len = len < SR_SYNHOLD_PKT ? len : SR_SYNHOLD_PKT;
+  memcpy(e->packet, packet, e->len);
+  if (sr_hash_insert(&(sh->index), e) != 0) {
+    sh->dropped++;
+    return 0;
+  }
+  sh->free = e->next;
+  e->next = NULL;
+  e->prev = sh->tail;
+  if (sh->tail) {
+    sh->tail->next = e;
+  }
+  else {
+    sh->head = e;
+  }
+  sh->tail = e;
+  sh->count++;
+  sh->held++;
+  return 1;
+}
+
+int sr_synhold_cancel(struct sr_synhold *sh, uint32_t ip_remote, uint16_t aux_remote) {
+  struct sr_synhold_entry key, *e;
+  uint32_t hash = sr_synhold_remote_hash(ip_remote, aux_remote);
+  int n = 0;
+
+  key.ip_remote = ip_remote;
+  key.aux_remote = aux_remote;
+  while ((e = sr_hash_find(&(sh->index), hash, &key, sr_synhold_match_remote))) {
+    sr_synhold_release(sh, e);
+    sh->cancelled++;
+    n++;
+  }
+  return n;
+}
+
+unsigned int sr_synhold_expire(struct sr_synhold *sh, time_t now, uint8_t *buf) {
+  struct sr_synhold_entry *e = sh->head;
+  unsigned int len;
+
+  if (e == NULL || e->expires > now) {
+    return 0;
+  }
+  len = e->len;
+  memcpy(buf, e->packet, len);
+  sr_synhold_release(sh, e);
+  sh->expired++;
+  return len;
+}
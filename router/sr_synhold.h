@@ -0,0 +1,77 @@
+/* Holding area for unsolicited inbound TCP SYNs.
+
+   A SYN sent to an external address and port that has no mapping is not
+   refused at once: an internal host may be about to open the same connection
+   outward (simultaneous open, as used for hole punching). The SYN is kept
+   for a few seconds; if a SYN from inside to the same remote endpoint shows
+   up it is dropped quietly, otherwise the caller answers it with an ICMP
+   port unreachable once it expires.
+
+   Entries come from a pool sized at init, and each keeps a copy of just the
+   head of the packet, which is all the ICMP error quotes. A flood of SYNs
+   therefore costs a fixed amount of memory: once the pool is used up further
+   SYNs are dropped and counted. Entries are indexed on the remote endpoint
+   that sent them and kept in arrival order, which, as they all get the same
+   timeout, is also the order they expire in.
+
+   The holding area does no locking of its own. */
+
+#ifndef SR_SYNHOLD_H
+#define SR_SYNHOLD_H
+
+#include <inttypes.h>
+#include <time.h>
+#include "sr_hash.h"
+
+#define SR_SYNHOLD_PKT 128  /* bytes of each SYN kept, from the Ethernet header */
+
+struct sr_synhold_entry {
+  uint32_t ip_remote;   /* sender, network byte order */
+  uint32_t ip_ext;      /* external address it was sent to */
+  uint16_t aux_remote;
+  uint16_t aux_ext;     /* and port */
+  time_t expires;
+  unsigned int len;     /* bytes of packet kept */
+  uint8_t packet[SR_SYNHOLD_PKT];
+  struct sr_synhold_entry *prev; /* arrival order; free entries chain on next */
+  struct sr_synhold_entry *next;
+};
+
+struct sr_synhold {
+  struct sr_synhold_entry *pool;
+  uint32_t size;
+  uint32_t count;       /* entries held */
+  struct sr_synhold_entry *free;
+  struct sr_synhold_entry *head; /* oldest */
+  struct sr_synhold_entry *tail;
+  struct sr_hash index; /* keyed on (ip_remote, aux_remote) */
+
+  /* counters */
+  uint64_t held;        /* SYNs taken in */
+  uint64_t duplicates;  /* retransmissions of a SYN already held */
+  uint64_t dropped;     /* SYNs refused because the pool was used up */
+  uint64_t cancelled;   /* answered by a SYN from inside */
+  uint64_t expired;
+};
+
+/* Sets up a pool of size entries. Returns 0 on success. */
+int sr_synhold_init(struct sr_synhold *sh, uint32_t size);
+void sr_synhold_destroy(struct sr_synhold *sh);
+
+/* Holds the SYN from ip_remote:aux_remote to ip_ext:aux_ext (all network
+   byte order) until expires. Only the first SR_SYNHOLD_PKT bytes of packet
+   are copied. A SYN already held for the same four-tuple keeps its original
+   deadline. Returns 0 if the SYN had to be dropped. */
+int sr_synhold_add(struct sr_synhold *sh, uint32_t ip_remote, uint16_t aux_remote,
+  uint32_t ip_ext, uint16_t aux_ext, const uint8_t *packet, unsigned int len,
+  time_t expires);
+
+/* Drops every SYN held from ip_remote:aux_remote. Returns how many. */
+int sr_synhold_cancel(struct sr_synhold *sh, uint32_t ip_remote, uint16_t aux_remote);
+
+/* Takes the oldest SYN off if it is due by now, copying its packet into buf
+   (SR_SYNHOLD_PKT bytes). Returns the packet's length, or 0 if nothing is
+   due. */
+unsigned int sr_synhold_expire(struct sr_synhold *sh, time_t now, uint8_t *buf);
+
+#endif
@@ -0,0 +1,130 @@
+#include <string.h>
+#include "sr_timerwheel.h"
+
+#define SR_WHEEL_MASK (SR_WHEEL_SLOTS - 1)
+#define SR_WHEEL_SPAN(level) ((time_t)1 << (SR_WHEEL_BITS * ((level) + 1)))
+
+void sr_timerwheel_init(struct sr_timerwheel *w, time_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void sr_timer_init(struct sr_timer *t, int kind, void *data) {
+  t->expires = 0;
+  t->data = data;
+  t->kind = kind;
+  t->pending = 0;
+  t->prev = t->next = NULL;
+}
+
+/* Picks the level whose span covers the deadline and links t at the head of
+   the matching slot. */
+static void sr_timerwheel_link(struct sr_timerwheel *w, struct sr_timer *t) {
+  struct sr_timer **slot;
+  time_t delta = t->expires - w->now;
+  int level = 0;
+
+  if (delta <= 0) {
+    t->expires = w->now + 1;
+    delta = 1;
+  }
+  while (level < SR_WHEEL_LEVELS - 1 && delta >= SR_WHEEL_SPAN(level)) {
+    level++;
+  }
+  if (delta >= SR_WHEEL_SPAN(level)) {
+    t->expires = w->now + SR_WHEEL_SPAN(level) - 1;
+  }
+
+  slot = &(w->slots[level][(t->expires >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK]);
+  t->prev = NULL;
+  t->next = *slot;
+  if (*slot) {
+    (*slot)->prev = t;
+  }
+  *slot = t;
+}
+
+static void sr_timerwheel_unlink(struct sr_timerwheel *w, struct sr_timer *t) {
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  if (t->prev) {
+    t->prev->next = t->next;
+  }
+  else {
+    /* head of its slot; find which one from the deadline */
+    int level;
+    for (level = 0; level < SR_WHEEL_LEVELS; level++) {
+      struct sr_timer **slot =
+        &(w->slots[level][(t->expires >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK]);
+      if (*slot == t) {
+        *slot = t->next;
+        break;
+      }
+    }
+  }
+  t->prev = t->next = NULL;
+}
+
+void sr_timer_schedule(struct sr_timerwheel *w, struct sr_timer *t, time_t expires) {
+  if (t->pending) {
+    sr_timerwheel_unlink(w, t);
+  }
+  else {
+    w->count++;
+  }
+  t->expires = expires;
+  t->pending = 1;
+  sr_timerwheel_link(w, t);
+}
+
+void sr_timer_cancel(struct sr_timerwheel *w, struct sr_timer *t) {
+  if (!t->pending) {
+    return;
+  }
+  sr_timerwheel_unlink(w, t);
+  t->pending = 0;
+  w->count--;
+}
+
+/* Re-files every timer in a coarse slot now that the wheel is close enough
+   for a finer level to hold it. */
+static void sr_timerwheel_cascade(struct sr_timerwheel *w, int level) {
+  struct sr_timer **slot =
+    &(w->slots[level][(w->now >> (SR_WHEEL_BITS * level)) & SR_WHEEL_MASK]);
+  struct sr_timer *t = *slot, *next;
+
+  *slot = NULL;
+  for (; t; t = next) {
+    next = t->next;
+    sr_timerwheel_link(w, t);
+  }
+}
+
+struct sr_timer *sr_timerwheel_advance(struct sr_timerwheel *w, time_t now) {
+  struct sr_timer *expired = NULL, *t, *next;
+
+  while (w->now < now) {
+    struct sr_timer **slot;
+    w->now++;
+
+    if ((w->now & (SR_WHEEL_SPAN(1) - 1)) == 0) {
+      sr_timerwheel_cascade(w, 2);
+    }
+    if ((w->now & (SR_WHEEL_SPAN(0) - 1)) == 0) {
+      sr_timerwheel_cascade(w, 1);
+    }
+
+    slot = &(w->slots[0][w->now & SR_WHEEL_MASK]);
+    for (t = *slot; t; t = next) {
+      next = t->next;
+      t->pending = 0;
+      t->prev = NULL;
+      t->next = expired;
+      expired = t;
+      w->count--;
+    }
+    *slot = NULL;
+  }
+  return expired;
+}
@@ -0,0 +1,59 @@
+/* Hierarchical timing wheel with one-second resolution.
+
+   Timers are intrusive: the owner embeds a struct sr_timer and points
+   timer->data back at itself, using timer->kind to tell its timers apart.
+   Scheduling, rescheduling and cancelling are O(1). Advancing the wheel by
+   one second only touches the timers that fall due in that second, plus
+   (once every 256 seconds) the timers that cascade down from a coarser
+   level.
+
+   Level 0 has one slot per second for the next 256 seconds, level 1 one slot
+   per 256 seconds for the next 65536 seconds and level 2 one slot per 65536
+   seconds beyond that. Deadlines further out than level 2 can cover are
+   clamped.
+
+   The wheel does no locking of its own. */
+
+#ifndef SR_TIMERWHEEL_H
+#define SR_TIMERWHEEL_H
+
+#include <time.h>
+#include <inttypes.h>
+
+#define SR_WHEEL_BITS   8
+#define SR_WHEEL_SLOTS  (1 << SR_WHEEL_BITS)
+#define SR_WHEEL_LEVELS 3
+
+struct sr_timer {
+  time_t expires;
+  void *data;               /* owner of the timer */
+  int kind;                 /* owner-defined tag, e.g. what data points at */
+  int pending;              /* non-zero while linked into a wheel */
+  struct sr_timer *prev;
+  struct sr_timer *next;
+};
+
+struct sr_timerwheel {
+  time_t now;               /* last second processed */
+  uint32_t count;           /* pending timers */
+  struct sr_timer *slots[SR_WHEEL_LEVELS][SR_WHEEL_SLOTS];
+};
+
+void sr_timerwheel_init(struct sr_timerwheel *w, time_t now);
+
+/* Prepares a timer for use by its owner. */
+void sr_timer_init(struct sr_timer *t, int kind, void *data);
+
+/* Arms t to fire at expires, moving it if it is already pending. A deadline
+   that has already passed fires on the next tick. */
+void sr_timer_schedule(struct sr_timerwheel *w, struct sr_timer *t, time_t expires);
+
+/* Disarms t if it is pending. */
+void sr_timer_cancel(struct sr_timerwheel *w, struct sr_timer *t);
+
+/* Moves the wheel forward to now and returns every timer that fell due on
+   the way, unlinked and chained through ->next. The owner may reschedule or
+   free them. */
+struct sr_timer *sr_timerwheel_advance(struct sr_timerwheel *w, time_t now);
+
+#endif
@@ -19,6 +19,42 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* HC' = ~(~HC + ~m + m'), eqn. 3 of RFC 1624. One's complement addition does
+   not care about byte order, so the fields can be used as they sit in the
+   packet. */
+uint16_t cksum_delta16(uint16_t delta, uint16_t old_val, uint16_t new_val) {
+  uint32_t s = delta + (uint16_t)~old_val + new_val;
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return s;
+}
+
+uint16_t cksum_delta32(uint16_t delta, uint32_t old_val, uint32_t new_val) {
+  delta = cksum_delta16(delta, old_val >> 16, new_val >> 16);
+  return cksum_delta16(delta, old_val & 0xffff, new_val & 0xffff);
+}
+
+uint16_t cksum_apply(uint16_t sum, uint16_t delta) {
+  uint32_t s = (uint16_t)~sum + delta;
+  s = (s & 0xffff) + (s >> 16);
+  return ~s;
+}
+
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old_val, uint16_t new_val) {
+  return cksum_apply(sum, cksum_delta16(0, old_val, new_val));
+}
+
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old_val, uint32_t new_val) {
+  return cksum_apply(sum, cksum_delta32(0, old_val, new_val));
+}
+
+void ip_decrement_ttl(struct sr_ip_hdr *iphdr) {
+  /* the TTL shares a 16-bit checksum word with the protocol */
+  uint16_t old_word = htons((iphdr->ip_ttl << 8) | iphdr->ip_p);
+  iphdr->ip_ttl--;
+  iphdr->ip_sum = cksum_adjust16(iphdr->ip_sum, old_word,
+                                 htons((iphdr->ip_ttl << 8) | iphdr->ip_p));
+}
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
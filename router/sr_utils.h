@@ -30,6 +30,23 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* Incremental checksum update (RFC 1624): returns sum patched for one field
+   changing from old_val to new_val. Every value is as stored in the packet
+   (network byte order). */
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old_val, uint32_t new_val);
+
+/* The same, split in two so that several field changes can be folded into
+   one precomputed delta: start from 0, accumulate each change, and apply
+   the total to a checksum with cksum_apply(). */
+uint16_t cksum_delta16(uint16_t delta, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_delta32(uint16_t delta, uint32_t old_val, uint32_t new_val);
+uint16_t cksum_apply(uint16_t sum, uint16_t delta);
+
+/* Decrements the TTL and patches the header checksum to match. */
+struct sr_ip_hdr;
+void ip_decrement_ttl(struct sr_ip_hdr *iphdr);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
@@ -39,6 +39,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
+#include "sr_rt.h"
 #include "sr_protocol.h"
 #include "sr_nat.h"
 
@@ -227,7 +228,10 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
         } /* -- switch -- */
     } /* -- for -- */
     if(sr->nat) {
-        sr->nat->ip_ext = sr_get_interface(sr,"eth2")->ip;
+        sr_nat_add_address(sr->nat, sr_get_interface(sr,"eth2")->ip);
+        /* the pool is complete only now */
+        if(sr_nat_restore_checkpoint(sr->nat) != 0)
+        { fprintf(stderr,"NAT state only partly restored\n"); }
     }
     printf("Router interfaces:\n");
     sr_print_if_list(sr);
@@ -472,6 +476,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
         case VNSHWINFO:
             sr_handle_hwinfo(sr,(c_hwinfo*)buf);
+            /* the routes can only be bound to interfaces now */
+            sr_update_fib(sr);
             if(sr_verify_routing_table(sr) != 0)
             {
                 fprintf(stderr,"Routing table not consistent with hardware\n");
@@ -520,23 +526,16 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 static int
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+                                const struct sr_if* iface /* borrowed */ )
 {
     struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(sr);
     assert(buf);
-    assert(name);
+    assert(iface);
 
     ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
-
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
 
     if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
         fprintf( stderr, "** Error, source address does not match interface\n");
@@ -565,7 +564,35 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          uint8_t* buf /* borrowed */ ,
                          unsigned int len,
-                         const char* iface /* borrowed */)
+                         const char* name /* borrowed */)
+{
+    struct sr_if* iface = 0;
+
+    /* REQUIRES */
+    assert(name);
+
+    iface = sr_get_interface(sr, name);
+    if ( iface == 0 ){
+        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+    return sr_send_packet_if(sr, buf, len, iface);
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet_if(..)
+ * Scope: Global
+ *
+ * sr_send_packet() to an interface already in hand, e.g. from a route
+ * lookup, without finding it by name again.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet_if(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const struct sr_if* iface /* borrowed */)
 {
     c_packet_header *sr_pkt;
     unsigned int total_len =  len + (sizeof(c_packet_header));
@@ -587,7 +614,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     assert(sr_pkt);
     sr_pkt->mLen  = htonl(total_len);
     sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
+    strncpy(sr_pkt->mInterfaceName,iface->name,16);
     memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
             buf,len);
 
@@ -609,7 +636,7 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     free(sr_pkt);
 
     return 0;
-} /* -- sr_send_packet -- */
+} /* -- sr_send_packet_if -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -0,0 +1,28 @@
+/* Checks for the module tests in this directory.
+
+   Each test is a small program that exercises one module through its
+   public API. A failed CHECK is reported with its file and line and the
+   program carries on, so one run shows every failure; main() ends with
+   SR_TEST_DONE, which makes the exit status non-zero if any check
+   failed. */
+
+#ifndef SR_TEST_H
+#define SR_TEST_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+static int sr_test_failures;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      sr_test_failures++; \
+    } \
+  } while (0)
+
+#define SR_TEST_DONE(name) \
+  (printf("%-16s %s\n", name, sr_test_failures ? "FAILED" : "ok"), sr_test_failures != 0)
+
+#endif
@@ -0,0 +1,104 @@
+/* RFC 1624 helpers in sr_utils: incremental updates agree with a full
+   recomputation. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_test.h"
+
+#define TRIALS 20000
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t rnd(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+/* cksum() of a header that includes its own correct checksum */
+#define SR_CKSUM_OK 0xffff
+
+/* Fresh checksum of iphdr, from scratch. */
+static uint16_t full(sr_ip_hdr_t *iphdr) {
+  uint16_t saved = iphdr->ip_sum, sum;
+
+  iphdr->ip_sum = 0;
+  sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
+  iphdr->ip_sum = saved;
+  return sum;
+}
+
+/* 0x0000 and 0xffff are the same one's complement value */
+static int same(uint16_t a, uint16_t b) {
+  return a == b || ((a == 0 || a == 0xffff) && (b == 0 || b == 0xffff));
+}
+
+int main(void) {
+  sr_ip_hdr_t iphdr;
+  uint32_t old_src, old_dst, new_src, new_dst;
+  uint16_t old_id, new_id, delta, sum_chained;
+  uint8_t *p = (uint8_t *) &iphdr;
+  int t, i, bad_adjust = 0, bad_delta = 0, bad_ttl = 0;
+
+  for (t = 0; t < TRIALS; t++) {
+    for (i = 0; i < (int) sizeof(iphdr); i++) {
+      p[i] = (uint8_t) rnd();
+    }
+    /* now and then the extremes, where end-around carries happen */
+    if (t % 7 == 0) {
+      iphdr.ip_src = t % 2 ? 0xffffffffu : 0;
+    }
+    iphdr.ip_ttl = (uint8_t)(1 + rnd() % 255);
+    iphdr.ip_sum = full(&iphdr);
+    CHECK(cksum(&iphdr, sizeof(iphdr)) == SR_CKSUM_OK);
+
+    old_src = iphdr.ip_src;
+    old_dst = iphdr.ip_dst;
+    old_id = iphdr.ip_id;
+    new_src = t % 11 == 0 ? ~old_src : rnd();
+    new_dst = rnd();
+    new_id = (uint16_t) rnd();
+
+    /* one adjust per field */
+    iphdr.ip_src = new_src;
+    iphdr.ip_sum = cksum_adjust32(iphdr.ip_sum, old_src, new_src);
+    iphdr.ip_dst = new_dst;
+    iphdr.ip_sum = cksum_adjust32(iphdr.ip_sum, old_dst, new_dst);
+    iphdr.ip_id = new_id;
+    iphdr.ip_sum = cksum_adjust16(iphdr.ip_sum, old_id, new_id);
+    sum_chained = iphdr.ip_sum;
+    bad_adjust += cksum(&iphdr, sizeof(iphdr)) != SR_CKSUM_OK ||
+      !same(sum_chained, full(&iphdr));
+
+    /* the same changes folded into one delta, as the flow cache does */
+    iphdr.ip_src = old_src;
+    iphdr.ip_dst = old_dst;
+    iphdr.ip_id = old_id;
+    iphdr.ip_sum = full(&iphdr);
+    delta = cksum_delta32(0, old_src, new_src);
+    delta = cksum_delta32(delta, old_dst, new_dst);
+    delta = cksum_delta16(delta, old_id, new_id);
+    iphdr.ip_src = new_src;
+    iphdr.ip_dst = new_dst;
+    iphdr.ip_id = new_id;
+    iphdr.ip_sum = cksum_apply(iphdr.ip_sum, delta);
+    bad_delta += cksum(&iphdr, sizeof(iphdr)) != SR_CKSUM_OK ||
+      !same(iphdr.ip_sum, sum_chained);
+
+    ip_decrement_ttl(&iphdr);
+    bad_ttl += cksum(&iphdr, sizeof(iphdr)) != SR_CKSUM_OK;
+  }
+  CHECK(bad_adjust == 0);
+  CHECK(bad_delta == 0);
+  CHECK(bad_ttl == 0);
+
+  /* changing a field to itself leaves the checksum alone */
+  CHECK(cksum_adjust32(0x1234, 0xdeadbeef, 0xdeadbeef) == 0x1234);
+  CHECK(cksum_apply(0x1234, cksum_delta16(0, 0xabcd, 0xabcd)) == 0x1234);
+
+  return SR_TEST_DONE("sr_cksum");
+}
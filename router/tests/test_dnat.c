@@ -0,0 +1,90 @@
+/* sr_dnat: rule parsing, ranges, and rejection of overlapping or
+   malformed rules. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sr_dnat.h"
+#include "sr_test.h"
+
+static char path[] = "/tmp/sr_test_dnatXXXXXX";
+
+/* Writes text to the rules file and loads it. */
+static struct sr_dnat *load(const char *text) {
+  FILE *fp = fopen(path, "w");
+
+  if (fp == NULL) {
+    return NULL;
+  }
+  fputs(text, fp);
+  fclose(fp);
+  return sr_dnat_load(path);
+}
+
+/* Non-zero if text is refused. */
+static int refused(const char *text) {
+  struct sr_dnat *d = load(text);
+
+  sr_dnat_free(d);
+  return d == NULL;
+}
+
+int main(void) {
+  struct sr_dnat *d;
+  const struct sr_dnat_rule *r;
+  uint32_t any = inet_addr("198.51.100.1"), pub = inet_addr("203.0.113.5");
+  int fd;
+
+  if ((fd = mkstemp(path)) < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  d = load("# forwarded services\n"
+           "\n"
+           "tcp  80                      10.0.1.100:8080\n"
+           "tcp  203.0.113.5:6000-6009   10.0.1.101:6000   # ten ports\n");
+  CHECK(d != NULL);
+  if (d) {
+    CHECK(d->nrules == 11);
+    r = sr_dnat_find_ext(d, any, 80);
+    CHECK(r && r->ip_int == inet_addr("10.0.1.100") && r->aux_int == 8080);
+    CHECK(sr_dnat_find_ext(d, any, 81) == NULL);
+    r = sr_dnat_find_ext(d, pub, 6004);
+    CHECK(r && r->ip_int == inet_addr("10.0.1.101") && r->aux_int == 6004);
+    CHECK(sr_dnat_find_ext(d, any, 6004) == NULL);
+    CHECK(sr_dnat_find_ext(d, pub, 6010) == NULL);
+    r = sr_dnat_find_int(d, inet_addr("10.0.1.101"), 6009);
+    CHECK(r && r->aux_ext == 6009 && r->ip_ext == pub);
+    CHECK(sr_dnat_find_int(d, inet_addr("10.0.1.101"), 6010) == NULL);
+    sr_dnat_free(d);
+  }
+
+  /* one rule per external port, whatever the address */
+  CHECK(refused("tcp 100-110 10.0.0.1:100\ntcp 105 10.0.0.2:80\n"));
+  CHECK(refused("tcp 1.2.3.4:80 10.0.0.1:80\ntcp 5.6.7.8:80 10.0.0.2:80\n"));
+  CHECK(refused("tcp 80 10.0.0.1:22\ntcp 81 10.0.0.1:22\n"));
+  CHECK(refused("tcp 100-102 10.0.0.1:22\ntcp 90 10.0.0.1:23\n"));
+
+  /* malformed lines */
+  CHECK(refused("tcp 200-100 10.0.0.1:80\n"));
+  CHECK(refused("tcp 0 10.0.0.1:80\n"));
+  CHECK(refused("tcp 65536 10.0.0.1:80\n"));
+  CHECK(refused("tcp 100-110 10.0.0.1:65530\n"));
+  CHECK(refused("udp 53 10.0.0.1:53\n"));
+  CHECK(refused("tcp 80\n"));
+  CHECK(refused("tcp 80 10.0.0.1:80 extra\n"));
+  CHECK(refused("tcp 80 8080\n"));
+  CHECK(refused("tcp 80 10.0.0.300:80\n"));
+  CHECK(refused("tcp 0.0.0.0:80 10.0.0.1:80\n"));
+  CHECK(refused("tcp 80x 10.0.0.1:80\n"));
+
+  /* the last port a range may reach */
+  CHECK(!refused("tcp 65530-65535 10.0.0.1:65530\n"));
+
+  unlink(path);
+  CHECK(sr_dnat_load(path) == NULL);
+  return SR_TEST_DONE("sr_dnat");
+}
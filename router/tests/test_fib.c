@@ -0,0 +1,128 @@
+/* sr_fib: both engines against a linear longest-prefix scan of the same
+   random tables. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_fib.h"
+#include "sr_test.h"
+
+#define MAX_ROUTES 400
+#define LOOKUPS 4000
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t rnd(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static uint32_t prefix_mask(int len) {
+  return len ? 0xffffffffu << (32 - len) : 0;
+}
+
+/* The route a lookup of ip (host order) must pick, or NULL. */
+static struct sr_rt *scan(struct sr_rt *routes, uint32_t ip) {
+  struct sr_rt *rt, *best = NULL;
+
+  for (rt = routes; rt; rt = rt->next) {
+    if ((ip & ntohl(rt->mask.s_addr)) == ntohl(rt->dest.s_addr) &&
+        (best == NULL || ntohl(rt->mask.s_addr) > ntohl(best->mask.s_addr))) {
+      best = rt;
+    }
+  }
+  return best;
+}
+
+/* A table of n routes with distinct prefixes, mostly nested inside
+   10.0.0.0/8 so they overlap at every depth. */
+static int make_table(struct sr_rt *rt, int n) {
+  int i, j, len;
+  uint32_t dest;
+
+  for (i = 0; i < n; ) {
+    len = rnd() % 33;
+    dest = rnd();
+    if (rnd() % 4) {
+      dest = 0x0a000000u | (dest & 0x00ffffffu);
+      len = len < 8 ? 8 + len : len;
+    }
+    dest &= prefix_mask(len);
+    for (j = 0; j < i && !(ntohl(rt[j].dest.s_addr) == dest &&
+                           ntohl(rt[j].mask.s_addr) == prefix_mask(len)); j++) {
+    }
+    if (j < i) {
+      continue;
+    }
+    rt[i].dest.s_addr = htonl(dest);
+    rt[i].mask.s_addr = htonl(prefix_mask(len));
+    rt[i].gw.s_addr = rnd() % 3 ? htonl(0xc0a80000u | (rnd() % 16)) : 0;
+    strcpy(rt[i].interface, rnd() % 2 ? "eth1" : "eth2");
+    rt[i].next = i + 1 < n ? &rt[i + 1] : NULL;
+    i++;
+  }
+  return n;
+}
+
+static void check_engine(int engine, int tables, struct sr_if *ifaces) {
+  static struct sr_rt rt[MAX_ROUTES];
+  const struct sr_nexthop *nh;
+  struct sr_rt *want, *routes;
+  struct sr_fib *fib;
+  uint32_t ip;
+  int t, i, n, mismatches = 0;
+
+  for (t = 0; t < tables; t++) {
+    n = t == 0 ? 0 : 1 + rnd() % MAX_ROUTES;
+    routes = n ? rt : NULL;
+    make_table(rt, n);
+    fib = sr_fib_build(routes, ifaces, engine);
+    CHECK(fib != NULL);
+    if (fib == NULL) {
+      continue;
+    }
+    for (i = 0; i < LOOKUPS; i++) {
+      ip = rnd();
+      if (n && i % 2) {
+        /* inside or just past one of the routes */
+        want = &rt[rnd() % n];
+        ip = (ntohl(want->dest.s_addr) | (ip & ~ntohl(want->mask.s_addr))) + (i % 4 == 3);
+      }
+      want = scan(routes, ip);
+      nh = sr_fib_lookup(fib, htonl(ip));
+      if (want == NULL ? nh != NULL :
+          nh == NULL || nh->gw.s_addr != want->gw.s_addr ||
+          nh->iface == NULL || strcmp(nh->iface->name, want->interface) != 0) {
+        mismatches++;
+      }
+    }
+    sr_fib_free(fib);
+  }
+  CHECK(mismatches == 0);
+}
+
+int main(void) {
+  struct sr_if ifaces[2];
+  struct sr_rt route;
+  struct sr_fib *fib;
+
+  memset(ifaces, 0, sizeof(ifaces));
+  strcpy(ifaces[0].name, "eth1");
+  strcpy(ifaces[1].name, "eth2");
+  ifaces[0].next = &ifaces[1];
+
+  check_engine(SR_FIB_POPTRIE, 200, ifaces);
+  check_engine(SR_FIB_DIR24, 12, ifaces);
+
+  /* a route through an unknown interface still resolves, without one */
+  memset(&route, 0, sizeof(route));
+  strcpy(route.interface, "eth9");
+  fib = sr_fib_build(&route, ifaces, SR_FIB_POPTRIE);
+  CHECK(fib && sr_fib_lookup(fib, htonl(0x01020304)) &&
+        sr_fib_lookup(fib, htonl(0x01020304))->iface == NULL);
+  sr_fib_free(fib);
+
+  return SR_TEST_DONE("sr_fib");
+}
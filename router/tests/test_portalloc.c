@@ -0,0 +1,74 @@
+/* sr_portalloc: FIFO reuse, claims settled out of the ring, reservations. */
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include "sr_portalloc.h"
+#include "sr_test.h"
+
+int main(void) {
+  struct sr_portalloc pa;
+  int seen[8], i, port;
+
+  CHECK(sr_portalloc_init(&pa, 1000, 1007) == 0);
+  for (i = 0; i < 8; i++) {
+    seen[i] = 0;
+  }
+  for (i = 0; i < 8; i++) {
+    port = sr_portalloc_get(&pa);
+    CHECK(port >= 1000 && port <= 1007);
+    if (port >= 1000 && port <= 1007) {
+      CHECK(!seen[port - 1000]);
+      seen[port - 1000] = 1;
+      CHECK(sr_portalloc_inuse(&pa, (uint16_t) port));
+    }
+  }
+  CHECK(sr_portalloc_get(&pa) == -1);
+  CHECK(pa.exhausted == 1);
+
+  /* released ports come back oldest first; a second release is ignored */
+  sr_portalloc_put(&pa, 1003);
+  sr_portalloc_put(&pa, 1001);
+  sr_portalloc_put(&pa, 1003);
+  sr_portalloc_put(&pa, 999);
+  CHECK(!sr_portalloc_inuse(&pa, 1003));
+  CHECK(sr_portalloc_get(&pa) == 1003);
+  CHECK(sr_portalloc_get(&pa) == 1001);
+  CHECK(sr_portalloc_get(&pa) == -1);
+  sr_portalloc_destroy(&pa);
+
+  /* a claimed port stays out once the ring is settled */
+  CHECK(sr_portalloc_init(&pa, 2000, 2009) == 0);
+  CHECK(sr_portalloc_claim(&pa, 2005) == 0);
+  CHECK(sr_portalloc_claim(&pa, 2005) == -1);
+  CHECK(sr_portalloc_claim(&pa, 2010) == -1);
+  sr_portalloc_settle(&pa);
+  for (i = 0; i < 9; i++) {
+    port = sr_portalloc_get(&pa);
+    CHECK(port >= 2000 && port <= 2009 && port != 2005);
+  }
+  CHECK(sr_portalloc_get(&pa) == -1);
+  sr_portalloc_put(&pa, 2005);
+  CHECK(sr_portalloc_get(&pa) == 2005);
+  sr_portalloc_destroy(&pa);
+
+  /* reserved ports are not handed out, and an in-use port reserved later
+     stays out when released */
+  CHECK(sr_portalloc_init(&pa, 3000, 3003) == 0);
+  sr_portalloc_reserve(&pa, 3002);
+  CHECK(sr_portalloc_claim(&pa, 3002) == -1);
+  CHECK(sr_portalloc_get(&pa) == 3000);
+  CHECK(sr_portalloc_get(&pa) == 3001);
+  CHECK(sr_portalloc_get(&pa) == 3003);
+  CHECK(sr_portalloc_get(&pa) == -1);
+  sr_portalloc_reserve(&pa, 3000);
+  sr_portalloc_put(&pa, 3000);
+  CHECK(sr_portalloc_get(&pa) == -1);
+  sr_portalloc_unreserve(&pa, 3002);
+  sr_portalloc_unreserve(&pa, 3000);
+  CHECK(sr_portalloc_get(&pa) == 3002);
+  CHECK(sr_portalloc_get(&pa) == 3000);
+  CHECK(sr_portalloc_get(&pa) == -1);
+  sr_portalloc_destroy(&pa);
+
+  return SR_TEST_DONE("sr_portalloc");
+}
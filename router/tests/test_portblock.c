@@ -0,0 +1,110 @@
+/* sr_portblock: per-host blocks, release of empty blocks, the per-host
+   limit, claims and reservations. */
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include "sr_portblock.h"
+#include "sr_test.h"
+
+#define LO 1024
+
+static int assigned, released;
+
+static void on_block(void *arg, int is_assign, uint32_t ip, uint16_t lo, uint16_t hi) {
+  CHECK(hi - lo + 1 == SR_PORTBLOCK_SZ);
+  CHECK((lo - LO) % SR_PORTBLOCK_SZ == 0);
+  if (is_assign) {
+    assigned++;
+  }
+  else {
+    released++;
+  }
+}
+
+static int block_of(int port) {
+  return (port - LO) / SR_PORTBLOCK_SZ;
+}
+
+int main(void) {
+  struct sr_portblock pb;
+  int ports[2 * SR_PORTBLOCK_SZ], port, i, block;
+
+  /* three whole blocks and a tail that is left unused */
+  CHECK(sr_portblock_init(&pb, LO, LO + 3 * SR_PORTBLOCK_SZ + 100, 16, on_block, NULL) == 0);
+  CHECK(sr_portblock_capacity(&pb) == 3 * SR_PORTBLOCK_SZ);
+
+  /* host 1 fills one block, then gets a second */
+  for (i = 0; i < 2 * SR_PORTBLOCK_SZ; i++) {
+    ports[i] = sr_portblock_get(&pb, 1, 0);
+    CHECK(ports[i] >= LO && ports[i] < LO + 3 * SR_PORTBLOCK_SZ);
+    CHECK(block_of(ports[i]) == block_of(ports[i < SR_PORTBLOCK_SZ ? 0 : SR_PORTBLOCK_SZ]));
+  }
+  CHECK(block_of(ports[0]) != block_of(ports[SR_PORTBLOCK_SZ]));
+  CHECK(assigned == 2);
+  CHECK(pb.in_use[0] == 2 * SR_PORTBLOCK_SZ);
+
+  /* the other kind shares the host's blocks */
+  port = sr_portblock_get(&pb, 1, 1);
+  CHECK(block_of(port) == block_of(ports[0]) || block_of(port) == block_of(ports[SR_PORTBLOCK_SZ]));
+  sr_portblock_put(&pb, 1, 1, (uint16_t) port);
+
+  /* host 2 takes the last block, host 3 finds none */
+  port = sr_portblock_get(&pb, 2, 0);
+  CHECK(port >= 0);
+  CHECK(sr_portblock_get(&pb, 3, 0) == -1);
+  CHECK(pb.exhausted[0] == 1);
+
+  /* emptying host 1's second block gives it back */
+  sr_portblock_put(&pb, 1, 0, (uint16_t) ports[SR_PORTBLOCK_SZ]);
+  sr_portblock_put(&pb, 1, 0, (uint16_t) ports[SR_PORTBLOCK_SZ]);  /* ignored */
+  sr_portblock_put(&pb, 2, 0, (uint16_t) ports[SR_PORTBLOCK_SZ + 1]);  /* not host 2's */
+  CHECK(released == 0);
+  for (i = SR_PORTBLOCK_SZ + 1; i < 2 * SR_PORTBLOCK_SZ; i++) {
+    sr_portblock_put(&pb, 1, 0, (uint16_t) ports[i]);
+  }
+  CHECK(released == 1);
+  port = sr_portblock_get(&pb, 3, 0);
+  CHECK(block_of(port) == block_of(ports[SR_PORTBLOCK_SZ]));
+  sr_portblock_destroy(&pb);
+
+  /* one host never holds more than SR_PORTBLOCK_PER_HOST blocks */
+  assigned = released = 0;
+  CHECK(sr_portblock_init(&pb, LO, LO + 8 * SR_PORTBLOCK_SZ - 1, 16, on_block, NULL) == 0);
+  for (i = 0; i < SR_PORTBLOCK_PER_HOST * SR_PORTBLOCK_SZ; i++) {
+    CHECK(sr_portblock_get(&pb, 7, 0) >= 0);
+  }
+  CHECK(sr_portblock_get(&pb, 7, 0) == -1);
+  CHECK(assigned == SR_PORTBLOCK_PER_HOST);
+  CHECK(sr_portblock_get(&pb, 8, 0) >= 0);
+  sr_portblock_destroy(&pb);
+
+  /* a claim takes its block for the claiming host only */
+  CHECK(sr_portblock_init(&pb, LO, LO + 3 * SR_PORTBLOCK_SZ - 1, 16, NULL, NULL) == 0);
+  port = LO + 2 * SR_PORTBLOCK_SZ + 17;
+  CHECK(sr_portblock_claim(&pb, 1, 0, (uint16_t) port) == 0);
+  CHECK(sr_portblock_claim(&pb, 1, 0, (uint16_t) port) == -1);
+  CHECK(sr_portblock_claim(&pb, 2, 0, (uint16_t)(port + 1)) == -1);
+  CHECK(sr_portblock_claim(&pb, 1, 0, (uint16_t)(port + 1)) == 0);
+  sr_portblock_settle(&pb);
+  for (i = 0; i < 2 * SR_PORTBLOCK_SZ; i++) {
+    block = block_of(sr_portblock_get(&pb, 2 + i / SR_PORTBLOCK_SZ, 0));
+    CHECK(block == 0 || block == 1);
+  }
+  CHECK(sr_portblock_get(&pb, 9, 0) == -1);
+  sr_portblock_destroy(&pb);
+
+  /* a reserved port is skipped whoever holds its block */
+  CHECK(sr_portblock_init(&pb, LO, LO + 2 * SR_PORTBLOCK_SZ - 1, 16, NULL, NULL) == 0);
+  sr_portblock_reserve(&pb, 0, LO + 5);
+  for (i = 0; i < SR_PORTBLOCK_SZ - 1; i++) {
+    port = sr_portblock_get(&pb, 1, 0);
+    CHECK(block_of(port) == 0 && port != LO + 5);
+  }
+  CHECK(block_of(sr_portblock_get(&pb, 1, 0)) == 1);
+  CHECK(sr_portblock_claim(&pb, 1, 0, LO + 5) == -1);
+  sr_portblock_unreserve(&pb, 0, LO + 5);
+  CHECK(sr_portblock_claim(&pb, 1, 0, LO + 5) == 0);
+  sr_portblock_destroy(&pb);
+
+  return SR_TEST_DONE("sr_portblock");
+}
@@ -0,0 +1,53 @@
+/* sr_synhold: the fixed pool, duplicates, cancellation and expiry order. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sr_synhold.h"
+#include "sr_test.h"
+
+int main(void) {
+  struct sr_synhold sh;
+  uint8_t pkt[200], buf[SR_SYNHOLD_PKT];
+  unsigned i;
+
+  for (i = 0; i < sizeof(pkt); i++) {
+    pkt[i] = (uint8_t) i;
+  }
+  CHECK(sr_synhold_init(&sh, 3) == 0);
+  pkt[0] = 1;
+  CHECK(sr_synhold_add(&sh, 1, 100, 50, 80, pkt, 60, 10) == 1);
+  pkt[0] = 2;
+  CHECK(sr_synhold_add(&sh, 2, 200, 50, 80, pkt, 60, 11) == 1);
+  pkt[0] = 3;
+  CHECK(sr_synhold_add(&sh, 3, 300, 50, 80, pkt, sizeof(pkt), 12) == 1);
+  CHECK(sh.count == 3);
+
+  /* a retransmission is taken but keeps the first deadline; the pool is
+     full for anything new */
+  CHECK(sr_synhold_add(&sh, 1, 100, 50, 80, pkt, 60, 20) == 1);
+  CHECK(sh.duplicates == 1);
+  CHECK(sr_synhold_add(&sh, 4, 400, 50, 80, pkt, 60, 12) == 0);
+  CHECK(sh.dropped == 1);
+
+  /* a SYN from inside answers the held one; its entry is free again */
+  CHECK(sr_synhold_cancel(&sh, 2, 200) == 1);
+  CHECK(sr_synhold_cancel(&sh, 2, 200) == 0);
+  pkt[0] = 4;
+  CHECK(sr_synhold_add(&sh, 4, 400, 50, 80, pkt, 60, 13) == 1);
+
+  /* expiry in arrival order, only once due, head of the packet only */
+  CHECK(sr_synhold_expire(&sh, 9, buf) == 0);
+  CHECK(sr_synhold_expire(&sh, 10, buf) == 60);
+  CHECK(buf[0] == 1);
+  CHECK(sr_synhold_expire(&sh, 10, buf) == 0);
+  CHECK(sr_synhold_expire(&sh, 13, buf) == SR_SYNHOLD_PKT);
+  CHECK(buf[0] == 3 && buf[SR_SYNHOLD_PKT - 1] == SR_SYNHOLD_PKT - 1);
+  CHECK(sr_synhold_expire(&sh, 13, buf) == 60);
+  CHECK(buf[0] == 4);
+  CHECK(sr_synhold_expire(&sh, 100, buf) == 0);
+  CHECK(sh.count == 0);
+  CHECK(sh.expired == 3 && sh.cancelled == 1);
+
+  sr_synhold_destroy(&sh);
+  return SR_TEST_DONE("sr_synhold");
+}
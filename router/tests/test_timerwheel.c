@@ -0,0 +1,91 @@
+/* sr_timerwheel: every timer fires exactly at its deadline, across the
+   cascades from the coarser levels. */
+
+#include <stdlib.h>
+#include "sr_timerwheel.h"
+#include "sr_test.h"
+
+/* a few seconds before a level-2 boundary, so every cascade happens */
+#define START ((time_t) 3 * 65536 - 10)
+
+static const time_t offsets[] = {
+  1, 2, 9, 10, 11, 255, 256, 257, 300, 511, 512, 1000,
+  65525, 65526, 65535, 65536, 65537, 70000, 140000, 200000
+};
+#define NTIMERS (sizeof(offsets) / sizeof(offsets[0]))
+
+int main(void) {
+  struct sr_timerwheel w;
+  struct sr_timer timers[NTIMERS], past, cancelled, moved, far, *t;
+  time_t fired[NTIMERS], now, moved_at = 0, past_at = 0, far_at = 0;
+  unsigned i;
+  int cancelled_fired = 0;
+
+  sr_timerwheel_init(&w, START);
+  for (i = 0; i < NTIMERS; i++) {
+    sr_timer_init(&timers[i], 0, &fired[i]);
+    sr_timer_schedule(&w, &timers[i], START + offsets[i]);
+    fired[i] = 0;
+  }
+  sr_timer_init(&past, 1, NULL);
+  sr_timer_schedule(&w, &past, START - 5);
+  sr_timer_init(&cancelled, 2, NULL);
+  sr_timer_schedule(&w, &cancelled, START + 600);
+  sr_timer_init(&moved, 3, NULL);
+  sr_timer_schedule(&w, &moved, START + 50);
+  sr_timer_schedule(&w, &moved, START + 66000);  /* now on a coarser level */
+  sr_timer_init(&far, 4, NULL);
+  sr_timer_schedule(&w, &far, START + ((time_t) 1 << 30));  /* clamped */
+  CHECK(w.count == NTIMERS + 4);
+
+  for (now = START + 1; w.count > 0 && now <= START + (1 << 24); now++) {
+    if (now == START + 500) {
+      sr_timer_cancel(&w, &cancelled);
+      CHECK(!cancelled.pending);
+    }
+    for (t = sr_timerwheel_advance(&w, now); t; t = t->next) {
+      CHECK(!t->pending);
+      switch (t->kind) {
+        case 0:
+          CHECK(*(time_t *) t->data == 0);
+          *(time_t *) t->data = now;
+          break;
+        case 1:
+          past_at = now;
+          break;
+        case 2:
+          cancelled_fired = 1;
+          break;
+        case 3:
+          moved_at = now;
+          break;
+        case 4:
+          far_at = now;
+          break;
+      }
+    }
+  }
+  for (i = 0; i < NTIMERS; i++) {
+    CHECK(fired[i] == START + offsets[i]);
+  }
+  CHECK(past_at == START + 1);
+  CHECK(!cancelled_fired);
+  CHECK(moved_at == START + 66000);
+  CHECK(far_at == START + (1 << 24) - 1);
+  CHECK(w.count == 0);
+
+  /* one big step returns everything due on the way */
+  sr_timerwheel_init(&w, START);
+  for (i = 0; i < NTIMERS; i++) {
+    sr_timer_init(&timers[i], 0, NULL);
+    sr_timer_schedule(&w, &timers[i], START + offsets[i]);
+  }
+  for (i = 0, t = sr_timerwheel_advance(&w, START + 100000); t; t = t->next) {
+    CHECK(t->expires <= START + 100000);
+    i++;
+  }
+  CHECK(i == NTIMERS - 2);
+  CHECK(w.count == 2);
+
+  return SR_TEST_DONE("sr_timerwheel");
+}